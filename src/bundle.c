@@ -0,0 +1,401 @@
+/**
+ * @file bundle.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ *
+ * Bundle sends all files named by the manifest in one download. The server reads the members one after another
+ * through the stream returned by bundle_open(), the client writes the download to the stream returned by bundle_unpack(),
+ * which creates the members as their data arrive.
+ */
+// fopencookie() of the sent and of the unpacked bundle
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bundle.h"
+
+unsigned bundle_count = 0;
+bool bundle_complete = false;
+
+/* Sends the members of the bundle, each of them is opened once the previous one was sent */
+typedef struct
+{
+    char names[BUNDLE_FILES][BUNDLE_NAME + 1];
+    off_t sizes[BUNDLE_FILES];
+    unsigned count;
+    unsigned index; /* Next member, count for the end of the bundle */
+    FILE *cur;
+    off_t left; /* Data of the current member that were not read yet */
+    uint8_t head[BUNDLE_ENTRY + BUNDLE_NAME];
+    size_t hpos;
+    size_t hlen;
+} bundle_reader;
+
+/* Creates the members of the received bundle */
+typedef struct
+{
+    char *dir;
+    uint8_t head[BUNDLE_ENTRY + BUNDLE_NAME + 1]; /* Magic, then the entry of the member with its name */
+    size_t nhead;
+    bool started;
+    FILE *cur;
+    char path[PATH_MAX];
+    uint64_t size;
+    uint64_t left;
+} bundle_writer;
+
+/**
+ * @brief Fills the header of the member, the empty name ends the bundle
+ * @param b Reader
+ * @param name Name of the member
+ * @param size Size of the member
+ */
+static void bundle_entry(bundle_reader *b, char *name, off_t size)
+{
+    uint16_t len = htobe16(strlen(name));
+    uint64_t be = htobe64(size);
+    memcpy(b->head, &len, 2);
+    memcpy(b->head + 2, &be, 8);
+    memcpy(b->head + BUNDLE_ENTRY, name, strlen(name));
+    b->hpos = 0;
+    b->hlen = BUNDLE_ENTRY + strlen(name);
+}
+
+/**
+ * @brief Reads the bundle, a member that got shorter since the manifest was read ends the download with an error
+ * @param cookie Reader
+ * @param buf Buffer of the stream
+ * @param size Size of the buffer
+ * @return Number of the read bytes, 0 at the end, -1 if the member can not be read
+ */
+static ssize_t bundle_read(void *cookie, char *buf, size_t size)
+{
+    bundle_reader *b = cookie;
+    size_t done = 0;
+    while (done < size)
+    {
+        if (b->hpos < b->hlen)
+        {
+            size_t n = b->hlen - b->hpos < size - done ? b->hlen - b->hpos : size - done;
+            memcpy(buf + done, b->head + b->hpos, n);
+            b->hpos += n;
+            done += n;
+            continue;
+        }
+        if (b->left > 0)
+        {
+            size_t want = (off_t)(size - done) < b->left ? size - done : (size_t)b->left;
+            size_t n = fread(buf + done, 1, want, b->cur);
+            if (n == 0)
+            {
+                return -1;
+            }
+            b->left -= n;
+            done += n;
+            continue;
+        }
+        if (b->cur != NULL)
+        {
+            fclose(b->cur);
+            b->cur = NULL;
+        }
+        if (b->index > b->count)
+        {
+            break;
+        }
+        if (b->index == b->count)
+        {
+            bundle_entry(b, "", 0);
+            b->index++;
+            continue;
+        }
+        // Member grown since the manifest was read is sent only up to its announced size
+        b->cur = fopen(b->names[b->index], "rb");
+        if (b->cur == NULL)
+        {
+            return -1;
+        }
+        bundle_entry(b, b->names[b->index], b->sizes[b->index]);
+        b->left = b->sizes[b->index];
+        b->index++;
+    }
+    return done;
+}
+
+/**
+ * @brief Frees the reader and closes the member that was being sent
+ * @param cookie Reader
+ * @return 0
+ */
+static int bundle_close(void *cookie)
+{
+    bundle_reader *b = cookie;
+    if (b->cur != NULL)
+    {
+        fclose(b->cur);
+    }
+    free(b);
+    return 0;
+}
+
+/**
+ * @brief Checks that the member stays inside the directory, the server checks the manifest and the client the received headers
+ * @param name Name of the member
+ * @return True if the name is relative and has no .. component
+ */
+bool bundle_name_valid(char *name)
+{
+    if (name[0] == '\0' || name[0] == '/')
+    {
+        return false;
+    }
+    for (char *part = name; part != NULL; part = strchr(part, '/'))
+    {
+        part += part[0] == '/';
+        if (!strncmp(part, "..", 2) && (part[2] == '/' || part[2] == '\0'))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Reads the manifest and opens the stream of the bundle. The manifest names one member per line relative
+ *        to the root directory, the empty lines and the lines starting with # are skipped.
+ * @param manifest Path of the manifest
+ * @param size Size of the whole bundle, it is reported as the tsize
+ * @return Stream of the bundle, NULL if the manifest or any of its members can not be read
+ */
+FILE *bundle_open(char *manifest, off_t *size)
+{
+    char line[PATH_MAX];
+    FILE *list = fopen(manifest, "r");
+    bundle_reader *b = calloc(1, sizeof(*b));
+    if (list == NULL || b == NULL)
+    {
+        if (list != NULL)
+        {
+            fclose(list);
+        }
+        free(b);
+        return NULL;
+    }
+    *size = BUNDLE_MAGIC_SIZE + BUNDLE_ENTRY;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), list) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *name = line + strspn(line, " \t");
+        if (name[0] == '\0' || name[0] == '#')
+        {
+            continue;
+        }
+        struct stat info;
+        ok = b->count < BUNDLE_FILES && bundle_name_valid(name) && strlen(name) <= BUNDLE_NAME && stat(name, &info) == 0 && S_ISREG(info.st_mode);
+        if (!ok)
+        {
+            printf("ERROR: Bundle member %s can not be sent\n", name);
+            break;
+        }
+        strcpy(b->names[b->count], name);
+        b->sizes[b->count] = info.st_size;
+        b->count++;
+        *size += BUNDLE_ENTRY + strlen(name) + info.st_size;
+    }
+    fclose(list);
+    cookie_io_functions_t io = {bundle_read, NULL, NULL, bundle_close};
+    FILE *fd = ok ? fopencookie(b, "r", io) : NULL;
+    if (fd == NULL)
+    {
+        free(b);
+        return NULL;
+    }
+    memcpy(b->head, BUNDLE_MAGIC, BUNDLE_MAGIC_SIZE);
+    b->hlen = BUNDLE_MAGIC_SIZE;
+    return fd;
+}
+
+/**
+ * @brief Creates the member whose header was received, the directories in its name are created first
+ * @param w Writer with the whole header
+ * @return False if the member can not be created
+ */
+static bool bundle_create(bundle_writer *w)
+{
+    uint16_t len;
+    uint64_t size;
+    memcpy(&len, w->head, 2);
+    memcpy(&size, w->head + 2, 8);
+    char *name = (char *)w->head + BUNDLE_ENTRY;
+    name[be16toh(len)] = '\0';
+    if (!bundle_name_valid(name) || snprintf(w->path, sizeof(w->path), "%s/%s", w->dir, name) >= (int)sizeof(w->path))
+    {
+        printf("ERROR: Invalid bundle member %s\n", name);
+        return false;
+    }
+    for (char *sep = strchr(w->path + strlen(w->dir) + 1, '/'); sep != NULL; sep = strchr(sep + 1, '/'))
+    {
+        *sep = '\0';
+        bool made = mkdir(w->path, 0755) == 0 || errno == EEXIST;
+        *sep = '/';
+        if (!made)
+        {
+            return false;
+        }
+    }
+    w->cur = fopen(w->path, "wb");
+    w->size = w->left = be64toh(size);
+    return w->cur != NULL;
+}
+
+/**
+ * @brief Closes the member once all its data were written
+ * @param w Writer
+ * @return False if the member can not be written
+ */
+static bool bundle_finish(bundle_writer *w)
+{
+    bool ok = fclose(w->cur) == 0;
+    w->cur = NULL;
+    if (ok)
+    {
+        bundle_count++;
+        printf("BUNDLE %s %llu\n", w->path, (unsigned long long)w->size);
+    }
+    return ok;
+}
+
+/**
+ * @brief Writes the received part of the bundle, the headers can be split between the blocks
+ * @param cookie Writer
+ * @param buf Part of the bundle
+ * @param size Size of the part
+ * @return Size of the part, -1 if the bundle is malformed or the member can not be written
+ */
+static ssize_t bundle_write(void *cookie, const char *buf, size_t size)
+{
+    bundle_writer *w = cookie;
+    size_t used = 0;
+    while (used < size)
+    {
+        if (bundle_complete)
+        {
+            // Nothing follows the end of the bundle
+            return -1;
+        }
+        if (w->cur != NULL)
+        {
+            size_t n = w->left < size - used ? w->left : size - used;
+            if (fwrite(buf + used, 1, n, w->cur) != n)
+            {
+                return -1;
+            }
+            w->left -= n;
+            used += n;
+            if (w->left == 0 && !bundle_finish(w))
+            {
+                return -1;
+            }
+            continue;
+        }
+        uint16_t len;
+        memcpy(&len, w->head, 2);
+        if (w->started && w->nhead >= BUNDLE_ENTRY && be16toh(len) > BUNDLE_NAME)
+        {
+            return -1;
+        }
+        size_t need = !w->started ? BUNDLE_MAGIC_SIZE : w->nhead < BUNDLE_ENTRY ? BUNDLE_ENTRY : BUNDLE_ENTRY + be16toh(len);
+        size_t n = need - w->nhead < size - used ? need - w->nhead : size - used;
+        memcpy(w->head + w->nhead, buf + used, n);
+        w->nhead += n;
+        used += n;
+        if (w->nhead < need)
+        {
+            continue;
+        }
+        if (!w->started)
+        {
+            if (memcmp(w->head, BUNDLE_MAGIC, BUNDLE_MAGIC_SIZE) != 0)
+            {
+                return -1;
+            }
+            w->started = true;
+            w->nhead = 0;
+            continue;
+        }
+        memcpy(&len, w->head, 2);
+        if (len == 0)
+        {
+            bundle_complete = true;
+            w->nhead = 0;
+            continue;
+        }
+        if (need == BUNDLE_ENTRY)
+        {
+            // Name of the member follows its entry
+            continue;
+        }
+        w->nhead = 0;
+        if (!bundle_create(w) || (w->left == 0 && !bundle_finish(w)))
+        {
+            return -1;
+        }
+    }
+    return size;
+}
+
+/**
+ * @brief Closes the writer, the member that did not arrive whole is removed
+ * @param cookie Writer
+ * @return 0 if the whole bundle was received, -1 otherwise
+ */
+static int bundle_unpack_close(void *cookie)
+{
+    bundle_writer *w = cookie;
+    if (w->cur != NULL)
+    {
+        fclose(w->cur);
+        unlink(w->path);
+    }
+    free(w);
+    return bundle_complete ? 0 : -1;
+}
+
+/**
+ * @brief Opens the stream that unpacks the downloaded bundle, it replaces the destination file of the download
+ * @param dir Directory the members are created in, it is created if it does not exist
+ * @return Stream of the bundle, NULL if the directory can not be created
+ */
+FILE *bundle_unpack(char *dir)
+{
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        return NULL;
+    }
+    bundle_writer *w = calloc(1, sizeof(*w));
+    if (w == NULL)
+    {
+        return NULL;
+    }
+    w->dir = dir;
+    bundle_count = 0;
+    bundle_complete = false;
+    cookie_io_functions_t io = {NULL, bundle_write, NULL, bundle_unpack_close};
+    FILE *fd = fopencookie(w, "w", io);
+    if (fd == NULL)
+    {
+        free(w);
+        return NULL;
+    }
+    // Every received block goes straight to its member
+    setvbuf(fd, NULL, _IONBF, 0);
+    return fd;
+}
@@ -0,0 +1,33 @@
+/**
+ * @file bundle.h
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#ifndef BUNDLE_H
+#define BUNDLE_H
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Bundle starts with the magic, every member then has the length of its name (2 bytes), its size (8 bytes),
+   the name and the data. Entry with the empty name ends the bundle. All numbers are in network order. */
+#define BUNDLE_MAGIC "TBN1"
+#define BUNDLE_MAGIC_SIZE 4
+#define BUNDLE_ENTRY 10
+
+/* Longest name of the member and the largest number of the members of one bundle */
+#define BUNDLE_NAME 255
+#define BUNDLE_FILES 256
+
+/* Number of the members the client unpacked and whether it received the end of the bundle */
+extern unsigned bundle_count;
+extern bool bundle_complete;
+
+bool bundle_name_valid(char *name);
+
+FILE *bundle_open(char *manifest, off_t *size);
+
+FILE *bundle_unpack(char *dir);
+
+#endif
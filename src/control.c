@@ -0,0 +1,304 @@
+/**
+ * @file control.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "control.h"
+#include "sessions.h"
+#include "profiles.h"
+#include "trace.h"
+#include "messages.h"
+#include "tftp-server.h"
+
+int control_fd = -1;
+
+/**
+ * @brief Creates the UNIX socket that accepts the commands while the server runs
+ * @param path Path of the socket, the socket left by the previous run of the server is replaced
+ * @return True if the socket listens
+ */
+bool control_open(char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    // Client that closes the connection before the reply must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    control_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (control_fd < 0)
+    {
+        return false;
+    }
+    unlink(path);
+    if (bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(control_fd, 8) < 0)
+    {
+        close(control_fd);
+        control_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Lists the running sessions, the rate is the average since the session started
+ * @param out Reply to the command
+ */
+static void control_list(FILE *out)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sessions_reap();
+    fprintf(out, "slot pid type peer file block bytes rate_Bps rtt_ms age_s\n");
+    for (int i = 0; i < SESSION_SLOTS; i++)
+    {
+        sessions_lock();
+        session_slot s = sessions->sessions[i];
+        sessions_unlock();
+        if (s.pid <= 0)
+        {
+            continue;
+        }
+        char ip_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &s.peer, ip_str, sizeof(ip_str));
+        double age = (now.tv_sec - s.started.tv_sec) + (now.tv_nsec - s.started.tv_nsec) / 1e9;
+        char *type = s.multicast ? "MC" : s.opcode == WRQ ? "WRQ" : s.opcode == RRQ ? "RRQ" : "-";
+        fprintf(out, "%d %d %s %s %s %llu %llu %.0f %.3f %.1f\n", i, (int)s.pid, type, ip_str, s.file[0] ? s.file : "-",
+                (unsigned long long)s.block, s.bytes, age > 0 ? s.bytes / age : 0, s.rtt * 1000, age);
+    }
+}
+
+/**
+ * @brief Prints the current limits with the names of the options that set them
+ * @param out Reply to the command
+ */
+static void control_limits(FILE *out)
+{
+    sessions_lock();
+    session_limits l = sessions->limits;
+    sessions_unlock();
+    fprintf(out, "max-sessions %d\nmax-per-ip %d\nmax-per-subnet %d\nsubnet-prefix %d\n", l.max_sessions, l.max_per_ip, l.max_per_subnet,
+            l.subnet_prefix);
+    fprintf(out, "max-rps %g\nsession-rate %g\nclient-rate %g\nuplink-rate %g\nsched-aging %g\n", l.max_rps, l.session_rate, l.client_rate,
+            l.uplink_rate, l.sched_aging);
+}
+
+/**
+ * @brief Changes the limit, the sessions read the limits from the shared table before every block
+ * @param name Name of the option that sets the limit
+ * @param value New value of the limit
+ * @return Error message, NULL if the limit was changed
+ */
+static char *control_limit(char *name, char *value)
+{
+    session_limits *l = &sessions->limits;
+    char *end;
+    long count = strtol(value, &end, 10);
+    bool is_count = end != value && *end == '\0' && count >= 0;
+    double rate = parse_rate(value);
+    char *error = NULL;
+    sessions_lock();
+    if (!strcmp(name, "max-sessions") || !strcmp(name, "max-per-ip") || !strcmp(name, "max-per-subnet"))
+    {
+        int *limit = !strcmp(name, "max-sessions") ? &l->max_sessions : !strcmp(name, "max-per-ip") ? &l->max_per_ip : &l->max_per_subnet;
+        if (is_count && count <= SESSION_SLOTS)
+        {
+            // Running sessions over the lowered limit continue, only the new requests are rejected
+            *limit = (int)count;
+        }
+        else
+        {
+            error = "ERROR: Invalid limit";
+        }
+    }
+    else if (!strcmp(name, "subnet-prefix"))
+    {
+        if (is_count && count <= 32)
+        {
+            l->subnet_prefix = (int)count;
+        }
+        else
+        {
+            error = "ERROR: Invalid subnet prefix";
+        }
+    }
+    else if (!strcmp(name, "max-rps") || !strcmp(name, "session-rate") || !strcmp(name, "client-rate") || !strcmp(name, "uplink-rate"))
+    {
+        double *limit = !strcmp(name, "max-rps")        ? &l->max_rps
+                        : !strcmp(name, "session-rate") ? &l->session_rate
+                        : !strcmp(name, "client-rate")  ? &l->client_rate
+                                                        : &l->uplink_rate;
+        if (rate >= 0)
+        {
+            *limit = rate;
+        }
+        else
+        {
+            error = "ERROR: Invalid rate";
+        }
+    }
+    else if (!strcmp(name, "sched-aging"))
+    {
+        if (rate > 0)
+        {
+            l->sched_aging = rate;
+        }
+        else
+        {
+            error = "ERROR: Invalid aging";
+        }
+    }
+    else
+    {
+        error = "ERROR: Unknown limit";
+    }
+    sessions_unlock();
+    return error;
+}
+
+/**
+ * @brief Stops the session, its process sends ERROR to the client and removes its partial upload
+ * @param slot Slot of the session from the list
+ * @return Error message, NULL if the session was signalled
+ */
+static char *control_cancel(char *slot)
+{
+    char *end;
+    long i = strtol(slot, &end, 10);
+    if (end == slot || *end != '\0' || i < 0 || i >= SESSION_SLOTS)
+    {
+        return "ERROR: Invalid slot";
+    }
+    sessions_lock();
+    pid_t pid = sessions->sessions[i].pid;
+    sessions_unlock();
+    if (pid <= 0 || kill(pid, SIGTERM) < 0)
+    {
+        return "ERROR: No such session";
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs one command
+ * @param line Command without the line end
+ * @param out Reply to the command
+ * @return Error message, NULL if the command succeeded
+ */
+static char *control_command(char *line, FILE *out)
+{
+    char *argv[4] = {NULL, NULL, NULL, NULL};
+    int argc = 0;
+    for (char *tok = strtok(line, " \t"); tok != NULL && argc < 4; tok = strtok(NULL, " \t"))
+    {
+        argv[argc++] = tok;
+    }
+    if (argc == 0)
+    {
+        return "ERROR: Empty command";
+    }
+    if (!strcmp(argv[0], "list") && argc == 1)
+    {
+        control_list(out);
+        return NULL;
+    }
+    if (!strcmp(argv[0], "cancel") && argc == 2)
+    {
+        return control_cancel(argv[1]);
+    }
+    if (!strcmp(argv[0], "limits") && argc == 1)
+    {
+        control_limits(out);
+        return NULL;
+    }
+    if (!strcmp(argv[0], "limit") && argc == 3)
+    {
+        return control_limit(argv[1], argv[2]);
+    }
+    if (!strcmp(argv[0], "flush") && argc <= 2)
+    {
+        bool all = argc == 1;
+        if (all || !strcmp(argv[1], "cache"))
+        {
+            fprintf(out, "cache %d\n", cache_flush());
+        }
+        if (all || !strcmp(argv[1], "profiles"))
+        {
+            profiles_clear();
+            profiles_save(true);
+            fprintf(out, "profiles cleared\n");
+        }
+        return all || !strcmp(argv[1], "cache") || !strcmp(argv[1], "profiles") ? NULL : "ERROR: Unknown cache";
+    }
+    if (!strcmp(argv[0], "trace") && argc >= 2 && argc <= 3)
+    {
+        bool on = !strcmp(argv[1], "on");
+        if ((!on && strcmp(argv[1], "off")) || (!on && argc == 3))
+        {
+            return "ERROR: Use trace on [file] or trace off";
+        }
+        // Relative path is relative to the root directory of the server
+        if (argc == 3 && !trace_open(argv[2]))
+        {
+            return "ERROR: Can not open the trace file";
+        }
+        return trace_enable(on) ? NULL : "ERROR: No trace file";
+    }
+    fprintf(out, "commands: list | cancel SLOT | limits | limit NAME VALUE | flush [cache|profiles] | trace on [FILE] | trace off\n");
+    return !strcmp(argv[0], "help") ? NULL : "ERROR: Unknown command";
+}
+
+/**
+ * @brief Accepts the connection to the control socket and answers its command.
+ *        The main server process stops receiving the requests meanwhile, so the silent connection is dropped after a second.
+ */
+void control_handle()
+{
+    int conn = accept(control_fd, NULL, NULL);
+    if (conn < 0)
+    {
+        return;
+    }
+    struct timeval tv = {1, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char line[CONTROL_LINE];
+    size_t len = 0;
+    while (len < sizeof(line) - 1)
+    {
+        ssize_t n = read(conn, line + len, sizeof(line) - 1 - len);
+        if (n <= 0)
+        {
+            break;
+        }
+        len += n;
+        if (memchr(line, '\n', len) != NULL)
+        {
+            break;
+        }
+    }
+    line[len] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+    FILE *out = fdopen(conn, "w");
+    if (out == NULL)
+    {
+        close(conn);
+        return;
+    }
+    char *error = control_command(line, out);
+    fprintf(out, "%s\n", error != NULL ? error : "OK");
+    fclose(out);
+}
@@ -0,0 +1,21 @@
+/**
+ * @file control.h
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#ifndef CONTROL_H
+#define CONTROL_H
+#include <stdbool.h>
+
+/* Longest command accepted on the control socket */
+#define CONTROL_LINE 512
+
+/* Listening control socket of the main server process, -1 if it is not used */
+extern int control_fd;
+
+bool control_open(char *path);
+
+void control_handle();
+
+#endif
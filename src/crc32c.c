@@ -0,0 +1,124 @@
+/**
+ * @file crc32c.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ *
+ * CRC32C (Castagnoli) used for the end to end checksum of the transfers. On x86-64 processors with SSE4.2 the crc32
+ * instruction is used, otherwise the slicing-by-8 table implementation. The implementation is chosen on the first call.
+ */
+#include <string.h>
+#include "crc32c.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78u
+
+static uint32_t table[8][256];
+
+/**
+ * @brief Fills the tables of the slicing-by-8 implementation
+ */
+static void crc32c_table_init()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+        {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+        }
+    }
+}
+
+/**
+ * @brief Table implementation processing 8 bytes per step
+ * @param crc Inverted CRC of the previous data
+ * @param p Data
+ * @param len Size of the data
+ * @return Inverted CRC including the data
+ */
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len >= 8)
+    {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+    {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief Implementation using the crc32 instruction of SSE4.2
+ * @param crc Inverted CRC of the previous data
+ * @param p Data
+ * @param len Size of the data
+ * @return Inverted CRC including the data
+ */
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c = crc;
+    while (len >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+    {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    }
+    return (uint32_t)c;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t crc, const uint8_t *p, size_t len) = NULL;
+
+/**
+ * @brief Continues the CRC32C with more data
+ * @param crc CRC32C of the previous data, 0 for the first call
+ * @param buf Data
+ * @param len Size of the data
+ * @return CRC32C including the data
+ */
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len)
+{
+    if (crc32c_impl == NULL)
+    {
+        crc32c_table_init();
+        crc32c_impl = crc32c_table;
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("sse4.2"))
+        {
+            crc32c_impl = crc32c_sse42;
+        }
+#endif
+    }
+    return ~crc32c_impl(~crc, buf, len);
+}
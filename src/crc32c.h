@@ -0,0 +1,14 @@
+/**
+ * @file crc32c.h
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#ifndef CRC32C_H
+#define CRC32C_H
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,729 @@
+/**
+ * @file delta.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ *
+ * Delta upload against the base file the server already has. The server sends the rolling and the strong signature
+ * of every chunk of the base, the client slides the rolling signature over the uploaded file byte by byte and sends
+ * the chunks found in the base as copy operations, everything else as literal bytes (the rsync algorithm).
+ */
+// fopencookie() of the encoded upload
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "delta.h"
+#include "crc32c.h"
+
+// Chunks with the same hash of the rolling signature compared before the byte is sent as a literal
+#define DELTA_CHAIN 32
+
+unsigned long long delta_literal = 0;
+unsigned long long delta_copied = 0;
+
+/* Encodes the uploaded file against the signatures of the base, read through the stream returned by delta_source() */
+typedef struct
+{
+    FILE *in;
+    uint32_t chunk;
+    uint32_t count;
+    uint64_t base_size;
+    uint32_t base_crc;
+    uint32_t *weak;
+    uint64_t *strong;
+    uint32_t *bucket; /* First chunk with the hash plus one, 0 if there is none */
+    uint32_t *next;   /* Next chunk with the same hash plus one */
+    int shift;
+    uint8_t *buf; /* Read part of the file, the literal bytes start at lit and the compared chunk at start */
+    size_t cap;
+    size_t lit;
+    size_t start;
+    size_t end;
+    bool eof;
+    bool rolled; /* True if the sums belong to the chunk at start */
+    uint32_t a;
+    uint32_t b;
+    uint32_t copy_index; /* Copied chunks that were not sent yet */
+    uint32_t copy_count;
+    uint32_t crc;
+    uint8_t *out; /* Encoded operations waiting to be read */
+    size_t out_len;
+    size_t out_pos;
+    bool done;
+} delta_encoder;
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+    put32(p, v >> 32);
+    put32(p + 4, (uint32_t)v);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+    return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+/**
+ * @brief Computes the sums of the rolling signature, they can be moved by one byte without reading the chunk again
+ * @param data Chunk
+ * @param len Size of the chunk
+ * @param a Sum of the bytes
+ * @param b Sum of the bytes weighted by their distance from the end of the chunk
+ */
+static void delta_sums(const uint8_t *data, size_t len, uint32_t *a, uint32_t *b)
+{
+    uint32_t s1 = 0, s2 = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        s1 += data[i];
+        s2 += s1;
+    }
+    *a = s1;
+    *b = s2;
+}
+
+static uint32_t delta_weak(uint32_t a, uint32_t b)
+{
+    return (b & 0xffff) << 16 | (a & 0xffff);
+}
+
+/**
+ * @brief Computes the strong signature, it confirms the match of the rolling signature.
+ *        It is not cryptographic, the checksum of the reconstructed file catches a collision.
+ * @param data Chunk
+ * @param len Size of the chunk
+ * @return Signature, the same on the server and the client regardless of their byte order
+ */
+static uint64_t delta_strong(const uint8_t *data, size_t len)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w = 0;
+        for (int k = 7; k >= 0; k--)
+        {
+            w = w << 8 | data[i + k];
+        }
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    uint64_t w = 0;
+    for (size_t k = len; k > i; k--)
+    {
+        w = w << 8 | data[k - 1];
+    }
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    return h ^ (uint64_t)crc32c_update(0, data, len) << 32;
+}
+
+/**
+ * @brief Returns the size of the signatures of the file, it is reported as the tsize of the download of the signatures
+ * @param size Size of the base file
+ * @param chunk Chunk size
+ * @return Size of the signatures
+ */
+off_t delta_signature_size(off_t size, uint32_t chunk)
+{
+    return SIGNATURE_HEADER + SIGNATURE_ENTRY * ((size + chunk - 1) / chunk);
+}
+
+/**
+ * @brief Computes the signatures of every chunk of the base file
+ * @param base Base file, it is read from its current position
+ * @param chunk Chunk size
+ * @return Temporary file with the signatures positioned at its start, NULL if error occurs
+ */
+FILE *delta_signatures(FILE *base, uint32_t chunk)
+{
+    FILE *out = tmpfile();
+    uint8_t *buf = malloc(chunk);
+    uint8_t head[SIGNATURE_HEADER], entry[SIGNATURE_ENTRY];
+    uint64_t size = 0;
+    uint32_t crc = 0, count = 0;
+    size_t n;
+    memset(head, 0, sizeof(head));
+    // Header is written again once the size and the checksum of the base are known
+    bool ok = out != NULL && buf != NULL && fwrite(head, 1, sizeof(head), out) == sizeof(head);
+    while (ok && (n = fread(buf, 1, chunk, base)) > 0)
+    {
+        uint32_t a, b;
+        delta_sums(buf, n, &a, &b);
+        put32(entry, delta_weak(a, b));
+        put64(entry + 4, delta_strong(buf, n));
+        crc = crc32c_update(crc, buf, n);
+        size += n;
+        count++;
+        ok = fwrite(entry, 1, sizeof(entry), out) == sizeof(entry);
+    }
+    memcpy(head, SIGNATURE_MAGIC, 4);
+    put32(head + 4, chunk);
+    put64(head + 8, size);
+    put32(head + 16, crc);
+    put32(head + 20, count);
+    ok = ok && !ferror(base) && fseeko(out, 0, SEEK_SET) == 0 && fwrite(head, 1, sizeof(head), out) == sizeof(head);
+    ok = ok && fflush(out) == 0 && fseeko(out, 0, SEEK_SET) == 0;
+    free(buf);
+    if (!ok && out != NULL)
+    {
+        fclose(out);
+    }
+    return ok ? out : NULL;
+}
+
+static uint32_t delta_hash(delta_encoder *e, uint32_t weak)
+{
+    return (weak * 2654435761u) >> e->shift;
+}
+
+/**
+ * @brief Reads more of the file once the chunk and the byte that follows it are not in the buffer
+ * @param e Encoder
+ * @return False if the file can not be read
+ */
+static bool delta_fill(delta_encoder *e)
+{
+    if (e->eof || e->end - e->start > e->chunk)
+    {
+        return true;
+    }
+    if (e->lit > 0)
+    {
+        // Literal bytes that were not sent yet stay in the buffer
+        memmove(e->buf, e->buf + e->lit, e->end - e->lit);
+        e->start -= e->lit;
+        e->end -= e->lit;
+        e->lit = 0;
+    }
+    size_t want = e->cap - e->end;
+    size_t n = fread(e->buf + e->end, 1, want, e->in);
+    e->crc = crc32c_update(e->crc, e->buf + e->end, n);
+    e->end += n;
+    e->eof = n < want;
+    return !ferror(e->in);
+}
+
+/**
+ * @brief Moves the literal bytes before the compared chunk to the output
+ * @param e Encoder
+ */
+static void delta_flush_literal(delta_encoder *e)
+{
+    size_t len = e->start - e->lit;
+    if (len == 0)
+    {
+        return;
+    }
+    uint8_t *p = e->out + e->out_len;
+    p[0] = DELTA_LITERAL;
+    put32(p + 1, len);
+    memcpy(p + 5, e->buf + e->lit, len);
+    e->out_len += 5 + len;
+    e->lit = e->start;
+    delta_literal += len;
+}
+
+/**
+ * @brief Moves the run of the copied chunks to the output
+ * @param e Encoder
+ */
+static void delta_flush_copy(delta_encoder *e)
+{
+    if (e->copy_count == 0)
+    {
+        return;
+    }
+    uint8_t *p = e->out + e->out_len;
+    p[0] = DELTA_COPY;
+    put32(p + 1, e->copy_index);
+    put32(p + 5, e->copy_count);
+    e->out_len += 9;
+    e->copy_count = 0;
+}
+
+/**
+ * @brief Copies the chunk of the base instead of sending the compared bytes, the next chunk of the base extends the run
+ * @param e Encoder
+ * @param index Matching chunk of the base
+ * @param len Size of the chunk
+ */
+static void delta_copy(delta_encoder *e, uint32_t index, size_t len)
+{
+    delta_flush_literal(e);
+    if (e->copy_count > 0 && index == e->copy_index + e->copy_count)
+    {
+        e->copy_count++;
+    }
+    else
+    {
+        delta_flush_copy(e);
+        e->copy_index = index;
+        e->copy_count = 1;
+    }
+    e->start += len;
+    e->lit = e->start;
+    e->rolled = false;
+    delta_copied += len;
+}
+
+/**
+ * @brief Compares the chunk of the base with the bytes at the start of the compared chunk
+ * @param e Encoder
+ * @param index Chunk of the base
+ * @param weak Rolling signature of the compared bytes
+ * @param strong Strong signature of the compared bytes, computed on the first call
+ * @param hashed True once the strong signature is computed
+ * @param len Number of the compared bytes
+ * @return True if both signatures match
+ */
+static bool delta_equal(delta_encoder *e, uint32_t index, uint32_t weak, uint64_t *strong, bool *hashed, size_t len)
+{
+    if (e->weak[index] != weak)
+    {
+        return false;
+    }
+    if (!*hashed)
+    {
+        *strong = delta_strong(e->buf + e->start, len);
+        *hashed = true;
+    }
+    return e->strong[index] == *strong;
+}
+
+/**
+ * @brief Looks up the compared chunk among the chunks of the base
+ * @param e Encoder
+ * @param index Matching chunk
+ * @return True if the chunk was found
+ */
+static bool delta_match(delta_encoder *e, uint32_t *index)
+{
+    uint32_t weak = delta_weak(e->a, e->b);
+    uint64_t strong = 0;
+    bool hashed = false;
+    // Chunk that follows the copied ones is the likeliest match, the run of the same chunks is then sent as one operation
+    uint32_t expect = e->copy_index + e->copy_count;
+    if (e->copy_count > 0 && (uint64_t)(expect + 1) * e->chunk <= e->base_size && delta_equal(e, expect, weak, &strong, &hashed, e->chunk))
+    {
+        *index = expect;
+        return true;
+    }
+    uint32_t i = e->bucket[delta_hash(e, weak)];
+    for (int n = 0; i != 0 && n < DELTA_CHAIN; n++, i = e->next[i - 1])
+    {
+        if (delta_equal(e, i - 1, weak, &strong, &hashed, e->chunk))
+        {
+            *index = i - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Encodes the file until some operation is ready to be read
+ * @param e Encoder
+ * @return False if the file can not be read
+ */
+static bool delta_step(delta_encoder *e)
+{
+    while (e->out_len == 0)
+    {
+        if (!delta_fill(e))
+        {
+            return false;
+        }
+        size_t avail = e->end - e->start;
+        if (avail < e->chunk)
+        {
+            // Only the end of the file is shorter than the chunk, it can match just the last chunk of the base
+            uint32_t last = e->count - 1, a, b;
+            uint64_t strong = 0;
+            bool hashed = false;
+            delta_sums(e->buf + e->start, avail, &a, &b);
+            if (avail > 0 && e->count > 0 && e->base_size - (uint64_t)last * e->chunk == avail &&
+                delta_equal(e, last, delta_weak(a, b), &strong, &hashed, avail))
+            {
+                delta_copy(e, last, avail);
+            }
+            e->start = e->end;
+            // Copied run precedes the literal bytes of the end
+            delta_flush_copy(e);
+            delta_flush_literal(e);
+            uint8_t *p = e->out + e->out_len;
+            p[0] = DELTA_END;
+            put32(p + 1, e->crc);
+            e->out_len += 5;
+            e->done = true;
+            return true;
+        }
+        if (!e->rolled)
+        {
+            delta_sums(e->buf + e->start, e->chunk, &e->a, &e->b);
+            e->rolled = true;
+        }
+        uint32_t index;
+        if (delta_match(e, &index))
+        {
+            delta_copy(e, index, e->chunk);
+            continue;
+        }
+        if (e->start == e->lit)
+        {
+            // Copied run ends where the literal bytes start
+            delta_flush_copy(e);
+        }
+        uint8_t out = e->buf[e->start];
+        e->start++;
+        if (e->start + e->chunk <= e->end)
+        {
+            uint8_t in = e->buf[e->start + e->chunk - 1];
+            e->a += in - out;
+            e->b += e->a - e->chunk * out;
+        }
+        else
+        {
+            e->rolled = false;
+        }
+        if (e->start - e->lit >= DELTA_RUN)
+        {
+            delta_flush_literal(e);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Reads the encoded upload
+ * @param cookie Encoder
+ * @param buf Buffer of the stream
+ * @param size Size of the buffer
+ * @return Number of the encoded bytes, 0 at the end, -1 if the file can not be read
+ */
+static ssize_t delta_read(void *cookie, char *buf, size_t size)
+{
+    delta_encoder *e = cookie;
+    if (e->out_pos == e->out_len)
+    {
+        e->out_pos = e->out_len = 0;
+        if (!e->done && !delta_step(e))
+        {
+            return -1;
+        }
+    }
+    size_t n = e->out_len - e->out_pos < size ? e->out_len - e->out_pos : size;
+    memcpy(buf, e->out + e->out_pos, n);
+    e->out_pos += n;
+    return n;
+}
+
+/**
+ * @brief Frees the encoder, the uploaded file stays open
+ * @param cookie Encoder
+ * @return 0
+ */
+static int delta_close(void *cookie)
+{
+    delta_encoder *e = cookie;
+    free(e->weak);
+    free(e->strong);
+    free(e->bucket);
+    free(e->next);
+    free(e->buf);
+    free(e->out);
+    free(e);
+    return 0;
+}
+
+/**
+ * @brief Opens the stream of the delta encoded upload, it replaces stdin of the upload
+ * @param in Uploaded file
+ * @param signatures Signatures of the base file downloaded from the server
+ * @param len Size of the signatures
+ * @return Stream of the delta, NULL if the signatures are malformed or there is not enough memory
+ */
+FILE *delta_source(FILE *in, uint8_t *signatures, size_t len)
+{
+    if (len < SIGNATURE_HEADER || memcmp(signatures, SIGNATURE_MAGIC, 4) != 0)
+    {
+        return NULL;
+    }
+    uint32_t chunk = get32(signatures + 4), count = get32(signatures + 20);
+    uint64_t size = get64(signatures + 8);
+    if (chunk < DELTA_CHUNK_MIN || chunk > DELTA_CHUNK_MAX || count != (size + chunk - 1) / chunk ||
+        len != SIGNATURE_HEADER + (size_t)count * SIGNATURE_ENTRY)
+    {
+        return NULL;
+    }
+    delta_encoder *e = calloc(1, sizeof(*e));
+    if (e == NULL)
+    {
+        return NULL;
+    }
+    e->in = in;
+    e->chunk = chunk;
+    e->count = count;
+    e->base_size = size;
+    e->base_crc = get32(signatures + 16);
+    // Hash table has at least twice as many buckets as there are chunks
+    int bits = 4;
+    while (bits < 31 && ((size_t)1 << bits) < 2 * (size_t)count)
+    {
+        bits++;
+    }
+    e->shift = 32 - bits;
+    e->weak = malloc(count * sizeof(uint32_t) + 1);
+    e->strong = malloc(count * sizeof(uint64_t) + 1);
+    e->next = malloc(count * sizeof(uint32_t) + 1);
+    e->bucket = calloc((size_t)1 << bits, sizeof(uint32_t));
+    e->cap = 2 * DELTA_RUN + 2 * chunk;
+    e->buf = malloc(e->cap);
+    // Longest output is the literal run extended by the end of the file, followed by the end of the stream
+    e->out = malloc(DELTA_RUN + chunk + 64);
+    if (e->weak == NULL || e->strong == NULL || e->next == NULL || e->bucket == NULL || e->buf == NULL || e->out == NULL)
+    {
+        delta_close(e);
+        return NULL;
+    }
+    // Chunks are inserted from the end, so the chain of the same chunks starts with the first of them
+    for (uint32_t i = count; i > 0; i--)
+    {
+        uint8_t *entry = signatures + SIGNATURE_HEADER + (size_t)(i - 1) * SIGNATURE_ENTRY;
+        e->weak[i - 1] = get32(entry);
+        e->strong[i - 1] = get64(entry + 4);
+        if ((uint64_t)i * chunk <= size)
+        {
+            // Short last chunk is not looked up by the rolling signature, only the end of the file can match it
+            uint32_t h = delta_hash(e, e->weak[i - 1]);
+            e->next[i - 1] = e->bucket[h];
+            e->bucket[h] = i;
+        }
+    }
+    memcpy(e->out, DELTA_MAGIC, 4);
+    put32(e->out + 4, chunk);
+    put64(e->out + 8, size);
+    put32(e->out + 16, e->base_crc);
+    e->out_len = DELTA_HEADER;
+    delta_literal = 0;
+    delta_copied = 0;
+    cookie_io_functions_t io = {delta_read, NULL, NULL, delta_close};
+    FILE *fd = fopencookie(e, "r", io);
+    if (fd == NULL)
+    {
+        delta_close(e);
+    }
+    return fd;
+}
+
+/**
+ * @brief Prepares the reconstruction of the upload, the base is checked against the header of the delta
+ * @param base Base file, it is closed by delta_free()
+ * @return Decoder, NULL if there is not enough memory
+ */
+delta_decoder *delta_start(FILE *base)
+{
+    struct stat info;
+    delta_decoder *d = calloc(1, sizeof(*d));
+    if (d == NULL || fstat(fileno(base), &info) < 0 || (d->buf = malloc(DELTA_RUN)) == NULL)
+    {
+        free(d);
+        fclose(base);
+        return NULL;
+    }
+    d->base = base;
+    d->base_size = info.st_size;
+    return d;
+}
+
+/**
+ * @brief Checks that the delta was encoded against the same base the server has
+ * @param d Decoder with the whole header
+ * @return True if the size and the checksum of the base match
+ */
+static bool delta_header(delta_decoder *d)
+{
+    uint32_t chunk = get32(d->head + 4), crc = 0;
+    bool ok = memcmp(d->head, DELTA_MAGIC, 4) == 0 && chunk >= DELTA_CHUNK_MIN && chunk <= DELTA_CHUNK_MAX && get64(d->head + 8) == d->base_size;
+    for (uint64_t off = 0; ok && off < d->base_size;)
+    {
+        size_t n = d->base_size - off < DELTA_RUN ? d->base_size - off : DELTA_RUN;
+        ok = pread(fileno(d->base), d->buf, n, off) == (ssize_t)n;
+        crc = crc32c_update(crc, d->buf, n);
+        off += n;
+    }
+    if (!ok || crc != get32(d->head + 16))
+    {
+        printf("ERROR: Delta was encoded against a different base\n");
+        return false;
+    }
+    d->chunk = chunk;
+    d->started = true;
+    return true;
+}
+
+/**
+ * @brief Runs the operation whose arguments were received
+ * @param d Decoder
+ * @param emit Writes the reconstructed data
+ * @param ctx Argument of emit
+ * @return False if the operation is malformed or the data can not be written
+ */
+static bool delta_op(delta_decoder *d, bool (*emit)(void *ctx, uint8_t *data, size_t len), void *ctx)
+{
+    uint32_t arg = get32(d->head + 1);
+    if (d->head[0] == DELTA_LITERAL)
+    {
+        d->literal = arg;
+        return true;
+    }
+    if (d->head[0] == DELTA_END)
+    {
+        d->done = true;
+        if (arg != d->crc)
+        {
+            printf("ERROR: Reconstructed file does not match\n");
+            return false;
+        }
+        return true;
+    }
+    uint64_t chunks = (d->base_size + d->chunk - 1) / d->chunk;
+    uint32_t count = get32(d->head + 5);
+    if ((uint64_t)arg + count > chunks)
+    {
+        return false;
+    }
+    uint64_t off = (uint64_t)arg * d->chunk;
+    uint64_t end = off + (uint64_t)count * d->chunk;
+    if (end > d->base_size)
+    {
+        end = d->base_size;
+    }
+    while (off < end)
+    {
+        size_t n = end - off < DELTA_RUN ? end - off : DELTA_RUN;
+        if (pread(fileno(d->base), d->buf, n, off) != (ssize_t)n)
+        {
+            return false;
+        }
+        d->crc = crc32c_update(d->crc, d->buf, n);
+        if (!emit(ctx, d->buf, n))
+        {
+            return false;
+        }
+        off += n;
+    }
+    return true;
+}
+
+/**
+ * @brief Reconstructs the next part of the file from the delta, the operations can be split between the blocks
+ * @param d Decoder
+ * @param data Part of the delta
+ * @param len Size of the part
+ * @param emit Writes the reconstructed data
+ * @param ctx Argument of emit
+ * @return False if the delta is malformed or the data can not be written
+ */
+bool delta_write(delta_decoder *d, uint8_t *data, size_t len, bool (*emit)(void *ctx, uint8_t *data, size_t len), void *ctx)
+{
+    while (len > 0)
+    {
+        if (d->done)
+        {
+            // Nothing follows the end of the delta
+            return false;
+        }
+        if (d->literal > 0)
+        {
+            size_t n = len < d->literal ? len : d->literal;
+            d->crc = crc32c_update(d->crc, data, n);
+            if (!emit(ctx, data, n))
+            {
+                return false;
+            }
+            d->literal -= n;
+            data += n;
+            len -= n;
+            continue;
+        }
+        size_t need = DELTA_HEADER;
+        if (d->started)
+        {
+            need = d->nhead == 0 ? 1 : d->head[0] == DELTA_COPY ? 9 : 5;
+        }
+        size_t n = need - d->nhead < len ? need - d->nhead : len;
+        memcpy(d->head + d->nhead, data, n);
+        d->nhead += n;
+        data += n;
+        len -= n;
+        if (d->nhead < need)
+        {
+            continue;
+        }
+        if (!d->started)
+        {
+            d->nhead = 0;
+            if (!delta_header(d))
+            {
+                return false;
+            }
+            continue;
+        }
+        if (need == 1)
+        {
+            if (d->head[0] != DELTA_COPY && d->head[0] != DELTA_LITERAL && d->head[0] != DELTA_END)
+            {
+                return false;
+            }
+            continue;
+        }
+        d->nhead = 0;
+        if (!delta_op(d, emit, ctx))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Checks that the delta ended with its end operation
+ * @param d Decoder
+ * @return True if the file was reconstructed
+ */
+bool delta_done(delta_decoder *d)
+{
+    return d->done;
+}
+
+/**
+ * @brief Frees the decoder and closes the base file
+ * @param d Decoder, NULL is ignored
+ */
+void delta_free(delta_decoder *d)
+{
+    if (d == NULL)
+    {
+        return;
+    }
+    fclose(d->base);
+    free(d->buf);
+    free(d);
+}
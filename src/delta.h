@@ -0,0 +1,70 @@
+/**
+ * @file delta.h
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#ifndef DELTA_H
+#define DELTA_H
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Signatures of the base file start with the magic, the chunk size, the size and CRC32C of the base and the number of the chunks.
+   Every chunk then has its rolling and strong signature. All numbers are in network order. */
+#define SIGNATURE_MAGIC "TSG1"
+#define SIGNATURE_HEADER 24
+#define SIGNATURE_ENTRY 12
+
+/* Delta stream starts with the magic, the chunk size and the size and CRC32C of the base it was encoded against.
+   Operations follow: 'C' copies the number of the chunks of the base from the index, 'L' carries the literal bytes
+   and 'E' ends the stream with CRC32C of the reconstructed file. */
+#define DELTA_MAGIC "TDL1"
+#define DELTA_HEADER 20
+#define DELTA_COPY 'C'
+#define DELTA_LITERAL 'L'
+#define DELTA_END 'E'
+
+/* Chunk sizes accepted by the signatures option and the chunk requested by the client */
+#define DELTA_CHUNK_MIN 256
+#define DELTA_CHUNK_MAX (1024 * 1024)
+#define DELTA_CHUNK 4096
+
+/* Literal bytes are sent in operations of at most this size, it is also the size of the copy reads */
+#define DELTA_RUN 65536
+
+/* Reconstructs the uploaded file from the delta stream and the base file */
+typedef struct
+{
+    FILE *base;
+    uint64_t base_size;
+    uint32_t chunk;
+    uint8_t head[DELTA_HEADER]; /* Header of the stream, then the operation with its arguments */
+    size_t nhead;
+    bool started;        /* True once the header matched the base */
+    uint64_t literal;    /* Literal bytes of the current operation that did not arrive yet */
+    uint32_t crc;        /* Checksum of the reconstructed file */
+    bool done;
+    uint8_t *buf;
+} delta_decoder;
+
+/* Number of the bytes the last delta upload sent as literals and copied from the base */
+extern unsigned long long delta_literal;
+extern unsigned long long delta_copied;
+
+off_t delta_signature_size(off_t size, uint32_t chunk);
+
+FILE *delta_signatures(FILE *base, uint32_t chunk);
+
+FILE *delta_source(FILE *in, uint8_t *signatures, size_t len);
+
+delta_decoder *delta_start(FILE *base);
+
+bool delta_write(delta_decoder *d, uint8_t *data, size_t len, bool (*emit)(void *ctx, uint8_t *data, size_t len), void *ctx);
+
+bool delta_done(delta_decoder *d);
+
+void delta_free(delta_decoder *d);
+
+#endif
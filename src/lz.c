@@ -0,0 +1,219 @@
+/**
+ * @file lz.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ *
+ * Fast LZ77 codec using the LZ4 block layout. Every sequence starts with a token, its high nibble is the number of
+ * literals and its low nibble is the match length minus 4, value 15 in either nibble continues in the following
+ * bytes. Literals follow, then 2 byte little endian offset of the match. The last sequence has literals only.
+ */
+#include <string.h>
+#include <sys/types.h>
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define HASH_BITS 13
+// Matches do not start in the last 12 bytes and the last 5 bytes are always literals
+#define MATCH_LIMIT 12
+#define LAST_LITERALS 5
+#define MAX_OFFSET 65535
+
+/**
+ * @brief Hashes 4 bytes at the position
+ * @param p Position in the input
+ * @return Index to the hash table
+ */
+static uint32_t lz_hash(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/**
+ * @brief Writes the length that did not fit into the token nibble
+ * @param dst Output position
+ * @param len Remaining length
+ * @return Output position after the length
+ */
+static uint8_t *lz_put_length(uint8_t *dst, size_t len)
+{
+    while (len >= 255)
+    {
+        *dst++ = 255;
+        len -= 255;
+    }
+    *dst++ = (uint8_t)len;
+    return dst;
+}
+
+/**
+ * @brief Writes one sequence of literals followed by the match
+ * @param dst Output position
+ * @param end End of the output
+ * @param literals Start of the literals
+ * @param nliterals Number of the literals
+ * @param offset Offset of the match, ignored if mlen is 0
+ * @param mlen Length of the match, 0 for the last sequence
+ * @return Output position after the sequence, NULL if the output is full
+ */
+static uint8_t *lz_sequence(uint8_t *dst, uint8_t *end, const uint8_t *literals, size_t nliterals, size_t offset, size_t mlen)
+{
+    size_t mcode = mlen ? mlen - MIN_MATCH : 0;
+    if (dst + 1 + nliterals / 255 + 1 + nliterals + 2 + mcode / 255 + 1 > end)
+    {
+        return NULL;
+    }
+    uint8_t *token = dst++;
+    *token = (uint8_t)((nliterals >= 15 ? 15 : nliterals) << 4);
+    if (nliterals >= 15)
+    {
+        dst = lz_put_length(dst, nliterals - 15);
+    }
+    memcpy(dst, literals, nliterals);
+    dst += nliterals;
+    if (mlen == 0)
+    {
+        return dst;
+    }
+    *dst++ = (uint8_t)(offset & 0xff);
+    *dst++ = (uint8_t)(offset >> 8);
+    *token |= (uint8_t)(mcode >= 15 ? 15 : mcode);
+    if (mcode >= 15)
+    {
+        dst = lz_put_length(dst, mcode - 15);
+    }
+    return dst;
+}
+
+/**
+ * @brief Compresses the buffer
+ * @param src Input
+ * @param size Size of the input
+ * @param dst Output
+ * @param capacity Size of the output, LZ_BOUND(size) is always enough
+ * @return Size of the compressed data, 0 if it does not fit into the output
+ */
+size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity)
+{
+    uint32_t table[1 << HASH_BITS];
+    const uint8_t *ip = src, *anchor = src;
+    const uint8_t *iend = src + size;
+    uint8_t *op = dst, *oend = dst + capacity;
+    memset(table, 0, sizeof(table));
+    if (size > MATCH_LIMIT)
+    {
+        const uint8_t *mlimit = iend - MATCH_LIMIT;
+        // Table stores positions + 1, so 0 means empty
+        while (ip < mlimit)
+        {
+            uint32_t h = lz_hash(ip);
+            const uint8_t *ref = table[h] ? src + table[h] - 1 : NULL;
+            table[h] = (uint32_t)(ip - src) + 1;
+            if (ref == NULL || ip - ref > MAX_OFFSET || memcmp(ref, ip, MIN_MATCH) != 0)
+            {
+                ip++;
+                continue;
+            }
+            const uint8_t *mend = ip + MIN_MATCH;
+            while (mend < iend - LAST_LITERALS && *mend == ref[mend - ip])
+            {
+                mend++;
+            }
+            op = lz_sequence(op, oend, anchor, ip - anchor, ip - ref, mend - ip);
+            if (op == NULL)
+            {
+                return 0;
+            }
+            // Positions inside the match are inserted sparsely, it keeps the speed on long matches
+            for (const uint8_t *p = ip + 1; p < mend && p < mlimit; p += 2)
+            {
+                table[lz_hash(p)] = (uint32_t)(p - src) + 1;
+            }
+            ip = anchor = mend;
+        }
+    }
+    op = lz_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    return op == NULL ? 0 : (size_t)(op - dst);
+}
+
+/**
+ * @brief Reads the length that did not fit into the token nibble
+ * @param ip Input position, moved after the length
+ * @param iend End of the input
+ * @param len Length from the nibble
+ * @return Whole length, (size_t)-1 if the input ends
+ */
+static size_t lz_get_length(const uint8_t **ip, const uint8_t *iend, size_t len)
+{
+    if (len != 15)
+    {
+        return len;
+    }
+    uint8_t b;
+    do
+    {
+        if (*ip >= iend)
+        {
+            return (size_t)-1;
+        }
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+/**
+ * @brief Decompresses the buffer, malformed input never reads or writes outside the buffers
+ * @param src Compressed input
+ * @param size Size of the input
+ * @param dst Output
+ * @param capacity Size of the output
+ * @return Size of the decompressed data, -1 if the input is malformed or does not fit into the output
+ */
+ssize_t lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity)
+{
+    const uint8_t *ip = src, *iend = src + size;
+    uint8_t *op = dst, *oend = dst + capacity;
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+        size_t nliterals = lz_get_length(&ip, iend, token >> 4);
+        if (nliterals == (size_t)-1 || nliterals > (size_t)(iend - ip) || nliterals > (size_t)(oend - op))
+        {
+            return -1;
+        }
+        memcpy(op, ip, nliterals);
+        op += nliterals;
+        ip += nliterals;
+        if (ip == iend)
+        {
+            break;
+        }
+        if (iend - ip < 2)
+        {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t mlen = lz_get_length(&ip, iend, token & 15);
+        if (mlen == (size_t)-1 || offset == 0 || offset > (size_t)(op - dst))
+        {
+            return -1;
+        }
+        mlen += MIN_MATCH;
+        if (mlen > (size_t)(oend - op))
+        {
+            return -1;
+        }
+        // Match can overlap the output it produces, so it is copied byte by byte
+        const uint8_t *ref = op - offset;
+        for (size_t i = 0; i < mlen; i++)
+        {
+            op[i] = ref[i];
+        }
+        op += mlen;
+    }
+    return op - dst;
+}
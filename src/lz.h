@@ -0,0 +1,23 @@
+/**
+ * @file lz.h
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#ifndef LZ_H
+#define LZ_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Biggest chunk of the file that is compressed as one frame */
+#define LZ_CHUNK 65536
+
+/* Biggest output of lz_compress() for the input of the given size */
+#define LZ_BOUND(size) ((size) + (size) / 255 + 16)
+
+size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity);
+
+ssize_t lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity);
+
+#endif
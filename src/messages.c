@@ -14,6 +14,11 @@
 #include <stdbool.h>
 #include <arpa/inet.h>
 #include <sys/statvfs.h>
+#include <unistd.h>
+
+ssize_t (*engine_sendto)(int socket, const void *buf, size_t len, int flags, const struct sockaddr *address, socklen_t alen) = sendto;
+ssize_t (*engine_recvfrom)(int socket, void *buf, size_t len, int flags, struct sockaddr *address, socklen_t *alen) = recvfrom;
+int (*engine_poll)(struct pollfd *fds, nfds_t nfds, int timeout) = poll;
 
 /**
  * @brief Function used by both SERVER and CLIENT for printing output on stdeer as describet in requierements
@@ -61,7 +66,7 @@ void message_info(tftp_message *message, struct sockaddr *address, int socket)
  */
 ssize_t receive_message(int socket, tftp_message *message, struct sockaddr *address, socklen_t *slen, ssize_t size)
 {
-    ssize_t bsize = recvfrom(socket, message, sizeof(message)+size, 0, address, slen);
+    ssize_t bsize = engine_recvfrom(socket, message, sizeof(tftp_message) + size, 0, address, slen);
     if (bsize < 0)
     {
         printf("ERROR recvfrom()\n");
@@ -89,7 +94,7 @@ ssize_t send_ack(int socket, uint16_t block, struct sockaddr *address, socklen_t
     message.ack.opcode = htons(ACK);
     message.ack.block_number = htons(block);
 
-    if ((x = sendto(socket, &message, sizeof(message.ack), 0, address, len)) < 0)
+    if ((x = engine_sendto(socket, &message, sizeof(message.ack), 0, address, len)) < 0)
     {
         printf("ERROR sendto()\n");
     }
@@ -119,41 +124,7 @@ ssize_t send_error(int socket, struct sockaddr *address, socklen_t len, int erro
     message->error.error_code = htons(error);
     strcpy(message->error.error_string, error_msg);
 
-    if (x = sendto(socket, message, strlen(error_msg) + 4, 0, address, len) < 0)
-    {
-        printf("ERROR sendto()\n");
-    }
-    free(message);
-    return x;
-}
-
-/**
- * @brief Function used by both SERVER and CLIENT for sending OACK message
- * @param socket Source ID
- * @param address Destination address
- * @param slen Address lenght
- * @param block Defines for what block of the data we send the OACK for
- * @param options Options that are about to be OACK
- * @return Number of bytes that have been sent
- */
-ssize_t send_oack(int socket, uint16_t block, struct sockaddr *address, socklen_t len, char *options)
-{
-    ssize_t x;
-    tftp_message *message = malloc(sizeof(tftp_message) + 512);
-    message->oack.opcode = htons(OACK);
-    message->oack.block_number = htons(block);
-    strcpy(message->oack.options, options);
-    int num = 1;
-    int lenght = strlen(options);
-    options = strchr(options, '\0') + 1;
-    while (options[0] != '\0')
-    {
-        strcpy(message->oack.options+lenght+num, options);
-        num++;
-        lenght += strlen(options);
-        options = strchr(options, '\0') + 1;
-    }
-    if ((x = sendto(socket, message, lenght + 4 + num, 0, address, len)) < 0)
+    if (x = engine_sendto(socket, message, strlen(error_msg) + 4, 0, address, len) < 0)
     {
         printf("ERROR sendto()\n");
     }
@@ -177,7 +148,7 @@ ssize_t send_data(ssize_t len, socklen_t slen, struct sockaddr *address, uint8_t
     message->data.block_number = htons(block);
     memcpy(message->data.data, data, len);
     ssize_t x;
-    if ((x = sendto(socket, message, len + 4, 0, address, slen)) < 0)
+    if ((x = engine_sendto(socket, message, len + 4, 0, address, slen)) < 0)
     {
         printf("ERROR sendto()\n");
     }
@@ -185,6 +156,29 @@ ssize_t send_data(ssize_t len, socklen_t slen, struct sockaddr *address, uint8_t
     return x;
 }
 
+/**
+ * @brief Function used by both SERVER and CLIENT for finding the local address used to reach the peer
+ * @param peer Address of the peer
+ * @return Local address, INADDR_ANY if the peer is not reachable
+ */
+struct in_addr local_address_to(struct sockaddr_in *peer)
+{
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    // Connecting UDP socket sends nothing, it only selects the route
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock >= 0)
+    {
+        if (connect(sock, (struct sockaddr *)peer, sizeof(*peer)) < 0 || getsockname(sock, (struct sockaddr *)&local, &len) < 0)
+        {
+            local.sin_addr.s_addr = htonl(INADDR_ANY);
+        }
+        close(sock);
+    }
+    return local.sin_addr;
+}
+
 /**
  * @brief Function used by both SERVER and CLIENT for checking the opcodes received
  * @param socket Source ID
@@ -247,4 +241,42 @@ bool opcodes_check_upload(int socket, uint16_t block, tftp_message *message, soc
         return false;
     }
     return true;
-}
\ No newline at end of file
+}
+/**
+ * @brief Converts the number of the block counted from the start of the transfer to the 16-bit number sent in the message
+ * @param block Number of the block, it never wraps
+ * @param rollover Number that follows the block 65535, 0 or 1
+ * @return Number of the block in the message
+ */
+uint16_t block_wire(uint64_t block, int rollover)
+{
+    if (rollover == 0 || block <= UINT16_MAX)
+    {
+        return (uint16_t)block;
+    }
+    // Number 0 is used only once, the numbers 1 to 65535 repeat after it
+    return (block - UINT16_MAX - 1) % UINT16_MAX + 1;
+}
+
+/**
+ * @brief Finds the block with the 16-bit number of the message that is the closest one to the known block
+ * @param near Known block, for example the last acknowledged one
+ * @param wire Number of the block in the message
+ * @param rollover Number that follows the block 65535, 0 or 1
+ * @return Number of the block counted from the start of the transfer, UINT64_MAX if no nearby block has the number
+ */
+uint64_t block_unwrap(uint64_t near, uint16_t wire, int rollover)
+{
+    int16_t distance = wire - block_wire(near, rollover);
+    // Skipped number 0 makes the distance over the rollover to 1 one block shorter
+    int64_t candidates[3] = {distance, distance - 1, distance + 1};
+    for (int i = 0; i < 3; i++)
+    {
+        int64_t block = (int64_t)near + candidates[i];
+        if (block >= 0 && block_wire(block, rollover) == wire)
+        {
+            return block;
+        }
+    }
+    return UINT64_MAX;
+}
@@ -7,6 +7,8 @@
 #ifndef MESSAGES_H
 #define MESSAGES_H
 #include <stdbool.h>
+#include <poll.h>
+#include <sys/socket.h>
 
 enum OPCODES
 {
@@ -80,8 +82,15 @@ typedef union
 
 } tftp_message_request;
 
+/* Packet engine of the messages, the kernel UDP stack unless the server moves its sessions to AF_XDP */
+extern ssize_t (*engine_sendto)(int socket, const void *buf, size_t len, int flags, const struct sockaddr *address, socklen_t alen);
+extern ssize_t (*engine_recvfrom)(int socket, void *buf, size_t len, int flags, struct sockaddr *address, socklen_t *alen);
+extern int (*engine_poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+
 int create_socket();
 
+void message_info(tftp_message *message, struct sockaddr *address, int socket);
+
 ssize_t receive_message_request(int socket, tftp_message_request *message, struct sockaddr *address, socklen_t *slen);
 
 ssize_t receive_message(int socket, tftp_message *message, struct sockaddr *address, socklen_t *slen, ssize_t size);
@@ -90,13 +99,17 @@ ssize_t send_ack(int socket, uint16_t block, struct sockaddr *address, socklen_t
 
 ssize_t send_error(int socket, struct sockaddr *address, socklen_t len, int error, char *error_msg);
 
-ssize_t send_oack(int socket, uint16_t block, struct sockaddr *address, socklen_t len, char *options);
-
 ssize_t send_data(ssize_t len, socklen_t slen, struct sockaddr *address, uint8_t *data, uint16_t block, int socket);
 
+struct in_addr local_address_to(struct sockaddr_in *peer);
+
 bool opcodes_check_download(tftp_message *message, int socket, uint16_t block, socklen_t slen, struct sockaddr *address);
 
 bool opcodes_check_upload(int socket, uint16_t block, tftp_message *message, socklen_t slen, struct sockaddr *address);
 
+uint16_t block_wire(uint64_t block, int rollover);
+
+uint64_t block_unwrap(uint64_t near, uint16_t wire, int rollover);
+
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,336 @@
+/**
+ * @file profiles.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "profiles.h"
+#include "sessions.h"
+
+profile_table *profiles = NULL;
+// Path of the snapshot, NULL if the profiles are kept only in the memory
+static char *snapshot_path = NULL;
+// Copy of the table written to the snapshot, the table is not locked while the file is written
+static peer_profile snapshot[PROFILE_SLOTS];
+
+/**
+ * @brief Creates the profile table in the memory that is shared with all forked session processes
+ */
+void profiles_init()
+{
+    profiles = mmap(NULL, sizeof(profile_table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (profiles == MAP_FAILED)
+    {
+        printf("ERROR: mmap()\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(profiles, 0, sizeof(profile_table));
+    profiles->decay = 3600;
+}
+
+/**
+ * @brief Locks the profile table, the lock is held only for a few instructions so spinning is fine
+ */
+static void profiles_lock()
+{
+    while (__atomic_test_and_set(&profiles->lock, __ATOMIC_ACQUIRE))
+    {
+        sched_yield();
+    }
+}
+
+/**
+ * @brief Unlocks the profile table
+ */
+static void profiles_unlock()
+{
+    __atomic_clear(&profiles->lock, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Finds the profile of the subnet the client belongs to, the table must be locked
+ * @param peer Address of the client
+ * @param create True if the missing profile is created, the oldest profile of the searched slots is replaced
+ * @return Profile of the subnet, NULL if it is missing and not created
+ */
+static peer_profile *profile_find(struct in_addr peer, bool create)
+{
+    int prefix = sessions->limits.subnet_prefix;
+    uint32_t mask = prefix <= 0 ? 0 : htonl(0xffffffffu << (32 - prefix));
+    struct in_addr subnet = {peer.s_addr & mask};
+    // Multiplicative hash spreads the neighbouring subnets over the table
+    uint32_t start = (ntohl(subnet.s_addr) * 2654435761u) % PROFILE_SLOTS;
+    peer_profile *victim = NULL;
+    for (int i = 0; i < PROFILE_PROBES; i++)
+    {
+        peer_profile *p = &profiles->profiles[(start + i) % PROFILE_SLOTS];
+        if (p->samples > 0 && p->subnet.s_addr == subnet.s_addr)
+        {
+            return p;
+        }
+        if (victim == NULL || (victim->samples > 0 && (p->samples == 0 || p->updated < victim->updated)))
+        {
+            victim = p;
+        }
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+    memset(victim, 0, sizeof(*victim));
+    victim->subnet = subnet;
+    return victim;
+}
+
+/**
+ * @brief Forgets the limits that are too old, the path could have changed since they were learned
+ * @param p Profile of the subnet
+ * @param now Current time
+ */
+static void profile_expire(peer_profile *p, time_t now)
+{
+    if (now - p->updated > profiles->decay)
+    {
+        p->bad_blksize = 0;
+        p->windowsize = 0;
+    }
+}
+
+/**
+ * @brief Lowers the block size and the window the client asked for to the values that worked for its subnet.
+ *        OACK can only lower the requested values, the client that did not ask for an option keeps its default.
+ * @param peer Address of the client
+ * @param blksize Requested block size, 0 if the client did not ask for it
+ * @param windowsize Requested window, 0 if the client did not ask for it
+ */
+void profile_offer(struct in_addr peer, int *blksize, int *windowsize)
+{
+    if (profiles == NULL)
+    {
+        return;
+    }
+    profiles_lock();
+    peer_profile *p = profile_find(peer, false);
+    if (p != NULL)
+    {
+        profile_expire(p, time(NULL));
+        if (p->bad_blksize > 0 && *blksize >= p->bad_blksize)
+        {
+            // Largest block that worked, or the block that is not fragmented
+            int fallback = p->good_blksize > 0 && p->good_blksize < p->bad_blksize ? p->good_blksize : FRAGMENT_BLKSIZE;
+            if (fallback >= p->bad_blksize)
+            {
+                fallback = 512;
+            }
+            if (fallback < *blksize)
+            {
+                *blksize = fallback;
+            }
+        }
+        if (p->windowsize > 0 && *windowsize > p->windowsize)
+        {
+            *windowsize = p->windowsize;
+        }
+    }
+    profiles_unlock();
+}
+
+/**
+ * @brief Updates the profile of the subnet of the client with the outcome of the finished session.
+ *        Older sessions weigh less, their weight halves with every decay period since the last update.
+ * @param peer Address of the client
+ * @param stats Outcome of the session
+ */
+void profile_update(struct in_addr peer, session_stats *stats)
+{
+    if (profiles == NULL || (stats->blocks == 0 && stats->completed))
+    {
+        return;
+    }
+    time_t now = time(NULL);
+    // Session that did not get a single block through lost everything
+    double loss = stats->blocks ? (double)stats->retransmits / (stats->blocks + stats->retransmits) : 1;
+    profiles_lock();
+    peer_profile *p = profile_find(peer, true);
+    double keep = 0;
+    if (p->samples > 0)
+    {
+        profile_expire(p, now);
+        keep = 0.8 * exp2(-(double)(now - p->updated) / profiles->decay);
+    }
+    // Loss much higher than the usual loss of the path is blamed on the parameters of the session
+    bool failed = !stats->completed || (loss >= PROFILE_LOSS_BAD && loss > 2 * p->loss);
+    p->loss = keep * p->loss + (1 - keep) * loss;
+    if (stats->rtt_samples > 0)
+    {
+        double rtt = stats->rtt_sum / stats->rtt_samples;
+        p->rtt = p->rtt > 0 ? keep * p->rtt + (1 - keep) * rtt : rtt;
+    }
+    if (failed && stats->blksize > FRAGMENT_BLKSIZE && (p->bad_blksize == 0 || stats->blksize < p->bad_blksize))
+    {
+        // Lost fragment loses the whole block, big blocks fail on the paths that drop the fragments
+        p->bad_blksize = stats->blksize;
+    }
+    else if (!failed && stats->blksize > p->good_blksize)
+    {
+        p->good_blksize = stats->blksize;
+        if (p->bad_blksize > 0 && p->good_blksize >= p->bad_blksize)
+        {
+            p->bad_blksize = 0;
+        }
+    }
+    if (stats->windowsize > 1)
+    {
+        if (failed)
+        {
+            // Lost block makes the client send the rest of the window again, smaller window wastes less
+            int limit = stats->windowsize / 2 > 0 ? stats->windowsize / 2 : 1;
+            p->windowsize = p->windowsize > 0 && p->windowsize < limit ? p->windowsize : limit;
+        }
+        else if (p->windowsize > 0 && stats->windowsize >= p->windowsize)
+        {
+            // Window that worked at the limit is allowed to grow again
+            p->windowsize = p->windowsize * 2 > 65535 ? 0 : p->windowsize * 2;
+        }
+    }
+    p->samples++;
+    p->updated = now;
+    profiles->dirty = true;
+    profiles_unlock();
+    profiles_save(false);
+}
+
+/**
+ * @brief Forgets everything the sessions learned, the next snapshot is empty
+ */
+void profiles_clear()
+{
+    if (profiles == NULL)
+    {
+        return;
+    }
+    profiles_lock();
+    memset(profiles->profiles, 0, sizeof(profiles->profiles));
+    profiles->dirty = true;
+    profiles_unlock();
+}
+
+/**
+ * @brief Loads the snapshot of the profiles written by the previous run of the server, it is updated while the server runs
+ * @param path Path of the snapshot, the missing file is created later
+ * @return True if the snapshot was loaded or does not exist yet
+ */
+bool profiles_open(char *path)
+{
+    // Server changes its directory after the arguments are parsed
+    snapshot_path = realpath(path, NULL);
+    if (snapshot_path == NULL)
+    {
+        char cwd[PATH_MAX];
+        if (errno != ENOENT)
+        {
+            return false;
+        }
+        if (path[0] == '/')
+        {
+            snapshot_path = strdup(path);
+            return true;
+        }
+        if (getcwd(cwd, sizeof(cwd)) == NULL)
+        {
+            return false;
+        }
+        snapshot_path = malloc(strlen(cwd) + strlen(path) + 2);
+        sprintf(snapshot_path, "%s/%s", cwd, path);
+        return true;
+    }
+    FILE *fd = fopen(snapshot_path, "r");
+    if (fd == NULL)
+    {
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), fd) != NULL)
+    {
+        char addr[INET_ADDRSTRLEN];
+        struct in_addr subnet;
+        peer_profile loaded;
+        long long updated;
+        if (sscanf(line, "%15s %lf %lf %d %d %d %u %lld", addr, &loaded.loss, &loaded.rtt, &loaded.good_blksize, &loaded.bad_blksize,
+                   &loaded.windowsize, &loaded.samples, &updated) != 8 ||
+            inet_pton(AF_INET, addr, &subnet) != 1 || loaded.samples == 0)
+        {
+            // Comments and damaged lines are skipped
+            continue;
+        }
+        peer_profile *p = profile_find(subnet, true);
+        loaded.subnet = p->subnet;
+        loaded.updated = (time_t)updated;
+        *p = loaded;
+    }
+    fclose(fd);
+    return true;
+}
+
+/**
+ * @brief Writes the changed profiles to the snapshot, the new file replaces the old one at once so a crash never leaves it half written
+ * @param force True if the snapshot is written even if the last one is recent
+ * @return True if the snapshot is up to date
+ */
+bool profiles_save(bool force)
+{
+    if (profiles == NULL || snapshot_path == NULL)
+    {
+        return true;
+    }
+    time_t now = time(NULL);
+    profiles_lock();
+    if (!profiles->dirty || (!force && now - profiles->saved < PROFILE_SAVE_INTERVAL))
+    {
+        profiles_unlock();
+        return true;
+    }
+    memcpy(snapshot, profiles->profiles, sizeof(snapshot));
+    profiles->dirty = false;
+    profiles->saved = now;
+    profiles_unlock();
+
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", snapshot_path, getpid());
+    FILE *fd = fopen(tmp, "w");
+    if (fd == NULL)
+    {
+        return false;
+    }
+    fprintf(fd, "# subnet loss rtt good_blksize bad_blksize windowsize samples updated\n");
+    for (int i = 0; i < PROFILE_SLOTS; i++)
+    {
+        peer_profile *p = &snapshot[i];
+        if (p->samples == 0)
+        {
+            continue;
+        }
+        char addr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &p->subnet, addr, sizeof(addr));
+        fprintf(fd, "%s %.6f %.6f %d %d %d %u %lld\n", addr, p->loss, p->rtt, p->good_blksize, p->bad_blksize, p->windowsize,
+                p->samples, (long long)p->updated);
+    }
+    if (fclose(fd) != 0 || rename(tmp, snapshot_path) < 0)
+    {
+        unlink(tmp);
+        // Next session tries again
+        profiles->dirty = true;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file profiles.h
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#ifndef PROFILES_H
+#define PROFILES_H
+#include <stdbool.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define PROFILE_SLOTS 4096
+/* Slots searched for the subnet before the oldest one of them is replaced */
+#define PROFILE_PROBES 8
+/* Largest block that fits into one Ethernet frame, bigger blocks are sent as IP fragments */
+#define FRAGMENT_BLKSIZE 1468
+/* Session that had to send this share of its blocks again did not work */
+#define PROFILE_LOSS_BAD 0.1
+/* Snapshot is written at most once per this many seconds */
+#define PROFILE_SAVE_INTERVAL 1
+
+/* What the previous sessions learned about the path to one client subnet */
+typedef struct
+{
+    struct in_addr subnet;
+    double loss;           /* Average share of the blocks that were sent again */
+    double rtt;            /* Average seconds between the block and its ACK */
+    int good_blksize;      /* Largest block size that worked, 0 if unknown */
+    int bad_blksize;       /* Smallest block size that was lost, 0 if none */
+    int windowsize;        /* Largest window offered to the client, 0 if unlimited */
+    unsigned samples;      /* Number of the sessions that updated the profile, 0 if the slot is free */
+    time_t updated;        /* Wall clock time, it survives the restart of the server */
+} peer_profile;
+
+/* Table shared between the server and all its session processes */
+typedef struct
+{
+    bool lock;
+    bool dirty;      /* True if the table changed since the last snapshot */
+    time_t saved;    /* Time of the last snapshot */
+    int decay;       /* Seconds that halve the weight of the old knowledge */
+    peer_profile profiles[PROFILE_SLOTS];
+} profile_table;
+
+/* Outcome of one session, it updates the profile of the client */
+typedef struct
+{
+    int blksize;
+    int windowsize;
+    unsigned long blocks;      /* Blocks transferred */
+    unsigned long long bytes;  /* Payload bytes of the transferred blocks */
+    unsigned long retransmits; /* Blocks sent again, or asked for again by the server */
+    double rtt_sum;            /* Seconds of the ACKs of the blocks that were sent once */
+    unsigned long rtt_samples;
+    double wire_sum;           /* Seconds between the kernel timestamps of the block and of its ACK */
+    double host_sum;           /* Seconds the timestamped blocks and their ACKs spent inside the server */
+    unsigned long stamped;     /* Round trips measured by the kernel timestamps */
+    bool completed;
+    bool timed_out; /* Client stopped answering, a session it aborted itself tells nothing about the path */
+} session_stats;
+
+extern profile_table *profiles;
+
+void profiles_init();
+
+bool profiles_open(char *path);
+
+bool profiles_save(bool force);
+
+void profiles_clear();
+
+void profile_offer(struct in_addr peer, int *blksize, int *windowsize);
+
+void profile_update(struct in_addr peer, session_stats *stats);
+
+#endif
@@ -0,0 +1,165 @@
+/**
+ * @file ring.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "ring.h"
+
+/**
+ * @brief Reader thread, reads the blocks of the file while there is a free slot
+ * @param arg Ring that is being filled
+ * @return NULL
+ */
+static void *ring_reader(void *arg)
+{
+    block_ring *ring = arg;
+    while (true)
+    {
+        pthread_mutex_lock(&ring->lock);
+        while (ring->head - ring->tail >= ring->slots && !ring->stop)
+        {
+            pthread_cond_wait(&ring->space, &ring->lock);
+        }
+        uint64_t block = ring->head + 1;
+        bool stop = ring->stop;
+        pthread_mutex_unlock(&ring->lock);
+        if (stop)
+        {
+            return NULL;
+        }
+        // Slot of the new block is not used by the sender, so it is filled without the lock
+        size_t slot = (block - 1) % ring->slots;
+        ssize_t len = source_read(ring->src, ring->data + slot * ring->blocksize, ring->blocksize);
+        pthread_mutex_lock(&ring->lock);
+        ring->lens[slot] = len;
+        ring->head = block;
+        ring->eof = len < (ssize_t)ring->blocksize;
+        pthread_mutex_unlock(&ring->lock);
+        char c = 0;
+        if (write(ring->notify[1], &c, 1) < 0)
+        {
+            // Pipe is full, the sender is going to be woken up anyway
+        }
+        if (len < (ssize_t)ring->blocksize)
+        {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * @brief Allocates the ring and starts the reader thread
+ * @param ring Ring that is about to be initialized
+ * @param src Source of the blocks
+ * @param blocksize Size of one block
+ * @param slots Number of the blocks kept in the ring
+ * @return True if everything is okay
+ */
+bool ring_start(block_ring *ring, xfer_source *src, size_t blocksize, size_t slots)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->src = src;
+    ring->blocksize = blocksize;
+    ring->slots = slots;
+    ring->data = malloc(slots * blocksize);
+    ring->lens = malloc(slots * sizeof(ssize_t));
+    if (ring->data == NULL || ring->lens == NULL || pipe(ring->notify) < 0)
+    {
+        free(ring->data);
+        free(ring->lens);
+        return false;
+    }
+    fcntl(ring->notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(ring->notify[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->space, NULL);
+    if (pthread_create(&ring->thread, NULL, ring_reader, ring) != 0)
+    {
+        close(ring->notify[0]);
+        close(ring->notify[1]);
+        free(ring->data);
+        free(ring->lens);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Gets the block from the ring
+ * @param ring Ring of the blocks
+ * @param block Number of the block, counted from 1 and never wrapping
+ * @param data Set to the data of the block
+ * @return Size of the block, RING_PENDING if it was not read yet, -1 if the reading failed
+ */
+ssize_t ring_get(block_ring *ring, uint64_t block, uint8_t **data)
+{
+    pthread_mutex_lock(&ring->lock);
+    ssize_t len = RING_PENDING;
+    if (block <= ring->head && block > ring->tail)
+    {
+        size_t slot = (block - 1) % ring->slots;
+        *data = ring->data + slot * ring->blocksize;
+        len = ring->lens[slot];
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return len;
+}
+
+/**
+ * @brief Clears the wake ups of the sender, the blocks are then checked by ring_get()
+ * @param ring Ring of the blocks
+ */
+void ring_drain(block_ring *ring)
+{
+    char buf[64];
+    while (read(ring->notify[0], buf, sizeof(buf)) > 0)
+    {
+    }
+}
+
+/**
+ * @brief Frees the slots of the acknowledged blocks
+ * @param ring Ring of the blocks
+ * @param block Number of the last acknowledged block
+ */
+void ring_release(block_ring *ring, uint64_t block)
+{
+    pthread_mutex_lock(&ring->lock);
+    if (block > ring->tail)
+    {
+        ring->tail = block;
+        pthread_cond_signal(&ring->space);
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/**
+ * @brief Stops the reader thread and frees the ring
+ * @param ring Ring of the blocks
+ */
+void ring_stop(block_ring *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->stop = true;
+    bool eof = ring->eof;
+    pthread_cond_signal(&ring->space);
+    pthread_mutex_unlock(&ring->lock);
+    if (!eof)
+    {
+        // Reader can be blocked in reading of stdin, the ring is left to the exit of the process
+        pthread_detach(ring->thread);
+        return;
+    }
+    pthread_join(ring->thread, NULL);
+    close(ring->notify[0]);
+    close(ring->notify[1]);
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->space);
+    free(ring->data);
+    free(ring->lens);
+}
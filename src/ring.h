@@ -0,0 +1,46 @@
+/**
+ * @file ring.h
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#ifndef RING_H
+#define RING_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "stream.h"
+
+/* Returned by ring_get() if the block was not read yet */
+#define RING_PENDING -2
+
+/* Blocks of the uploaded file, filled by the reader thread and kept until they are acknowledged */
+typedef struct
+{
+    xfer_source *src;
+    size_t blocksize;
+    size_t slots;
+    uint8_t *data;
+    ssize_t *lens;
+    uint64_t head; /* Number of blocks read, block n is stored in the slot (n - 1) % slots */
+    uint64_t tail; /* Number of acknowledged blocks */
+    bool eof;
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t space;
+    int notify[2]; /* Pipe that wakes up the sender when the block is read */
+    pthread_t thread;
+} block_ring;
+
+bool ring_start(block_ring *ring, xfer_source *src, size_t blocksize, size_t slots);
+
+ssize_t ring_get(block_ring *ring, uint64_t block, uint8_t **data);
+
+void ring_drain(block_ring *ring);
+
+void ring_release(block_ring *ring, uint64_t block);
+
+void ring_stop(block_ring *ring);
+
+#endif
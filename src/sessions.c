@@ -0,0 +1,680 @@
+/**
+ * @file sessions.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include "sessions.h"
+
+session_table *sessions;
+int session_index = -1;
+volatile sig_atomic_t session_cancelled = 0;
+
+// Bucket of the current session process, the shared client bucket lives in the table
+static token_bucket session_bucket;
+// Bucket limiting the number of the requests, used only by the main server process
+static token_bucket request_bucket;
+
+/**
+ * @brief Creates the session table in the memory that is shared with all forked session processes
+ */
+void sessions_init()
+{
+    sessions = mmap(NULL, sizeof(session_table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sessions == MAP_FAILED)
+    {
+        printf("ERROR: mmap()\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(sessions, 0, sizeof(session_table));
+    sessions->limits.subnet_prefix = 24;
+    sessions->limits.sched_aging = 0.1;
+}
+
+/**
+ * @brief Locks the session table, the lock is held only for a few instructions so spinning is fine
+ */
+void sessions_lock()
+{
+    while (__atomic_test_and_set(&sessions->lock, __ATOMIC_ACQUIRE))
+    {
+        sched_yield();
+    }
+}
+
+/**
+ * @brief Unlocks the session table
+ */
+void sessions_unlock()
+{
+    __atomic_clear(&sessions->lock, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Initializes the token bucket, burst allows roughly a quarter of a second of traffic
+ * @param bucket Bucket that is about to be initialized
+ * @param rate Number of tokens added per second, 0 means unlimited
+ */
+void bucket_init(token_bucket *bucket, double rate)
+{
+    bucket->rate = rate;
+    bucket->burst = rate / 4;
+    if (bucket->burst < 1)
+    {
+        bucket->burst = 1;
+    }
+    bucket->tokens = bucket->burst;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+/**
+ * @brief Adds the tokens earned since the last refill
+ * @param bucket Bucket that is about to be refilled
+ */
+static void bucket_refill(token_bucket *bucket)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double elapsed = (ts.tv_sec - bucket->last.tv_sec) + (ts.tv_nsec - bucket->last.tv_nsec) / 1e9;
+    bucket->last = ts;
+    bucket->tokens += elapsed * bucket->rate;
+    if (bucket->tokens > bucket->burst)
+    {
+        bucket->tokens = bucket->burst;
+    }
+}
+
+/**
+ * @brief Takes tokens from the bucket even if there are not enough of them, the caller pays the debt by waiting
+ * @param bucket Bucket to take the tokens from
+ * @param amount Number of tokens
+ * @return Number of seconds the caller has to wait before using the tokens
+ */
+double bucket_take(token_bucket *bucket, double amount)
+{
+    if (bucket->rate <= 0)
+    {
+        return 0;
+    }
+    bucket_refill(bucket);
+    bucket->tokens -= amount;
+    if (bucket->tokens >= 0)
+    {
+        return 0;
+    }
+    return -bucket->tokens / bucket->rate;
+}
+
+/**
+ * @brief Takes tokens from the bucket only if there are enough of them
+ * @param bucket Bucket to take the tokens from
+ * @param amount Number of tokens
+ * @return True if the tokens were taken
+ */
+bool bucket_try(token_bucket *bucket, double amount)
+{
+    if (bucket->rate <= 0)
+    {
+        return true;
+    }
+    bucket_refill(bucket);
+    if (bucket->tokens < amount)
+    {
+        return false;
+    }
+    bucket->tokens -= amount;
+    return true;
+}
+
+/**
+ * @brief Parses rate passed by the user, suffixes k, m and g multiply the value by 1000, 1000000 and 1000000000
+ * @param str Rate passed by the user
+ * @return Parsed rate, -1 if the rate is invalid
+ */
+double parse_rate(char *str)
+{
+    char *end;
+    double rate = strtod(str, &end);
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        rate *= 1e3;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        rate *= 1e6;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        rate *= 1e9;
+        end++;
+        break;
+    }
+    if (end == str || *end != '\0' || rate < 0)
+    {
+        return -1;
+    }
+    return rate;
+}
+
+/**
+ * @brief Removes the session from the sessions waiting for the uplink, the table is locked
+ * @param slot Index of the session slot
+ * @return True if the session was waiting, the other waiting sessions should be woken then
+ */
+static bool sched_leave(int slot)
+{
+    session_slot *s = &sessions->sessions[slot];
+    if (!s->waiting)
+    {
+        return false;
+    }
+    s->waiting = false;
+    for (int i = 0; i < sessions->nwaiters; i++)
+    {
+        if (sessions->waiters[i] == slot)
+        {
+            sessions->waiters[i] = sessions->waiters[--sessions->nwaiters];
+            break;
+        }
+    }
+    __atomic_add_fetch(&sessions->sched_seq, 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * @brief Wakes the sessions waiting for the uplink, they choose the next session to send again
+ */
+static void sched_wake()
+{
+    syscall(SYS_futex, &sessions->sched_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * @brief Frees the slot of the finished session and the client slot if no other session uses it
+ * @param slot Index of the session slot
+ */
+void session_release(int slot)
+{
+    sessions_lock();
+    session_slot *s = &sessions->sessions[slot];
+    bool waited = sched_leave(slot);
+    if (s->pid != 0)
+    {
+        sessions->clients[s->client].refs--;
+        sessions->active--;
+        s->pid = 0;
+    }
+    sessions_unlock();
+    if (waited)
+    {
+        sched_wake();
+    }
+}
+
+/**
+ * @brief Collects all finished session processes and frees their slots
+ */
+void sessions_reap()
+{
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (int i = 0; i < SESSION_SLOTS; i++)
+        {
+            if (sessions->sessions[i].pid == pid)
+            {
+                session_release(i);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Decides whether the request of the client can be served and reserves the session slot for it
+ * @param peer Address of the client
+ * @param reason Set to the message for the client if the request is rejected
+ * @return Index of the reserved session slot, -1 if the request is rejected
+ */
+int session_admit(struct sockaddr_in *peer, char **reason)
+{
+    session_limits *limits = &sessions->limits;
+    if (request_bucket.rate != limits->max_rps)
+    {
+        bucket_init(&request_bucket, limits->max_rps);
+        request_bucket.burst = request_bucket.tokens = limits->max_rps > 1 ? limits->max_rps : 1;
+    }
+    if (!bucket_try(&request_bucket, 1))
+    {
+        *reason = "ERROR: Server busy, too many requests\n";
+        return -1;
+    }
+    sessions_reap();
+
+    uint32_t mask = limits->subnet_prefix <= 0 ? 0 : htonl(0xffffffffu << (32 - limits->subnet_prefix));
+    int per_ip = 0, per_subnet = 0, free_slot = -1, client = -1, free_client = -1;
+    sessions_lock();
+    for (int i = 0; i < SESSION_SLOTS; i++)
+    {
+        session_slot *s = &sessions->sessions[i];
+        if (s->pid == 0)
+        {
+            if (free_slot < 0)
+            {
+                free_slot = i;
+            }
+            continue;
+        }
+        if (s->peer.s_addr == peer->sin_addr.s_addr)
+        {
+            per_ip++;
+        }
+        if ((s->peer.s_addr & mask) == (peer->sin_addr.s_addr & mask))
+        {
+            per_subnet++;
+        }
+    }
+    for (int i = 0; i < SESSION_SLOTS; i++)
+    {
+        client_slot *c = &sessions->clients[i];
+        if (c->refs == 0)
+        {
+            if (free_client < 0)
+            {
+                free_client = i;
+            }
+        }
+        else if (c->peer.s_addr == peer->sin_addr.s_addr)
+        {
+            client = i;
+        }
+    }
+
+    *reason = NULL;
+    if (free_slot < 0 || (limits->max_sessions && sessions->active >= limits->max_sessions))
+    {
+        *reason = "ERROR: Server busy, too many sessions\n";
+    }
+    else if (limits->max_per_ip && per_ip >= limits->max_per_ip)
+    {
+        *reason = "ERROR: Server busy, too many sessions from this address\n";
+    }
+    else if (limits->max_per_subnet && per_subnet >= limits->max_per_subnet)
+    {
+        *reason = "ERROR: Server busy, too many sessions from this subnet\n";
+    }
+    if (*reason != NULL)
+    {
+        sessions_unlock();
+        return -1;
+    }
+    if (client < 0)
+    {
+        client = free_client;
+        sessions->clients[client].peer = peer->sin_addr;
+        bucket_init(&sessions->clients[client].bucket, limits->client_rate);
+    }
+    sessions->clients[client].refs++;
+    sessions->sessions[free_slot].pid = -1;
+    sessions->sessions[free_slot].peer = peer->sin_addr;
+    sessions->sessions[free_slot].client = client;
+    sessions->sessions[free_slot].multicast = false;
+    sessions->sessions[free_slot].file[0] = '\0';
+    sessions->sessions[free_slot].weight = 1;
+    sessions->sessions[free_slot].waiting = false;
+    sessions->sessions[free_slot].opcode = 0;
+    sessions->sessions[free_slot].block = 0;
+    sessions->sessions[free_slot].bytes = 0;
+    sessions->sessions[free_slot].rtt = 0;
+    clock_gettime(CLOCK_MONOTONIC, &sessions->sessions[free_slot].started);
+    sessions->active++;
+    sessions_unlock();
+    return free_slot;
+}
+
+/**
+ * @brief Assigns the forked process to the reserved session slot
+ * @param slot Index of the session slot
+ * @param pid Process serving the session
+ */
+void session_attach(int slot, pid_t pid)
+{
+    sessions_lock();
+    sessions->sessions[slot].pid = pid;
+    sessions_unlock();
+}
+
+/**
+ * @brief Stores the name of the file transferred by the current session
+ * @param file Name of the file
+ * @param opcode RRQ or WRQ
+ */
+void session_set_file(char *file, uint16_t opcode)
+{
+    if (session_index < 0)
+    {
+        return;
+    }
+    // Longest matching prefix decides the weight
+    double weight = 1;
+    size_t longest = 0;
+    for (int i = 0; i < sessions->nclasses; i++)
+    {
+        size_t len = strlen(sessions->classes[i].prefix);
+        if (len >= longest && strncmp(file, sessions->classes[i].prefix, len) == 0)
+        {
+            weight = sessions->classes[i].weight;
+            longest = len;
+        }
+    }
+    sessions_lock();
+    snprintf(sessions->sessions[session_index].file, sizeof(sessions->sessions[session_index].file), "%s", file);
+    sessions->sessions[session_index].weight = weight;
+    sessions->sessions[session_index].opcode = opcode;
+    sessions_unlock();
+}
+
+/**
+ * @brief Publishes the progress of the current session for the control socket.
+ *        Only the session writes its slot, so the lock is not taken, the reader can see the values of two different blocks.
+ * @param block Last block acknowledged or received
+ * @param bytes Payload bytes transferred
+ * @param rtt Average round trip time in seconds, 0 if it was not measured
+ */
+void session_progress(uint64_t block, unsigned long long bytes, double rtt)
+{
+    if (session_index < 0)
+    {
+        return;
+    }
+    session_slot *s = &sessions->sessions[session_index];
+    s->block = block;
+    s->bytes = bytes;
+    s->rtt = rtt;
+}
+
+/**
+ * @brief Cancels the other sessions of the same client that transfer the same file in the same direction,
+ *        the client that retries a transfer then does not wait until the abandoned session times out
+ * @return Number of the sessions that were signalled
+ */
+int session_cancel_duplicates()
+{
+    if (session_index < 0)
+    {
+        return 0;
+    }
+    session_slot *me = &sessions->sessions[session_index];
+    pid_t pids[SESSION_SLOTS];
+    int count = 0;
+    sessions_lock();
+    for (int i = 0; i < SESSION_SLOTS; i++)
+    {
+        session_slot *s = &sessions->sessions[i];
+        if (i != session_index && s->pid > 0 && s->opcode == me->opcode && s->peer.s_addr == me->peer.s_addr && !strcmp(s->file, me->file))
+        {
+            pids[count++] = s->pid;
+        }
+    }
+    sessions_unlock();
+    // Signal is sent without the lock, the cancelled session ends through its usual cleanup
+    int signalled = 0;
+    for (int i = 0; i < count; i++)
+    {
+        signalled += kill(pids[i], SIGTERM) == 0;
+    }
+    return signalled;
+}
+
+/**
+ * @brief Adds the weight class passed by the user in the form PREFIX=WEIGHT
+ * @param str Class passed by the user
+ * @return True if the class is valid
+ */
+bool sched_add_class(char *str)
+{
+    char *eq = strrchr(str, '=');
+    if (eq == NULL || eq - str >= (long)sizeof(sessions->classes[0].prefix) || sessions->nclasses >= SCHED_CLASSES)
+    {
+        return false;
+    }
+    char *end;
+    double weight = strtod(eq + 1, &end);
+    if (end == eq + 1 || *end != '\0' || weight <= 0)
+    {
+        return false;
+    }
+    sched_class *c = &sessions->classes[sessions->nclasses++];
+    memcpy(c->prefix, str, eq - str);
+    c->prefix[eq - str] = '\0';
+    c->weight = weight;
+    return true;
+}
+
+/**
+ * @brief Computes the priority of the waiting session, the session with the lowest score is served first
+ * @param s Waiting session
+ * @param now Current time
+ * @return Remaining bytes multiplied by the weight, halved for every aging period of waiting
+ */
+static double sched_score(session_slot *s, struct timespec *now)
+{
+    double waited = (now->tv_sec - s->since.tv_sec) + (now->tv_nsec - s->since.tv_nsec) / 1e9;
+    return s->remaining * s->weight * exp2(-waited / sessions->limits.sched_aging);
+}
+
+/**
+ * @brief Checks whether the session process still runs, the process that ended stays a zombie until the server reaps it
+ * @param pid Process of the session
+ * @return False if the process ended
+ */
+static bool session_alive(pid_t pid)
+{
+    char path[32];
+    char stat[128];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return kill(pid, 0) == 0 || errno != ESRCH;
+    }
+    size_t n = fread(stat, 1, sizeof(stat) - 1, f);
+    fclose(f);
+    stat[n] = '\0';
+    // State follows the name of the program in the parentheses
+    char *state = strrchr(stat, ')');
+    return state == NULL || state[1] == '\0' || state[2] != 'Z';
+}
+
+/**
+ * @brief Waits until the current session is the waiting session with the least remaining data and the uplink has tokens.
+ *        Only the waiting sessions are scanned. The best one sleeps until the uplink has tokens, the others until
+ *        a session stops waiting, the scores age meanwhile so the order is checked again at least every 100 ms.
+ * @param bytes Number of bytes that are about to be sent
+ * @param remaining Number of bytes left to send including this block
+ * @return Number of seconds the session has to wait before sending
+ */
+static double sched_wait(size_t bytes, off_t remaining)
+{
+    session_slot *me = &sessions->sessions[session_index];
+    // Other session that was the best since the time, it is checked if it does not send for too long
+    int seen = -1;
+    struct timespec seen_at = {0, 0};
+    sessions_lock();
+    me->remaining = remaining;
+    if (!me->waiting)
+    {
+        me->waiting = true;
+        sessions->waiters[sessions->nwaiters++] = session_index;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &me->since);
+    sessions_unlock();
+    while (true)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        sessions_lock();
+        if (session_cancelled)
+        {
+            // Cancelled session does not send anymore, the others must not wait for it
+            sched_leave(session_index);
+            sessions_unlock();
+            sched_wake();
+            return 0;
+        }
+        uint32_t seq = sessions->sched_seq;
+        token_bucket *uplink = &sessions->uplink;
+        if (uplink->rate != sessions->limits.uplink_rate)
+        {
+            bucket_init(uplink, sessions->limits.uplink_rate);
+        }
+        bucket_refill(uplink);
+        int best = -1;
+        double best_score = 0;
+        for (int i = 0; i < sessions->nwaiters; i++)
+        {
+            double score = sched_score(&sessions->sessions[sessions->waiters[i]], &now);
+            if (best < 0 || score < best_score)
+            {
+                best = sessions->waiters[i];
+                best_score = score;
+            }
+        }
+        double wait = -uplink->tokens / uplink->rate;
+        if (best == session_index && uplink->tokens > 0)
+        {
+            sched_leave(session_index);
+            wait = bucket_take(uplink, bytes);
+            sessions_unlock();
+            sched_wake();
+            return wait;
+        }
+        pid_t best_pid = sessions->sessions[best].pid;
+        bool handover = false;
+        if (best != session_index && best != seen)
+        {
+            seen = best;
+            seen_at = now;
+            // Tokens wait for the session that may be sleeping since it was not the best before
+            handover = uplink->tokens > 0;
+        }
+        else if (best != session_index && (now.tv_sec - seen_at.tv_sec) + (now.tv_nsec - seen_at.tv_nsec) / 1e9 > 0.1)
+        {
+            // Session that died while waiting would keep the best score until the server reaps it
+            sessions_unlock();
+            seen = -1;
+            if (!session_alive(best_pid))
+            {
+                sessions_lock();
+                bool left = sessions->sessions[best].pid == best_pid && sched_leave(best);
+                sessions_unlock();
+                if (left)
+                {
+                    sched_wake();
+                }
+            }
+            continue;
+        }
+        if (handover)
+        {
+            __atomic_add_fetch(&sessions->sched_seq, 1, __ATOMIC_RELEASE);
+            seq++;
+        }
+        sessions_unlock();
+        if (handover)
+        {
+            sched_wake();
+        }
+        struct timespec ts = {0, 100000000};
+        if (best == session_index && wait < 0.1)
+        {
+            ts.tv_nsec = wait > 0.000001 ? (long)(wait * 1e9) : 1000;
+        }
+        syscall(SYS_futex, &sessions->sched_seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+    }
+}
+
+/**
+ * @brief Marks whether the clients requesting the same file can join the current session
+ * @param multicast True if the clients can join
+ */
+void session_set_multicast(bool multicast)
+{
+    if (session_index < 0)
+    {
+        return;
+    }
+    sessions_lock();
+    sessions->sessions[session_index].multicast = multicast;
+    sessions_unlock();
+}
+
+/**
+ * @brief Sleeps the current session process so that it does not exceed the session and the client bandwidth,
+ *        with the uplink rate set the sending sessions are scheduled by their remaining data
+ * @param bytes Number of bytes that are about to be sent
+ * @param remaining Number of bytes left to send including this block, -1 if the session does not send the file
+ */
+void shape_wait(size_t bytes, off_t remaining)
+{
+    if (session_index < 0)
+    {
+        return;
+    }
+    session_limits *limits = &sessions->limits;
+    if (session_bucket.rate != limits->session_rate)
+    {
+        bucket_init(&session_bucket, limits->session_rate);
+    }
+    double wait = bucket_take(&session_bucket, bytes);
+
+    sessions_lock();
+    token_bucket *client = &sessions->clients[sessions->sessions[session_index].client].bucket;
+    if (client->rate != limits->client_rate)
+    {
+        bucket_init(client, limits->client_rate);
+    }
+    double client_wait = bucket_take(client, bytes);
+    sessions_unlock();
+
+    if (client_wait > wait)
+    {
+        wait = client_wait;
+    }
+    if (remaining >= 0 && limits->uplink_rate > 0)
+    {
+        double uplink_wait = sched_wait(bytes, remaining);
+        if (uplink_wait > wait)
+        {
+            wait = uplink_wait;
+        }
+    }
+    if (wait > 0)
+    {
+        struct timespec ts;
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR && !session_cancelled)
+        {
+        }
+    }
+}
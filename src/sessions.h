@@ -0,0 +1,130 @@
+/**
+ * @file sessions.h
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#ifndef SESSIONS_H
+#define SESSIONS_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#define SESSION_SLOTS 1024
+#define SCHED_CLASSES 32
+
+typedef struct
+{
+    double tokens;
+    double rate; /* Units per second, 0 means unlimited */
+    double burst;
+    struct timespec last;
+} token_bucket;
+
+typedef struct
+{
+    int max_sessions;   /* 0 means unlimited */
+    int max_per_ip;     /* 0 means unlimited */
+    int max_per_subnet; /* 0 means unlimited */
+    int subnet_prefix;
+    double max_rps;      /* Requests per second, 0 means unlimited */
+    double session_rate; /* Bytes per second for one session, 0 means unlimited */
+    double client_rate;  /* Bytes per second for all sessions of one client, 0 means unlimited */
+    double uplink_rate;  /* Bytes per second sent by all sessions, 0 means unlimited and no scheduling */
+    double sched_aging;  /* Seconds of waiting that halve the priority score of the session */
+} session_limits;
+
+/* Files starting with the prefix have their remaining bytes multiplied by the weight when scheduled */
+typedef struct
+{
+    char prefix[128];
+    double weight;
+} sched_class;
+
+typedef struct
+{
+    pid_t pid; /* 0 if the slot is free, -1 if reserved and not forked yet */
+    struct in_addr peer;
+    int client; /* Index to the client table */
+    bool multicast; /* True if clients requesting the same file can join the session */
+    char file[256];
+    double weight;      /* Weight of the class of the file */
+    off_t remaining;    /* Bytes left to send, valid only while waiting */
+    bool waiting;       /* True if the session waits for the uplink */
+    struct timespec since; /* Start of the waiting */
+    uint16_t opcode;    /* RRQ or WRQ, 0 until the request is parsed */
+    uint64_t block;     /* Last block acknowledged or received */
+    unsigned long long bytes; /* Payload bytes transferred */
+    double rtt;         /* Average round trip time in seconds, 0 if it was not measured */
+    struct timespec started; /* Time the session was admitted */
+} session_slot;
+
+typedef struct
+{
+    struct in_addr peer;
+    int refs; /* Number of sessions using this slot, 0 if the slot is free */
+    token_bucket bucket;
+} client_slot;
+
+/* Table shared between the server and all its session processes */
+typedef struct
+{
+    bool lock;
+    int active;
+    session_limits limits;
+    sched_class classes[SCHED_CLASSES];
+    int nclasses;
+    token_bucket uplink;
+    int waiters[SESSION_SLOTS]; /* Slots of the sessions waiting for the uplink */
+    int nwaiters;
+    uint32_t sched_seq; /* Changed whenever a session stops waiting, the waiting sessions sleep on it */
+    session_slot sessions[SESSION_SLOTS];
+    client_slot clients[SESSION_SLOTS];
+} session_table;
+
+extern session_table *sessions;
+
+extern int session_index;
+
+/* Set by SIGTERM when the session is cancelled from the control socket, the session ends at its next wait */
+extern volatile sig_atomic_t session_cancelled;
+
+void sessions_init();
+
+void sessions_lock();
+
+void sessions_unlock();
+
+void sessions_reap();
+
+int session_admit(struct sockaddr_in *peer, char **reason);
+
+void session_attach(int slot, pid_t pid);
+
+void session_release(int slot);
+
+void bucket_init(token_bucket *bucket, double rate);
+
+double bucket_take(token_bucket *bucket, double amount);
+
+bool bucket_try(token_bucket *bucket, double amount);
+
+double parse_rate(char *str);
+
+void session_set_file(char *file, uint16_t opcode);
+
+void session_progress(uint64_t block, unsigned long long bytes, double rtt);
+
+void session_set_multicast(bool multicast);
+
+int session_cancel_duplicates();
+
+bool sched_add_class(char *str);
+
+void shape_wait(size_t bytes, off_t remaining);
+
+#endif
@@ -0,0 +1,530 @@
+/**
+ * @file stream.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "stream.h"
+#include "lz.h"
+#include "crc32c.h"
+
+#define FRAME_SIZE (FRAME_HEADER + LZ_BOUND(LZ_CHUNK))
+
+/**
+ * @brief Prepares the source of the DATA blocks
+ * @param src Source that is about to be initialized
+ * @param fd File that is going to be sent
+ * @param compress True if the file is sent as compressed frames
+ * @param checksum True if the checksum of the file is sent after the file
+ * @return True if everything is okay
+ */
+bool source_init(xfer_source *src, FILE *fd, bool compress, bool checksum)
+{
+    memset(src, 0, sizeof(*src));
+    src->fd = fd;
+    src->compress = compress;
+    src->checksum = checksum;
+    struct stat info;
+    src->sparse = fstat(fileno(fd), &info) == 0 && S_ISREG(info.st_mode);
+    src->size = src->sparse ? info.st_size : 0;
+    src->pos = src->sparse ? ftello(fd) : 0;
+    src->data = src->hole = src->pos;
+    if (compress)
+    {
+        src->chunk = malloc(LZ_CHUNK);
+        src->frame = malloc(FRAME_SIZE);
+        if (src->chunk == NULL || src->frame == NULL)
+        {
+            source_free(src);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Reads the file, holes of the sparse file are filled with zeros without reading them
+ * @param src Source of the DATA blocks
+ * @param buf Output
+ * @param len Size of the output
+ * @return Number of bytes read, smaller than len only at the end of the file
+ */
+static size_t source_fread(xfer_source *src, uint8_t *buf, size_t len)
+{
+    size_t filled = 0;
+    while (src->sparse && filled < len)
+    {
+        if (src->pos >= src->hole)
+        {
+            // Next data and hole are looked up only when the data region ends, file without holes has one region
+            int fd = fileno(src->fd);
+            src->data = lseek(fd, src->pos, SEEK_DATA);
+            if (src->data < 0 && errno == ENXIO)
+            {
+                // No data after the position, the rest of the file is a hole
+                src->data = src->size;
+            }
+            src->hole = src->data >= 0 && src->data < src->size ? lseek(fd, src->data, SEEK_HOLE) : src->data;
+            if (src->data < src->pos || src->hole < src->data || fseeko(src->fd, src->data, SEEK_SET) < 0)
+            {
+                // File system does not report the holes, the file is read as it is
+                src->sparse = false;
+                fseeko(src->fd, src->pos, SEEK_SET);
+                break;
+            }
+            if (src->pos == src->hole)
+            {
+                return filled;
+            }
+        }
+        size_t n = len - filled;
+        if (src->pos < src->data)
+        {
+            if ((off_t)n > src->data - src->pos)
+            {
+                n = src->data - src->pos;
+            }
+            memset(buf + filled, 0, n);
+        }
+        else
+        {
+            if ((off_t)n > src->hole - src->pos)
+            {
+                n = src->hole - src->pos;
+            }
+            n = fread(buf + filled, 1, n, src->fd);
+            if (n == 0)
+            {
+                return filled;
+            }
+        }
+        filled += n;
+        src->pos += n;
+    }
+    return filled + fread(buf + filled, 1, len - filled, src->fd);
+}
+
+/**
+ * @brief Compresses the next chunk of the file into the frame
+ * @param src Source of the DATA blocks
+ * @return False if the file has no more data
+ */
+static bool source_next_frame(xfer_source *src)
+{
+    size_t len = source_fread(src, src->chunk, LZ_CHUNK);
+    if (len == 0)
+    {
+        return false;
+    }
+    if (src->checksum)
+    {
+        src->crc = crc32c_update(src->crc, src->chunk, len);
+    }
+    size_t clen = lz_compress(src->chunk, len, src->frame + FRAME_HEADER, FRAME_SIZE - FRAME_HEADER);
+    if (clen == 0 || clen >= len)
+    {
+        // Data that does not compress is stored as it is
+        memcpy(src->frame + FRAME_HEADER, src->chunk, len);
+        clen = len;
+    }
+    uint32_t header[2] = {htonl(len), htonl(clen)};
+    memcpy(src->frame, header, FRAME_HEADER);
+    src->start = 0;
+    src->end = FRAME_HEADER + clen;
+    if (src->cache != NULL && fwrite(src->frame, 1, src->end, src->cache) != src->end)
+    {
+        fclose(src->cache);
+        src->cache = NULL;
+    }
+    return true;
+}
+
+/**
+ * @brief Fills the payload of the next DATA block
+ * @param src Source of the DATA blocks
+ * @param buf Payload
+ * @param len Block size
+ * @return Size of the payload, smaller than the block size only for the last block, -1 if error occurs
+ */
+ssize_t source_read(xfer_source *src, uint8_t *buf, size_t len)
+{
+    size_t filled = 0;
+    while (filled < len)
+    {
+        if (src->start < src->end)
+        {
+            size_t n = src->end - src->start;
+            if (n > len - filled)
+            {
+                n = len - filled;
+            }
+            memcpy(buf + filled, src->frame + src->start, n);
+            src->start += n;
+            filled += n;
+        }
+        else if (!src->eof && src->compress)
+        {
+            src->eof = !source_next_frame(src);
+        }
+        else if (!src->eof)
+        {
+            // Without compression the file is read straight into the payload
+            size_t n = source_fread(src, buf + filled, len - filled);
+            if (src->checksum)
+            {
+                src->crc = crc32c_update(src->crc, buf + filled, n);
+            }
+            filled += n;
+            src->eof = filled < len;
+        }
+        else if (src->checksum && src->trailer_sent < CHECKSUM_SIZE)
+        {
+            if (src->trailer_sent == 0)
+            {
+                uint32_t crc = htonl(src->crc);
+                memcpy(src->trailer, &crc, CHECKSUM_SIZE);
+            }
+            buf[filled++] = src->trailer[src->trailer_sent++];
+        }
+        else
+        {
+            break;
+        }
+    }
+    return ferror(src->fd) ? -1 : (ssize_t)filled;
+}
+
+/**
+ * @brief Frees the buffers of the source, the file and the cache stay open
+ * @param src Source of the DATA blocks
+ */
+void source_free(xfer_source *src)
+{
+    free(src->chunk);
+    free(src->frame);
+    src->chunk = NULL;
+    src->frame = NULL;
+}
+
+/**
+ * @brief Prepares the sink of the DATA blocks
+ * @param sink Sink that is about to be initialized
+ * @param fd File that is being received
+ * @param compress True if the file is received as compressed frames
+ * @param checksum True if the stream ends with the checksum of the file
+ * @return True if everything is okay
+ */
+bool sink_init(xfer_sink *sink, FILE *fd, bool compress, bool checksum)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->fd = fd;
+    sink->compress = compress;
+    sink->checksum = checksum;
+    // File is always written at its end, so the skipped blocks read as zeros
+    struct stat info;
+    sink->sparse = fstat(fileno(fd), &info) == 0 && S_ISREG(info.st_mode);
+    if (compress)
+    {
+        sink->frame = malloc(FRAME_SIZE);
+        sink->chunk = malloc(LZ_CHUNK);
+        if (sink->frame == NULL || sink->chunk == NULL)
+        {
+            sink_free(sink);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Preallocates the whole file and maps it to the memory, the data are then copied to their place in the file
+ * @param sink Sink of the DATA blocks
+ * @param size Size of the file announced by the sender
+ * @return False if the file can not be mapped, the data are then written to the file
+ */
+bool sink_map(xfer_sink *sink, off_t size)
+{
+    int fd = fileno(sink->fd);
+    off_t pos = ftello(sink->fd);
+    if (size <= 0 || pos < 0 || pos > size || fflush(sink->fd) != 0)
+    {
+        return false;
+    }
+    // Allocation of the whole file at once keeps it in one piece, file system without fallocate gets the sparse file
+    if (fallocate(fd, 0, 0, size) < 0 && ftruncate(fd, size) < 0)
+    {
+        return false;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        // Preallocated size is given back, the data are written to the file
+        if (ftruncate(fd, pos) < 0)
+        {
+            printf("ERROR: Can not truncate the file\n");
+        }
+        return false;
+    }
+    sink->map = map;
+    sink->map_size = size;
+    sink->pos = pos;
+    return true;
+}
+
+/**
+ * @brief Unmaps the file, its size is set to the size of the received data
+ * @param sink Sink of the DATA blocks
+ * @return False if the size can not be set
+ */
+static bool sink_unmap(xfer_sink *sink)
+{
+    if (sink->map == NULL)
+    {
+        return true;
+    }
+    munmap(sink->map, sink->map_size);
+    sink->map = NULL;
+    return ftruncate(fileno(sink->fd), sink->pos) == 0 && fseeko(sink->fd, sink->pos, SEEK_SET) == 0;
+}
+
+/**
+ * @brief Writes the data to the file
+ * @param ctx Sink of the DATA blocks
+ * @param data Data of the file
+ * @param len Size of the data
+ * @return False if the data can not be written
+ */
+static bool sink_emit(void *ctx, uint8_t *data, size_t len)
+{
+    xfer_sink *sink = ctx;
+    if (len == 0)
+    {
+        return true;
+    }
+    if (sink->map != NULL && sink->pos + (off_t)len <= sink->map_size)
+    {
+        // Preallocated file already contains zeros
+        if (data[0] != 0 || memcmp(data, data + 1, len - 1) != 0)
+        {
+            memcpy(sink->map + sink->pos, data, len);
+        }
+        sink->pos += len;
+        return true;
+    }
+    // Sender sent more data than it announced, the rest is written to the file
+    if (!sink_unmap(sink))
+    {
+        return false;
+    }
+    if (sink->sparse && data[0] == 0 && memcmp(data, data + 1, len - 1) == 0)
+    {
+        // Zero block is skipped, it becomes a hole in the file
+        sink->hole = true;
+        return fseeko(sink->fd, len, SEEK_CUR) == 0;
+    }
+    sink->hole = false;
+    return fwrite(data, 1, len, sink->fd) == len;
+}
+
+/**
+ * @brief Writes the decoded data to the file, the checksum is computed from the same data
+ * @param sink Sink of the DATA blocks
+ * @param data Decoded data of the stream
+ * @param len Size of the data
+ * @return False if the data can not be written or the delta is malformed
+ */
+static bool sink_output(xfer_sink *sink, uint8_t *data, size_t len)
+{
+    if (sink->checksum)
+    {
+        sink->crc = crc32c_update(sink->crc, data, len);
+    }
+    if (sink->delta != NULL)
+    {
+        // Delta upload carries the operations that rebuild the file from its base
+        return delta_write(sink->delta, data, len, sink_emit, sink);
+    }
+    return sink_emit(sink, data, len);
+}
+
+/**
+ * @brief Decodes the stream without the checksum
+ * @param sink Sink of the DATA blocks
+ * @param data Part of the stream
+ * @param len Size of the part
+ * @return False if the data can not be written or the frame is malformed
+ */
+static bool sink_store(xfer_sink *sink, uint8_t *data, size_t len)
+{
+    if (!sink->compress)
+    {
+        return sink_output(sink, data, len);
+    }
+    while (len > 0)
+    {
+        uint32_t header[2];
+        size_t need = FRAME_HEADER;
+        if (sink->have >= FRAME_HEADER)
+        {
+            memcpy(header, sink->frame, FRAME_HEADER);
+            need += ntohl(header[1]);
+        }
+        size_t n = need - sink->have;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(sink->frame + sink->have, data, n);
+        sink->have += n;
+        data += n;
+        len -= n;
+        if (sink->have == FRAME_HEADER)
+        {
+            memcpy(header, sink->frame, FRAME_HEADER);
+            uint32_t raw = ntohl(header[0]), clen = ntohl(header[1]);
+            if (raw == 0 || raw > LZ_CHUNK || clen == 0 || clen > raw)
+            {
+                return false;
+            }
+            continue;
+        }
+        if (sink->have < need)
+        {
+            continue;
+        }
+        uint32_t raw = ntohl(header[0]), clen = ntohl(header[1]);
+        uint8_t *out = sink->frame + FRAME_HEADER;
+        if (clen < raw)
+        {
+            if (lz_decompress(sink->frame + FRAME_HEADER, clen, sink->chunk, LZ_CHUNK) != (ssize_t)raw)
+            {
+                return false;
+            }
+            out = sink->chunk;
+        }
+        if (!sink_output(sink, out, raw))
+        {
+            return false;
+        }
+        sink->have = 0;
+    }
+    return true;
+}
+
+/**
+ * @brief Stores the payload of the DATA block
+ * @param sink Sink of the DATA blocks
+ * @param data Payload
+ * @param len Size of the payload
+ * @return False if the data can not be written or the frame is malformed
+ */
+bool sink_write(xfer_sink *sink, uint8_t *data, size_t len)
+{
+    if (!sink->checksum)
+    {
+        return sink_store(sink, data, len);
+    }
+    // Last bytes are held back until more data arrives, at the end they contain the checksum
+    uint8_t joined[2 * CHECKSUM_SIZE];
+    if (len >= CHECKSUM_SIZE)
+    {
+        if (!sink_store(sink, sink->held, sink->nheld) || !sink_store(sink, data, len - CHECKSUM_SIZE))
+        {
+            return false;
+        }
+        memcpy(sink->held, data + len - CHECKSUM_SIZE, CHECKSUM_SIZE);
+        sink->nheld = CHECKSUM_SIZE;
+        return true;
+    }
+    memcpy(joined, sink->held, sink->nheld);
+    memcpy(joined + sink->nheld, data, len);
+    size_t total = sink->nheld + len;
+    size_t emit = total > CHECKSUM_SIZE ? total - CHECKSUM_SIZE : 0;
+    sink->nheld = total - emit;
+    memcpy(sink->held, joined + emit, sink->nheld);
+    return sink_store(sink, joined, emit);
+}
+
+/**
+ * @brief Checks that the transfer did not end in the middle of the frame and that the checksum matches
+ * @param sink Sink of the DATA blocks
+ * @return True if all received data were stored and the checksum matches
+ */
+bool sink_finish(xfer_sink *sink)
+{
+    if (sink->checksum)
+    {
+        uint32_t crc;
+        if (sink->nheld != CHECKSUM_SIZE)
+        {
+            return false;
+        }
+        memcpy(&crc, sink->held, CHECKSUM_SIZE);
+        if (ntohl(crc) != sink->crc)
+        {
+            printf("ERROR: Checksum mismatch\n");
+            return false;
+        }
+    }
+    if (sink->delta != NULL && !delta_done(sink->delta))
+    {
+        return false;
+    }
+    if (!sink_unmap(sink))
+    {
+        return false;
+    }
+    if (sink->hole && (fflush(sink->fd) != 0 || ftruncate(fileno(sink->fd), ftello(sink->fd)) < 0))
+    {
+        // Skipped zero block at the end must still extend the file
+        return false;
+    }
+    return sink->have == 0;
+}
+
+/**
+ * @brief Frees the buffers of the sink and unmaps the file, the file stays open and the base of the delta is closed
+ * @param sink Sink of the DATA blocks
+ */
+void sink_free(xfer_sink *sink)
+{
+    // Partial file keeps only the received data, so its size is the resume offset
+    sink_unmap(sink);
+    free(sink->frame);
+    free(sink->chunk);
+    delta_free(sink->delta);
+    sink->frame = NULL;
+    sink->chunk = NULL;
+    sink->delta = NULL;
+}
+
+/**
+ * @brief Computes the checksum of the part of the file that precedes the resume offset
+ * @param fd File, its position is not changed
+ * @param offset Resume offset
+ * @param crc Checksum of the last RESUME_WINDOW bytes before the offset
+ * @return False if the file is shorter than the offset or can not be read
+ */
+bool file_crc(FILE *fd, off_t offset, uint32_t *crc)
+{
+    uint8_t *buf = malloc(RESUME_WINDOW);
+    off_t start = offset > RESUME_WINDOW ? offset - RESUME_WINDOW : 0;
+    size_t len = offset - start;
+    bool ok = buf != NULL && pread(fileno(fd), buf, len, start) == (ssize_t)len;
+    if (ok)
+    {
+        *crc = crc32c_update(0, buf, len);
+    }
+    free(buf);
+    return ok;
+}
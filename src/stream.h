@@ -0,0 +1,85 @@
+/**
+ * @file stream.h
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#ifndef STREAM_H
+#define STREAM_H
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "delta.h"
+
+/* Every compressed frame starts with the size of the original chunk and the size of the payload, both 4 bytes in network order.
+   Payload of the same size as the original chunk is stored without compression. */
+#define FRAME_HEADER 8
+
+/* With the checksum option the stream ends with CRC32C of the file, 4 bytes in network order */
+#define CHECKSUM_SIZE 4
+
+/* Resumed download is checked by the checksum of this many bytes before the offset */
+#define RESUME_WINDOW 65536
+
+/* Produces the payload of the DATA blocks from the file */
+typedef struct
+{
+    FILE *fd;
+    bool compress;
+    bool checksum;
+    uint32_t crc;
+    uint8_t trailer[CHECKSUM_SIZE];
+    size_t trailer_sent;
+    bool sparse; /* True if the holes of the file are not read */
+    off_t size;
+    off_t pos;
+    off_t data; /* Start of the next data after the position */
+    off_t hole; /* Start of the next hole after the data */
+    FILE *cache;    /* Copy of the encoded frames, NULL if it is not written */
+    uint8_t *chunk; /* Chunk of the file that is being compressed */
+    uint8_t *frame; /* Encoded frame that is being sent */
+    size_t start;
+    size_t end;
+    bool eof;
+} xfer_source;
+
+/* Stores the payload of the DATA blocks to the file */
+typedef struct
+{
+    FILE *fd;
+    bool compress;
+    bool checksum;
+    uint32_t crc;
+    uint8_t held[CHECKSUM_SIZE]; /* Last bytes of the stream, they can be the checksum */
+    size_t nheld;
+    bool sparse; /* True if the zero blocks are skipped instead of written */
+    bool hole;   /* True if the file ends with the skipped zero block */
+    uint8_t *map; /* Preallocated file mapped to the memory, NULL if the data are written to the file */
+    off_t map_size;
+    off_t pos;
+    uint8_t *frame; /* Frame that is being received */
+    uint8_t *chunk; /* Decompressed frame */
+    size_t have;
+    delta_decoder *delta; /* Reconstructs the delta upload, NULL if the stream is the file itself */
+} xfer_sink;
+
+bool source_init(xfer_source *src, FILE *fd, bool compress, bool checksum);
+
+ssize_t source_read(xfer_source *src, uint8_t *buf, size_t len);
+
+void source_free(xfer_source *src);
+
+bool sink_init(xfer_sink *sink, FILE *fd, bool compress, bool checksum);
+
+bool sink_map(xfer_sink *sink, off_t size);
+
+bool sink_write(xfer_sink *sink, uint8_t *data, size_t len);
+
+bool sink_finish(xfer_sink *sink);
+
+void sink_free(xfer_sink *sink);
+
+bool file_crc(FILE *fd, off_t offset, uint32_t *crc);
+
+#endif
@@ -0,0 +1,369 @@
+/**
+ * @file tftp-bench.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#define _GNU_SOURCE
+#include <sched.h>
+// Server is compiled into the benchmark so that its functions can be called directly, its main() is renamed
+#define main server_main
+#include "tftp-server.c"
+#undef main
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+/* Every benchmark is repeated and the fastest repetition is reported, it is the least disturbed one */
+#define BENCH_REPEATS 7
+/* Number of operations of one repetition is calibrated to take at least this many nanoseconds */
+#define BENCH_TARGET_NS 20000000
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static unsigned long long allocations = 0;
+// Options built by the benchmark of options_append(), global so that the stores are not optimized away
+static tftp_request appended;
+// Last byte of the sent message, it is read so that the assembly of the message can not be optimized away
+static volatile uint8_t sent_byte;
+
+/**
+ * @brief Counts the allocations of the measured functions, the build wraps malloc() with it
+ * @param size Size of the allocation
+ * @return Allocated memory
+ */
+void *__wrap_malloc(size_t size)
+{
+    allocations++;
+    return __real_malloc(size);
+}
+
+/**
+ * @brief Counts the allocations of the measured functions, the build wraps calloc() with it
+ * @param n Number of the elements
+ * @param size Size of one element
+ * @return Allocated memory
+ */
+void *__wrap_calloc(size_t n, size_t size)
+{
+    allocations++;
+    return __real_calloc(n, size);
+}
+
+/**
+ * @brief Counts the allocations of the measured functions, the build wraps realloc() with it
+ * @param ptr Reallocated memory
+ * @param size New size
+ * @return Reallocated memory
+ */
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+/**
+ * @brief Replaces sendto() of the measured functions, so only the assembly of the message is measured
+ * @return Number of bytes that would be sent
+ */
+ssize_t __wrap_sendto(int socket, const void *buf, size_t len, int flags, const struct sockaddr *address, socklen_t slen)
+{
+    (void)socket;
+    (void)flags;
+    (void)address;
+    (void)slen;
+    sent_byte = ((const uint8_t *)buf)[len - 1];
+    return len;
+}
+
+/**
+ * @brief Replaces getsockname() of the measured functions with the address of the server
+ * @return 0
+ */
+int __wrap_getsockname(int socket, struct sockaddr *address, socklen_t *slen)
+{
+    (void)socket;
+    struct sockaddr_in *addr = (struct sockaddr_in *)address;
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(PORT);
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    *slen = sizeof(*addr);
+    return 0;
+}
+
+/* Request of the corpus, strings separated by | are turned to the wire format */
+typedef struct
+{
+    char *name;
+    char *text;
+    uint8_t wire[MAX_REQUEST + 1];
+    ssize_t lenght; /* Lenght of the whole request including the opcode */
+    tftp_request parsed;
+} bench_request;
+
+static bench_request corpus[] = {
+    {"rrq-plain", "\001pxelinux.0|octet|", {0}, 0, {0}},
+    {"rrq-pxe", "\001boot/x86_64/loader/linux|octet|blksize|1468|tsize|0|", {0}, 0, {0}},
+    {"rrq-full", "\001images/ubuntu-24.04-live-server-amd64.iso|octet|blksize|1428|timeout|3|tsize|0|windowsize|16|compress|lz|checksum|crc32c|resume|1048576,1c291ca3|", {0}, 0, {0}},
+    {"wrq-full", "\002uploads/firmware/router-7.2.1-signed.bin|octet|blksize|8192|tsize|1048576|windowsize|64|checksum|crc32c|resume||", {0}, 0, {0}},
+    {"rrq-netascii", "\001pxelinux.cfg/default|netascii|blksize|512|timeout|5|", {0}, 0, {0}},
+};
+
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+/* Measured operation, its argument is the case of the corpus */
+typedef void (*bench_fn)(void *arg);
+
+/**
+ * @brief Reads the time of the monotonic clock
+ * @return Nanoseconds
+ */
+static uint64_t bench_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Reads the cycle counter
+ * @return Cycles, 0 if the counter is not available
+ */
+static uint64_t bench_cycles()
+{
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Runs the operation, calibrates the number of the operations and prints the fastest repetition
+ * @param name Name of the benchmark
+ * @param fn Measured operation
+ * @param arg Argument of the operation
+ * @param bytes Number of the input bytes of one operation
+ */
+static void bench_run(char *name, bench_fn fn, void *arg, size_t bytes)
+{
+    uint64_t ops = 1;
+    while (true)
+    {
+        uint64_t start = bench_ns();
+        for (uint64_t i = 0; i < ops; i++)
+        {
+            fn(arg);
+        }
+        if (bench_ns() - start >= BENCH_TARGET_NS / 4)
+        {
+            break;
+        }
+        ops *= 2;
+    }
+    ops *= 4;
+    double best_ns = 0, best_cycles = 0, allocs = 0;
+    for (int r = 0; r < BENCH_REPEATS; r++)
+    {
+        unsigned long long before = allocations;
+        uint64_t cycles = bench_cycles();
+        uint64_t start = bench_ns();
+        for (uint64_t i = 0; i < ops; i++)
+        {
+            fn(arg);
+        }
+        double ns = (double)(bench_ns() - start) / ops;
+        double cyc = (double)(bench_cycles() - cycles) / ops;
+        allocs = (double)(allocations - before) / ops;
+        if (r == 0 || ns < best_ns)
+        {
+            best_ns = ns;
+            best_cycles = cyc;
+        }
+    }
+    if (HAVE_TSC && bytes > 0)
+    {
+        printf("%-32s %12.1f %12.2f %10.2f %8zu\n", name, best_ns, best_cycles / bytes, allocs, bytes);
+    }
+    else
+    {
+        printf("%-32s %12.1f %12s %10.2f %8zu\n", name, best_ns, "-", allocs, bytes);
+    }
+}
+
+/**
+ * @brief Converts the text of the request to the wire format and the way receive_message_request() leaves it
+ * @param req Case of the corpus
+ */
+static void corpus_prepare(bench_request *req)
+{
+    uint8_t *wire = req->wire;
+    *wire++ = 0;
+    *wire++ = req->text[0];
+    for (char *c = req->text + 1; *c; c++)
+    {
+        *wire++ = *c == '|' ? '\0' : *c;
+    }
+    req->lenght = wire - req->wire;
+    req->wire[req->lenght] = '\0';
+}
+
+/**
+ * @brief Parses the request and builds its OACK like handle_client_rqst() does
+ * @param arg Case of the corpus
+ */
+static void bench_parse_request(void *arg)
+{
+    bench_request *req = arg;
+    int error;
+    char *reason;
+    parse_request((tftp_message_request *)req->wire, req->lenght, &req->parsed, &error, &reason);
+}
+
+/**
+ * @brief Attaches the pairs of the accepted options one by one
+ * @param arg Case of the corpus
+ */
+static void bench_options_append(void *arg)
+{
+    bench_request *req = arg;
+    appended.opts = (char *)appended.oack + 4;
+    appended.opts_len = 0;
+    for (char *str = req->parsed.opts; str < req->parsed.opts + req->parsed.opts_len;)
+    {
+        char *value = str + strlen(str) + 1;
+        options_append(&appended, str, value);
+        str = value + strlen(value) + 1;
+    }
+}
+
+/**
+ * @brief Sends the OACK that was built while the request was parsed
+ * @param arg Case of the corpus
+ */
+static void bench_oack_send(void *arg)
+{
+    bench_request *req = arg;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    oack_send(-1, (struct sockaddr *)&addr, sizeof(addr), &req->parsed);
+}
+
+/**
+ * @brief Parses and logs the request
+ * @param arg Case of the corpus
+ */
+static void bench_request_info(void *arg)
+{
+    bench_request *req = arg;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(49152);
+    addr.sin_addr.s_addr = htonl(0xc0a80a17);
+    request_message_info((tftp_message_request *)req->wire, (struct sockaddr *)&addr, -1, req->lenght);
+}
+
+/* Text file converted to netascii, it is read through fmemopen() so no disk is touched */
+typedef struct
+{
+    char *text;
+    size_t size;
+    char *ndata;
+} bench_text;
+
+/**
+ * @brief Converts the whole text to netascii blocks
+ * @param arg Text of the corpus
+ */
+static void bench_netascii(void *arg)
+{
+    bench_text *text = arg;
+    FILE *fd = fmemopen(text->text, text->size, "r");
+    bool extrach = false;
+    char extra;
+    while (netascii_read(fd, text->ndata, &extrach, &extra) == blocksize)
+    {
+    }
+    fclose(fd);
+}
+
+/**
+ * @brief Main function of the benchmark
+ * @return 0 if everything is okay
+ */
+int main()
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+    // Pinned process gives more stable numbers, the benchmark runs without it too
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+    // Logging of the requests is measured, but not shown
+    if (freopen("/dev/null", "w", stderr) == NULL)
+    {
+        printf("ERROR: Can not open /dev/null\n");
+        return EXIT_FAILURE;
+    }
+    directory = ".";
+    mcast_enabled = true;
+
+    printf("%-32s %12s %12s %10s %8s\n", "benchmark", "ns/op", "cycles/byte", "allocs/op", "bytes");
+    char name[64];
+    for (size_t i = 0; i < CORPUS_SIZE; i++)
+    {
+        corpus_prepare(&corpus[i]);
+        bench_parse_request(&corpus[i]);
+    }
+    for (size_t i = 0; i < CORPUS_SIZE; i++)
+    {
+        snprintf(name, sizeof(name), "parse_request/%s", corpus[i].name);
+        bench_run(name, bench_parse_request, &corpus[i], corpus[i].lenght);
+    }
+    for (size_t i = 0; i < CORPUS_SIZE; i++)
+    {
+        snprintf(name, sizeof(name), "options_append/%s", corpus[i].name);
+        bench_run(name, bench_options_append, &corpus[i], corpus[i].parsed.opts_len);
+    }
+    for (size_t i = 0; i < CORPUS_SIZE; i++)
+    {
+        snprintf(name, sizeof(name), "oack_send/%s", corpus[i].name);
+        bench_run(name, bench_oack_send, &corpus[i], corpus[i].parsed.opts_len);
+    }
+    for (size_t i = 0; i < CORPUS_SIZE; i++)
+    {
+        snprintf(name, sizeof(name), "request_message_info/%s", corpus[i].name);
+        bench_run(name, bench_request_info, &corpus[i], corpus[i].lenght);
+    }
+
+    // Configuration file of a boot loader, lines of the typical length with some CR characters
+    bench_text text;
+    text.size = 64 * 1024;
+    text.text = malloc(text.size);
+    text.ndata = malloc(65464);
+    char *lines[] = {"LABEL linux\n", "  KERNEL vmlinuz\n", "  APPEND initrd=initrd.img root=/dev/nfs ip=dhcp quiet\r\n", "\n"};
+    for (size_t pos = 0, l = 0; pos < text.size; l++)
+    {
+        char *line = lines[l % 4];
+        for (size_t c = 0; line[c] && pos < text.size; c++)
+        {
+            text.text[pos++] = line[c];
+        }
+    }
+    int sizes[] = {512, 1468, 8192};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        blocksize = sizes[i];
+        snprintf(name, sizeof(name), "netascii_read/%d", sizes[i]);
+        bench_run(name, bench_netascii, &text, text.size);
+    }
+    free(text.text);
+    free(text.ndata);
+    return EXIT_SUCCESS;
+}
@@ -4,7 +4,8 @@
  * @brief  ISA Project
  * @date 2023-10-22
  */
-
+// fopencookie() of the generated upload and of the discarded download
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,122 +19,464 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <limits.h>
 #include "messages.h"
+#include "tftp-client.h"
+#include "stream.h"
+#include "crc32c.h"
+#include "ring.h"
+#include "timer.h"
+#include "delta.h"
+#include "bundle.h"
 #define RECV_RETRIES 5
+#define RECV_TIMEOUT 5
+// Smallest number of the blocks read ahead of the acknowledged block
+#define RING_SLOTS 64
+// Blocks of the download that arrived before the missing block are kept until it arrives
+#define REORDER_SLOTS 32
+// Gap is reported to the server once the missing block is this many blocks behind the newest one, closer it is just reordered
+#define REORDER_GAP 3
 char *hostname, *destination_path, *filepath;
 int port = 69;
 int type;
 ssize_t blocksize = 512;
+// Requested and acknowledged number of the blocks sent without waiting for the ACK
+int window_request = 16;
+int windowsize = 1;
+char request_options[512];
+size_t request_options_len = 0;
+bool multicast = false;
+bool compress = false;
+bool lz_accepted = false;
+bool checksum = false;
+bool crc_accepted = false;
+bool resume = false;
+bool resume_accepted = false;
+off_t resume_offset = 0;
+uint32_t resume_crc = 0;
+// Size of the downloaded file reported by the server, 0 if it is not known
+off_t transfer_size = 0;
+// Requested and acknowledged number of the block that follows the block 65535, -1 if the option is not requested
+int rollover_request = -1;
+int rollover = 0;
+// Sink of the running download, its preallocated file is truncated when the client is interrupted
+xfer_sink *active_sink = NULL;
+// Size of the generated upload, -1 if the upload is read from stdin
+long long null_bytes = -1;
+// True if the payload of the download is thrown away instead of written to the file
+bool discard = false;
+// Stream the download is written to instead of the destination file, NULL if the file is written
+FILE *receive_stream = NULL;
+// Base file on the server the upload is encoded against, NULL if the whole file is uploaded
+char *delta_base = NULL;
+bool delta_accepted = false;
+// Signatures of the base downloaded before the delta upload
+char *signatures = NULL;
+size_t signatures_len = 0;
+bool signatures_accepted = false;
+// True if the downloaded file is the manifest of the bundle, its members are unpacked to the destination directory
+bool bundle = false;
+bool bundle_accepted = false;
+// True if the counters of the timer wheel are printed at the end of the upload
+bool timer_report = false;
+// Counters printed at the end of the generated upload or the discarded download
+unsigned long long payload_bytes = 0;
+unsigned long data_packets = 0;
+unsigned long retransmits = 0;
+unsigned long timeouts = 0;
+bool mc_accepted = false;
+bool mc_master = false;
+struct in_addr mc_group;
+int mc_port;
 
 /**
- * @brief Additional function to arguments_check(int num, char **argarr), used for checking the -h
- * @param a -h should be passed here, signalling that the hostname argument should follow
- * @param b Hostname of the server
+ * @brief Additional function to arguments_check(int num, char **argarr), used for checking the -p
+ * @param b port number that the server should be running on
  */
-void handle_hostname(char *a, char *b)
+void handle_port(char *b)
 {
-    if (!strcmp(a, "-h"))
-    {
-        hostname = b;
-    }
-    else
+    port = atoi(b);
+    if (port > 65535 || port < 0)
     {
         exit(EXIT_FAILURE);
     }
 }
 
 /**
- * @brief Additional function to arguments_check(int num, char **argarr), used for checking the -d
- * @param a -d should be passed here, signalling that the destination argument should follow
- * @param b the local or destination filepath
+ * @brief Parses the size with the optional suffix k, m or g
+ * @param str Size from the command line
+ * @return Size in bytes, -1 if the size is not valid
  */
-void handle_dfilepath(char *a, char *b)
+long long parse_size(char *str)
 {
-    if (!strcmp(a, "-t"))
+    char *end;
+    errno = 0;
+    long long size = strtoll(str, &end, 10);
+    long long unit = 1;
+    switch (*end)
     {
-        destination_path = b;
+    case 'k':
+    case 'K':
+        unit = 1024;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        unit = 1024 * 1024;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        unit = 1024 * 1024 * 1024;
+        end++;
+        break;
     }
-    else
+    if (errno || end == str || *end != '\0' || size < 0 || size > LLONG_MAX / unit)
     {
-        exit(EXIT_FAILURE);
+        return -1;
     }
+    return size * unit;
 }
 
 /**
- * @brief Additional function to arguments_check(int num, char **argarr), used for checking the -p
- * @param a -p should be passed here, signalling that the port number is following
- * @param b port number that the server should be running on
+ * @brief Checks whether the arguments are passed in the correct way
+ * @param num Number of arguments
+ * @param argarr Array of arguments passed by the user
  */
-void handle_port(char *a, char *b)
+void arguments_check(int num, char **argarr)
 {
-    if (!strcmp(a, "-p"))
+    int opt;
+    type = UPLOAD;
+    while ((opt = getopt(num, argarr, "h:p:f:t:mcsrw:o:n:dD:bT")) != -1)
     {
-        port = atoi(b);
-        if (port > 65535 || port < 0)
+        switch (opt)
         {
+        case 'h':
+            hostname = optarg;
+            break;
+        case 'p':
+            handle_port(optarg);
+            break;
+        case 'f':
+            filepath = optarg;
+            type = DOWNLOAD;
+            break;
+        case 't':
+            destination_path = optarg;
+            break;
+        case 'm':
+            multicast = true;
+            break;
+        case 'c':
+            compress = true;
+            break;
+        case 's':
+            checksum = true;
+            break;
+        case 'r':
+            resume = true;
+            break;
+        case 'w':
+            window_request = atoi(optarg);
+            if (window_request < 1 || window_request > 65535)
+            {
+                printf("ERROR: Invalid window size\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            if (strcmp(optarg, "0") && strcmp(optarg, "1"))
+            {
+                printf("ERROR: Invalid rollover\n");
+                exit(EXIT_FAILURE);
+            }
+            rollover_request = atoi(optarg);
+            break;
+        case 'n':
+            null_bytes = parse_size(optarg);
+            if (null_bytes < 0)
+            {
+                printf("ERROR: Invalid size\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd':
+            discard = true;
+            break;
+        case 'D':
+            delta_base = optarg;
+            break;
+        case 'b':
+            bundle = true;
+            break;
+        case 'T':
+            timer_report = true;
+            break;
+        default:
+            printf("ERROR: Invalid arguments passed\n");
             exit(EXIT_FAILURE);
         }
-        return;
     }
-    else
+    // Discarded download has no destination
+    if (hostname == NULL || (destination_path == NULL && !discard) || optind != num)
+    {
+        printf("ERROR: Invalid number of arguments passed\n");
+        exit(EXIT_FAILURE);
+    }
+    if (multicast && type != DOWNLOAD)
     {
+        printf("ERROR: Multicast can be used only for download\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((null_bytes >= 0 && type != UPLOAD) || (discard && type != DOWNLOAD))
+    {
+        printf("ERROR: Generated data can be only uploaded and discarded data only downloaded\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((null_bytes >= 0 || discard) && (resume || multicast))
+    {
+        printf("ERROR: Generated or discarded data can not be resumed or sent by multicast\n");
+        exit(EXIT_FAILURE);
+    }
+    if (delta_base != NULL && (type != UPLOAD || resume))
+    {
+        printf("ERROR: Delta can be only uploaded and it can not be resumed\n");
+        exit(EXIT_FAILURE);
+    }
+    if (bundle && (type != DOWNLOAD || resume || multicast || discard))
+    {
+        printf("ERROR: Bundle can be only downloaded, it can not be resumed, sent by multicast or discarded\n");
         exit(EXIT_FAILURE);
     }
 }
 
 /**
- * @brief Additional function to arguments_check(int num, char **argarr), used for checking the -f
- * @param a -f should be passed here
- * @param b the local or destination filepath
+ * @brief Fills the buffer with the generated data, xorshift makes them as incompressible as a real image
+ * @param cookie Number of the bytes left to generate and the state of the generator
+ * @param buf Buffer of the stream
+ * @param size Size of the buffer
+ * @return Number of the generated bytes, 0 at the end
  */
-void handle_filepath(char *a, char *b)
+static ssize_t null_read(void *cookie, char *buf, size_t size)
 {
-    if (!strcmp(a, "-f"))
+    long long *state = cookie;
+    size_t n = (long long)size < state[0] ? size : (size_t)state[0];
+    uint64_t x = (uint64_t)state[1];
+    for (size_t i = 0; i < n; i += sizeof(x))
     {
-        filepath = b;
-    }
-    else
-    {
-        exit(EXIT_FAILURE);
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(buf + i, &x, n - i < sizeof(x) ? n - i : sizeof(x));
     }
+    state[0] -= n;
+    state[1] = (long long)x;
+    return n;
 }
 
 /**
- * @brief Checks whether the arguments are passed in the correct way
- * @param num Number of arguments
- * @param argarr Array of arguments passed by the user
+ * @brief Throws the written data away
+ * @param cookie Unused
+ * @param buf Written data
+ * @param size Size of the data
+ * @return Size of the data
  */
-void arguments_check(int num, char **argarr)
+static ssize_t null_write(void *cookie, const char *buf, size_t size)
 {
-    switch (num)
-    {
-    case 5:
-        handle_hostname(argarr[1], argarr[2]);
-        handle_dfilepath(argarr[3], argarr[4]);
-        type = UPLOAD;
-        return;
+    (void)cookie;
+    (void)buf;
+    return size;
+}
 
-    case 7:
-        handle_hostname(argarr[1], argarr[2]);
-        handle_port(argarr[3], argarr[4]);
-        handle_dfilepath(argarr[5], argarr[6]);
-        type = UPLOAD;
-        return;
+/**
+ * @brief Opens the stream of the generated data, it replaces stdin of the upload so nothing is read from the disk
+ * @param size Number of the generated bytes
+ * @return Stream of the generated data
+ */
+FILE *null_source(long long size)
+{
+    static long long state[2];
+    cookie_io_functions_t io = {null_read, NULL, NULL, NULL};
+    state[0] = size;
+    state[1] = 0x2545f4914f6cdd1dLL;
+    return fopencookie(state, "r", io);
+}
 
-    case 9:
-        handle_hostname(argarr[1], argarr[2]);
-        handle_port(argarr[3], argarr[4]);
-        handle_filepath(argarr[5], argarr[6]);
-        handle_dfilepath(argarr[7], argarr[8]);
-        type = DOWNLOAD;
-        return;
+/**
+ * @brief Opens the stream that discards the written data, it replaces the destination file of the download
+ * @return Stream that discards the data
+ */
+FILE *null_sink()
+{
+    cookie_io_functions_t io = {NULL, null_write, NULL, NULL};
+    return fopencookie(NULL, "w", io);
+}
 
-    default:
-        printf("ERROR: Invalid number of arguments passed\n");
-        ;
+/**
+ * @brief Reads the monotonic clock for the throughput report
+ * @return Seconds
+ */
+double transfer_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Prints the throughput of the generated upload or the discarded download
+ * @param seconds Duration of the transfer
+ */
+void transfer_report(double seconds)
+{
+    if (seconds <= 0)
+    {
+        seconds = 1e-9;
+    }
+    printf("TRANSFER bytes=%llu seconds=%.3f throughput=%.2fMB/s packets=%lu pps=%.0f retransmits=%lu timeouts=%lu\n", payload_bytes, seconds,
+           payload_bytes / seconds / 1e6, data_packets, data_packets / seconds, retransmits, timeouts);
+}
+
+/**
+ * @brief Attaches the option to the request that is about to be sent
+ * @param name Name of the option
+ * @param value Value of the option
+ */
+void request_option_add(char *name, char *value)
+{
+    if (request_options_len + strlen(name) + strlen(value) + 2 > sizeof(request_options))
+    {
+        printf("ERROR: Too many options\n");
         exit(EXIT_FAILURE);
     }
+    strcpy(request_options + request_options_len, name);
+    request_options_len += strlen(name) + 1;
+    strcpy(request_options + request_options_len, value);
+    request_options_len += strlen(value) + 1;
+}
+
+/**
+ * @brief Checks and applies the options acknowledged by the server
+ * @param message OACK message
+ * @param len Lenght of the message
+ * @return True if all options were requested by the client and have valid values
+ */
+bool handle_oack(tftp_message *message, ssize_t len)
+{
+    char *str = (char *)message->oack.options;
+    char *end = (char *)message + len;
+    while (str < end)
+    {
+        char *value = memchr(str, '\0', end - str);
+        if (value == NULL || value + 1 >= end || memchr(value + 1, '\0', end - value - 1) == NULL)
+        {
+            return false;
+        }
+        value++;
+        if (!strcasecmp(str, "blksize"))
+        {
+            blocksize = atoi(value);
+            if (blocksize < 8 || blocksize > 65464)
+            {
+                return false;
+            }
+        }
+        else if (!strcasecmp(str, "multicast") && multicast)
+        {
+            // Value is "address,port,master"
+            char group[INET_ADDRSTRLEN];
+            int mport, master;
+            if (sscanf(value, "%15[0-9.],%d,%d", group, &mport, &master) != 3 && sscanf(value, ",,%d", &master) != 1)
+            {
+                return false;
+            }
+            // Address and port can be left out in the OACKs that only change the master client
+            if (value[0] != ',' && (inet_pton(AF_INET, group, &mc_group) != 1 || mport <= 0 || mport > 65535))
+            {
+                return false;
+            }
+            if (value[0] != ',')
+            {
+                mc_port = mport;
+            }
+            mc_master = master == 1;
+            mc_accepted = true;
+        }
+        else if (!strcasecmp(str, "compress") && compress && !strcasecmp(value, "lz"))
+        {
+            lz_accepted = true;
+        }
+        else if (!strcasecmp(str, "resume") && type == DOWNLOAD && resume_offset > 0 && strtoll(value, NULL, 10) == resume_offset)
+        {
+            resume_accepted = true;
+        }
+        else if (!strcasecmp(str, "resume") && type == UPLOAD && resume)
+        {
+            // Server reports the size of the partial upload and the checksum of its end
+            long long offset;
+            if (sscanf(value, "%lld,%x", &offset, &resume_crc) != 2 || offset < 0)
+            {
+                return false;
+            }
+            resume_offset = offset;
+            resume_accepted = true;
+        }
+        else if (!strcasecmp(str, "windowsize") && window_request > 1)
+        {
+            windowsize = atoi(value);
+            if (windowsize < 1 || windowsize > window_request)
+            {
+                return false;
+            }
+        }
+        else if (!strcasecmp(str, "checksum") && checksum && !strcasecmp(value, "crc32c"))
+        {
+            crc_accepted = true;
+        }
+        else if (!strcasecmp(str, "rollover") && rollover_request >= 0)
+        {
+            if (strcmp(value, rollover_request ? "1" : "0"))
+            {
+                return false;
+            }
+            rollover = rollover_request;
+        }
+        else if (!strcasecmp(str, "signatures") && type == DOWNLOAD && delta_base != NULL)
+        {
+            if (atoi(value) != DELTA_CHUNK)
+            {
+                return false;
+            }
+            signatures_accepted = true;
+        }
+        else if (!strcasecmp(str, "bundle") && bundle && !strcmp(value, "1"))
+        {
+            bundle_accepted = true;
+        }
+        else if (!strcasecmp(str, "delta") && type == UPLOAD && delta_base != NULL && !strcmp(value, delta_base))
+        {
+            delta_accepted = true;
+        }
+        else if (!strcasecmp(str, "tsize"))
+        {
+            transfer_size = type == DOWNLOAD ? strtoll(value, NULL, 10) : 0;
+        }
+        else if (strcasecmp(str, "timeout"))
+        {
+            // Server must not acknowledge option that was not requested
+            return false;
+        }
+        str = strchr(value, '\0') + 1;
+    }
+    return true;
 }
+
 /**
  * @brief Function that creates UDP socket
  * @return Function returns socket if no error occurs during the creation proccess
@@ -146,9 +489,82 @@ int create_socket()
         printf("ERROR: socket()\n");
         exit(EXIT_FAILURE);
     }
+    // Receive loops count the retries, so the receiving must not block forever
+    struct timeval tv = {RECV_TIMEOUT, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     return sock;
 }
 
+/**
+ * @brief Handles the interruption of the download, the file keeps only the received data
+ * @param sig Number of the signal
+ */
+void interrupt_handler(int sig)
+{
+    if (active_sink != NULL && active_sink->map != NULL)
+    {
+        if (ftruncate(fileno(active_sink->fd), active_sink->pos) < 0)
+        {
+            _exit(EXIT_FAILURE);
+        }
+    }
+    _exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Removes the partially received file, it is kept if the download can be resumed later
+ * @param filename Received file
+ */
+void partial_remove(char *filename)
+{
+    if (!resume && receive_stream == NULL)
+    {
+        remove(filename);
+    }
+}
+
+/**
+ * @brief Moves to the place in the file where the received data are written
+ * @param fd Received file
+ * @return False if the file can not be positioned
+ */
+bool resume_position(FILE *fd)
+{
+    if (resume_accepted)
+    {
+        return fseeko(fd, resume_offset, SEEK_SET) == 0;
+    }
+    // Server sends the whole file
+    return ftruncate(fileno(fd), 0) == 0 && fseeko(fd, 0, SEEK_SET) == 0;
+}
+
+/**
+ * @brief Requests the resume of the download if the destination file already contains its beginning
+ * @param filename Destination file
+ */
+void resume_request(char *filename)
+{
+    char value[48];
+    uint32_t crc;
+    FILE *fd = fopen(filename, "r");
+    if (fd == NULL)
+    {
+        return;
+    }
+    fseeko(fd, 0, SEEK_END);
+    resume_offset = ftello(fd);
+    if (resume_offset > 0 && file_crc(fd, resume_offset, &crc))
+    {
+        snprintf(value, sizeof(value), "%lld,%08x", (long long)resume_offset, crc);
+        request_option_add("resume", value);
+    }
+    else
+    {
+        resume_offset = 0;
+    }
+    fclose(fd);
+}
+
 /**
  * @brief Function used by CLIENT for handling the transfer of the data from the server to the client
  * @param socket Source ID
@@ -161,11 +577,29 @@ int create_socket()
  */
 void client_receive(FILE *fd, struct sockaddr *address, socklen_t slen, int socket, char *filename)
 {
-    fd = fopen(filename, "w");
-    bool end = false;
+    // Partial file is opened without truncating, it is truncated when the server does not accept the resume option
+    fd = receive_stream != NULL ? receive_stream : fopen(filename, resume_offset > 0 ? "r+" : "w+");
+    if (fd == NULL)
+    {
+        printf("ERROR: Can not open the file\n");
+        close(socket);
+        exit(EXIT_FAILURE);
+    }
+    xfer_sink sink;
+    sink_init(&sink, fd, false, false);
+    bool end = false, started = false;
     tftp_message *message = malloc(sizeof(tftp_message) + blocksize);
+    // Blocks of the window that arrived before the missing block, the block n is kept in the slot n % REORDER_SLOTS
+    uint8_t *reorder = NULL;
+    uint64_t early_block[REORDER_SLOTS];
+    ssize_t early_len[REORDER_SLOTS];
+    // Highest block that arrived, blocks after the gap up to it may still wait in the slots
+    uint64_t newest = 0;
     ssize_t x;
-    uint16_t block = 0;
+    // Blocks are counted without wrapping, the messages carry their 16-bit numbers. Acked is the last block the client acknowledged
+    uint64_t block = 0, acked = 0;
+    // True once the gap was reported and once a copy of the acknowledged block was answered
+    bool gap = false, reacked = false;
     int tiktok;
     while (true)
     {
@@ -177,9 +611,11 @@ void client_receive(FILE *fd, struct sockaddr *address, socklen_t slen, int sock
             {
                 // send error
                 free(message);
+                free(reorder);
+                sink_free(&sink);
                 fclose(fd);
                 close(socket);
-                remove(filename);
+                partial_remove(filename);
                 exit(EXIT_FAILURE);
             }
 
@@ -189,13 +625,17 @@ void client_receive(FILE *fd, struct sockaddr *address, socklen_t slen, int sock
                 break;
             }
 
-            x = send_ack(socket, block, address, slen);
+            timeouts++;
+            x = send_ack(socket, block_wire(block, rollover), address, slen);
+            acked = block;
             if (x < 0)
             {
                 free(message);
+                free(reorder);
+                sink_free(&sink);
                 fclose(fd);
                 close(socket);
-                remove(filename);
+                partial_remove(filename);
                 exit(EXIT_FAILURE);
             }
         }
@@ -203,54 +643,479 @@ void client_receive(FILE *fd, struct sockaddr *address, socklen_t slen, int sock
         {
             // Transfer timed out
             free(message);
+            free(reorder);
+            sink_free(&sink);
             fclose(fd);
             close(socket);
-            remove(filename);
+            partial_remove(filename);
             exit(EXIT_FAILURE);
         }
 
-        block++;
-        // Last packet received
-        if (x < blocksize)
+        if (block == 0 && ntohs(message->opcode) == OACK)
         {
-            end = true;
+            if (!handle_oack(message, x))
+            {
+                send_error(socket, address, slen, option_negogiaton, "Invalid options acknowledged\n");
+                free(message);
+                free(reorder);
+                sink_free(&sink);
+                fclose(fd);
+                close(socket);
+                partial_remove(filename);
+                exit(EXIT_FAILURE);
+            }
+            if (mc_accepted)
+            {
+                free(message);
+                fclose(fd);
+                if (!client_receive_multicast(address, slen, socket, filename))
+                {
+                    close(socket);
+                    remove(filename);
+                    exit(EXIT_FAILURE);
+                }
+                return;
+            }
+            message = realloc(message, sizeof(tftp_message) + blocksize);
+            sink_init(&sink, fd, lz_accepted, crc_accepted);
+            if (windowsize > 1)
+            {
+                reorder = malloc(REORDER_SLOTS * blocksize);
+                memset(early_block, 0, sizeof(early_block));
+                // Whole window can arrive at once, kernel limits the size to net.core.rmem_max
+                int size = windowsize * (blocksize + 512);
+                setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+            }
+            if (send_ack(socket, block, address, slen) < 0)
+            {
+                free(message);
+                free(reorder);
+                sink_free(&sink);
+                fclose(fd);
+                close(socket);
+                partial_remove(filename);
+                exit(EXIT_FAILURE);
+            }
+            continue;
         }
-        if (!opcodes_check_upload(socket, block, message, slen, address))
+        if (!started && ntohs(message->opcode) == DATA && ((delta_base != NULL && !signatures_accepted) || (bundle && !bundle_accepted)))
         {
+            // Server that does not know the option sends the base file or the manifest itself
+            send_error(socket, address, slen, option_negogiaton, "Option not supported\n");
+            printf("ERROR: Server does not send the signatures or the bundle\n");
             free(message);
+            free(reorder);
+            sink_free(&sink);
             fclose(fd);
             close(socket);
-            remove(filename);
             exit(EXIT_FAILURE);
         }
-        x = fwrite(message->data.data, 1, x - 4, fd);
-        if (x < 0)
+        if (!started && receive_stream == NULL && !resume_position(fd))
+        {
+            send_error(socket, address, slen, disk_full, "Write failed\n");
+            free(message);
+            free(reorder);
+            sink_free(&sink);
+            fclose(fd);
+            close(socket);
+            exit(EXIT_FAILURE);
+        }
+        if (!started && transfer_size > 0 && receive_stream == NULL)
+        {
+            // Data are copied straight to their place in the preallocated file
+            sink_map(&sink, transfer_size);
+            active_sink = &sink;
+            signal(SIGINT, interrupt_handler);
+            signal(SIGTERM, interrupt_handler);
+        }
+        started = true;
+        uint64_t received = block_unwrap(block, ntohs(message->data.block_number), rollover);
+        bool data = ntohs(message->opcode) == DATA;
+        data_packets += data;
+        if (block > 0 && data && received <= block)
+        {
+            retransmits++;
+            // Block that was already stored, the server sent it again because it did not get the ACK.
+            // In the window only the first copy of the acknowledged block is answered, the server then continues after the ACK
+            bool answer = windowsize == 1 ? received == block : received <= acked && !reacked;
+            if (!answer)
+            {
+                continue;
+            }
+            reacked = true;
+            acked = block;
+            if (send_ack(socket, block_wire(block, rollover), address, slen) < 0)
+            {
+                free(message);
+                free(reorder);
+                sink_free(&sink);
+                fclose(fd);
+                close(socket);
+                partial_remove(filename);
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        if (windowsize > 1 && data && received > block + 1 && received != UINT64_MAX)
+        {
+            size_t slot = received % REORDER_SLOTS;
+            if (early_block[slot] == received)
+            {
+                retransmits++;
+            }
+            if (received - block <= REORDER_SLOTS && early_block[slot] != received)
+            {
+                memcpy(reorder + slot * blocksize, message->data.data, x - 4);
+                early_block[slot] = received;
+                early_len[slot] = x - 4;
+                if (received > newest)
+                {
+                    newest = received;
+                }
+            }
+            // Missing block close behind the newest one was only reordered, the gap is reported once it falls further behind or when the window of the server ends
+            if (!gap && (received > block + REORDER_GAP || received >= acked + windowsize || x - 4 < blocksize))
+            {
+                gap = true;
+                reacked = false;
+                acked = block;
+                if (send_ack(socket, block_wire(block, rollover), address, slen) < 0)
+                {
+                    free(message);
+                    free(reorder);
+                    sink_free(&sink);
+                    fclose(fd);
+                    close(socket);
+                    partial_remove(filename);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            continue;
+        }
+        block++;
+        // Last packet received
+        if (x - 4 < blocksize)
+        {
+            end = true;
+        }
+        if (!opcodes_check_upload(socket, block_wire(block, rollover), message, slen, address))
         {
             free(message);
+            free(reorder);
+            sink_free(&sink);
             fclose(fd);
             close(socket);
-            remove(filename);
+            partial_remove(filename);
             exit(EXIT_FAILURE);
         }
-        x = send_ack(socket, block, address, slen);
+        uint8_t *stored_data = message->data.data;
+        ssize_t len = x - 4;
+        while (true)
+        {
+            payload_bytes += len;
+            bool stored = sink_write(&sink, stored_data, len);
+            if (!stored || (end && !sink_finish(&sink)))
+            {
+                // Finished stream that does not match its checksum or ends inside a frame is corrupted
+                send_error(socket, address, slen, stored ? 0 : disk_full, stored ? "ERROR: Transferred data corrupted\n" : "Write failed\n");
+                free(message);
+                free(reorder);
+                sink_free(&sink);
+                fclose(fd);
+                close(socket);
+                if (receive_stream == NULL)
+                {
+                    remove(filename);
+                }
+                exit(EXIT_FAILURE);
+            }
+            size_t slot = (block + 1) % REORDER_SLOTS;
+            if (end || reorder == NULL || early_block[slot] != block + 1)
+            {
+                break;
+            }
+            // Block that waited for the missing one is stored right after it
+            block++;
+            stored_data = reorder + slot * blocksize;
+            len = early_len[slot];
+            end = len < blocksize;
+            early_block[slot] = 0;
+        }
+        gap = false;
+        // Blocks after another gap may be waiting already, it is reported like when they arrived
+        bool behind = newest > block + 1 && (newest > block + REORDER_GAP || newest >= acked + windowsize || early_len[newest % REORDER_SLOTS] < blocksize);
+        if (!end && behind && block - acked < (uint64_t)windowsize)
+        {
+            // Server sends again only the missing block, the gap is reported right away instead of after the timeout
+            gap = true;
+            reacked = false;
+            acked = block;
+            if (send_ack(socket, block_wire(block, rollover), address, slen) < 0)
+            {
+                free(message);
+                free(reorder);
+                sink_free(&sink);
+                fclose(fd);
+                close(socket);
+                partial_remove(filename);
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        if (!end && block - acked < (uint64_t)windowsize)
+        {
+            // Server expects the ACK only after the whole window
+            continue;
+        }
+        acked = block;
+        reacked = false;
+        x = send_ack(socket, block_wire(block, rollover), address, slen);
         if (x < 0)
         {
             free(message);
+            free(reorder);
+            sink_free(&sink);
             fclose(fd);
             close(socket);
-            remove(filename);
+            partial_remove(filename);
             exit(EXIT_FAILURE);
         }
         // Last packet end transfer
         if (end)
         {
             free(message);
+            free(reorder);
             fclose(fd);
+            sink_free(&sink);
             return;
         }
     }
 }
 
+/**
+ * @brief Creates the socket receiving the blocks sent to the multicast group
+ * @param server Address of the server, the group is joined on the interface used to reach it
+ * @return Socket joined to the group, -1 if error occurs
+ */
+int multicast_socket(struct sockaddr_in *server)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int reuse = 1;
+    struct sockaddr_in addr;
+    struct ip_mreq mreq;
+    if (sock < 0)
+    {
+        printf("ERROR: socket()\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = mc_group;
+    addr.sin_port = htons(mc_port);
+    mreq.imr_multiaddr = mc_group;
+    mreq.imr_interface = local_address_to(server);
+    // Several clients on the same host listen to the same group and port
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+        bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+    {
+        printf("ERROR: multicast socket\n");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * @brief Function used by CLIENT for receiving the file from the multicast session (RFC 2090)
+ * Blocks can arrive in any order, every block is written on its place in the file and the received blocks are tracked.
+ * The master client ACKs the blocks it has in order, other clients ask for the lost blocks by unicast ACKs.
+ * @param socket Source ID
+ * @param address Destination address
+ * @param slen Adress lenght
+ * @param filename The name of the file that we are going to receive
+ * @return True if the whole file was received
+ */
+bool client_receive_multicast(struct sockaddr *address, socklen_t slen, int socket, char *filename)
+{
+    int mc_socket = multicast_socket((struct sockaddr_in *)address);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    uint8_t received[(UINT16_MAX + 1) / 8];
+    // All blocks up to prefix are received, last is the number of the final block if it is known
+    uint16_t prefix = 0, last = 0, highest = 0, first = 0;
+    int tiktok = RECV_RETRIES;
+    bool done = false;
+    tftp_message *message = malloc(sizeof(tftp_message) + blocksize);
+    if (mc_socket < 0 || fd < 0)
+    {
+        free(message);
+        if (mc_socket >= 0)
+        {
+            close(mc_socket);
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+    memset(received, 0, sizeof(received));
+    if (mc_master)
+    {
+        send_ack(socket, prefix, address, slen);
+    }
+    struct pollfd fds[2] = {{socket, POLLIN, 0}, {mc_socket, POLLIN, 0}};
+    while (!done)
+    {
+        int ready = poll(fds, 2, RECV_TIMEOUT * 1000);
+        if (ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready <= 0)
+        {
+            if (ready < 0 || --tiktok == 0)
+            {
+                break;
+            }
+            // Master client repeats its ACK, other clients ask for the next block they miss
+            send_ack(socket, prefix, address, slen);
+            continue;
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            if (!(fds[i].revents & POLLIN))
+            {
+                continue;
+            }
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+            ssize_t x = receive_message(fds[i].fd, message, (struct sockaddr *)&from, &fromlen, blocksize);
+            if (x < 4)
+            {
+                continue;
+            }
+            if (i == 0)
+            {
+                // Unicast messages come from the session port of the server
+                memcpy(address, &from, fromlen);
+            }
+            else if (from.sin_addr.s_addr != ((struct sockaddr_in *)address)->sin_addr.s_addr)
+            {
+                continue;
+            }
+            uint16_t opcode = ntohs(message->opcode);
+            if (opcode == ERROR)
+            {
+                printf("Error message received: %s", message->error.error_string);
+                ready = -1;
+                break;
+            }
+            if (opcode == OACK && i == 0)
+            {
+                // Server elected this client as the master client
+                if (!handle_oack(message, x))
+                {
+                    send_error(socket, address, slen, option_negogiaton, "Invalid options acknowledged\n");
+                    ready = -1;
+                    break;
+                }
+                tiktok = RECV_RETRIES;
+                if (mc_master)
+                {
+                    send_ack(socket, prefix, address, slen);
+                }
+                continue;
+            }
+            if (opcode != DATA)
+            {
+                continue;
+            }
+            tiktok = RECV_RETRIES;
+            uint16_t block = ntohs(message->data.block_number);
+            if (block == 0 || (received[block / 8] & (1 << (block % 8))))
+            {
+                continue;
+            }
+            if (pwrite(fd, message->data.data, x - 4, (off_t)(block - 1) * blocksize) != x - 4)
+            {
+                printf("ERROR: pwrite()\n");
+                ready = -1;
+                break;
+            }
+            received[block / 8] |= 1 << (block % 8);
+            if (x - 4 < blocksize)
+            {
+                last = block;
+            }
+            uint16_t before = prefix;
+            while (prefix < UINT16_MAX && (received[(prefix + 1) / 8] & (1 << ((prefix + 1) % 8))))
+            {
+                prefix++;
+            }
+            if (last && prefix >= last)
+            {
+                // Tells the server this client is done, so it is not elected as the master client
+                send_ack(socket, last, address, slen);
+                done = true;
+                break;
+            }
+            if (mc_master && prefix != before)
+            {
+                send_ack(socket, prefix, address, slen);
+            }
+            else if (!mc_master && i == 1)
+            {
+                // Blocks lost since this client joined the group are asked for right away
+                if (first == 0)
+                {
+                    first = block;
+                }
+                for (uint16_t lost = highest + 1; first && highest >= first && lost < block && lost - highest <= 16; lost++)
+                {
+                    send_ack(socket, lost - 1, address, slen);
+                }
+            }
+            if (block > highest)
+            {
+                highest = block;
+            }
+        }
+        if (ready < 0)
+        {
+            break;
+        }
+    }
+    free(message);
+    close(mc_socket);
+    close(fd);
+    return done;
+}
+
+/**
+ * @brief Skips the data that the server already has from the partial upload
+ * @param fd Uploaded stream
+ * @param offset Size of the partial upload
+ * @param crc Checksum of the last RESUME_WINDOW bytes of the partial upload
+ * @return True if the skipped data end with the same checksum
+ */
+bool resume_skip(FILE *fd, off_t offset, uint32_t crc)
+{
+    uint8_t *buf = malloc(RESUME_WINDOW);
+    off_t skip = offset > RESUME_WINDOW ? offset - RESUME_WINDOW : 0;
+    bool ok = buf != NULL;
+    while (ok && skip > 0)
+    {
+        size_t n = skip > RESUME_WINDOW ? RESUME_WINDOW : skip;
+        ok = fread(buf, 1, n, fd) == n;
+        skip -= n;
+    }
+    size_t len = offset - (offset > RESUME_WINDOW ? offset - RESUME_WINDOW : 0);
+    ok = ok && fread(buf, 1, len, fd) == len && crc32c_update(0, buf, len) == crc;
+    free(buf);
+    return ok;
+}
+
 /**
  * @brief Function used by CLIENT for transferring the file to the server
  * @param socket Source ID
@@ -263,68 +1128,194 @@ void client_receive(FILE *fd, struct sockaddr *address, socklen_t slen, int sock
 void client_send(struct sockaddr *address, socklen_t slen, int socket, char *filename)
 {
     ssize_t x, datalen;
-    uint8_t data[blocksize];
-    uint16_t block = 0;
-    tftp_message *message = malloc(sizeof(tftp_message)+blocksize);
-    int tiktok;
+    tftp_message *message = malloc(sizeof(tftp_message) + 512);
     x = receive_message(socket, message, address, &slen, 512);
+    if (x < 0)
+    {
+        printf("ERROR: Server does not respond\n");
+        close(socket);
+        exit(EXIT_FAILURE);
+    }
     if (x >= 0 && x < 4)
     {
         send_error(socket, address, slen, 0, "Invalid message received\n");
         close(socket);
         exit(EXIT_FAILURE);
     }
+    if (x >= 4 && ntohs(message->opcode) == ERROR)
+    {
+        printf("Error message received: %s", message->error.error_string);
+        close(socket);
+        exit(EXIT_FAILURE);
+    }
+    if (x >= 4 && ntohs(message->opcode) == OACK && !handle_oack(message, x))
+    {
+        send_error(socket, address, slen, option_negogiaton, "Invalid options acknowledged\n");
+        close(socket);
+        exit(EXIT_FAILURE);
+    }
     free(message);
-    while (true)
+    FILE *raw = null_bytes >= 0 ? null_source(null_bytes) : stdin;
+    FILE *in = raw;
+    if (delta_base != NULL && !delta_accepted)
     {
-        tftp_message *message = malloc(sizeof(tftp_message)+blocksize);
-        datalen = fread(data, 1, sizeof(data), stdin);
-        block++;
-        for (tiktok = RECV_RETRIES; tiktok; tiktok--)
+        send_error(socket, address, slen, option_negogiaton, "Delta not acknowledged\n");
+        printf("ERROR: Server does not accept the delta\n");
+        close(socket);
+        exit(EXIT_FAILURE);
+    }
+    if (delta_base != NULL)
+    {
+        // Chunks found in the base are sent as the references, the server copies them from its base
+        in = delta_source(raw, (uint8_t *)signatures, signatures_len);
+        if (in == NULL)
         {
-            x = send_data(datalen, slen, address, data, block, socket);
-            if (x < 0)
+            send_error(socket, address, slen, 0, "Malformed signatures\n");
+            printf("ERROR: Malformed signatures of the base file\n");
+            close(socket);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (resume_accepted && !resume_skip(stdin, resume_offset, resume_crc))
+    {
+        send_error(socket, address, slen, 0, "Partial upload differs\n");
+        printf("ERROR: Partial upload on the server differs, it was removed\n");
+        close(socket);
+        exit(EXIT_FAILURE);
+    }
+    // Reader thread keeps the blocks in the ring until they are acknowledged, retransmits are served from it
+    xfer_source src;
+    block_ring ring;
+    source_init(&src, in, lz_accepted, crc_accepted);
+    if (!ring_start(&ring, &src, blocksize, windowsize * 4 > RING_SLOTS ? windowsize * 4 : RING_SLOTS))
+    {
+        printf("ERROR: Can not start the reader\n");
+        close(socket);
+        exit(EXIT_FAILURE);
+    }
+    message = malloc(sizeof(tftp_message) + 512);
+    // Blocks are counted without wrapping, the messages carry their 16-bit numbers
+    uint64_t acked = 0, next = 1, last = 0, highest = 0;
+    int tiktok = RECV_RETRIES;
+    // Retransmission timer of the window, armed while some blocks are not acknowledged
+    timer_wheel wheel;
+    timer_entry retransmit;
+    bool timed_out = false;
+    if (!wheel_init(&wheel))
+    {
+        printf("ERROR: Out of memory\n");
+        close(socket);
+        exit(EXIT_FAILURE);
+    }
+    timer_init(&retransmit, timer_flag, &timed_out);
+    while (last == 0 || acked < last)
+    {
+        // Window is filled with the blocks that the reader already has
+        while (next <= acked + windowsize && (last == 0 || next <= last))
+        {
+            uint8_t *data;
+            datalen = ring_get(&ring, next, &data);
+            if (datalen == RING_PENDING)
             {
-                // ERROR sendto() terminate child process
-                close(socket);
-                exit(EXIT_FAILURE);
+                break;
             }
-            x = receive_message(socket, message, address, &slen, 512);
-            if (x >= 0 && x < 4)
+            if (datalen < 0 || send_data(datalen, slen, address, data, block_wire(next, rollover), socket) < 0)
             {
+                printf("ERROR: Can not send the data\n");
                 close(socket);
                 exit(EXIT_FAILURE);
             }
-
-            // I guess if we received a correct response on time we jump out of this for that is handling timeout, this break is not for while loop
-            // This means that we received correct response
-            if (x >= 4)
+            if (datalen < blocksize)
             {
-                break;
+                last = next;
+            }
+            data_packets++;
+            if (next > highest)
+            {
+                highest = next;
+                payload_bytes += datalen;
+            }
+            else
+            {
+                retransmits++;
             }
-            if (errno != EAGAIN)
+            next++;
+        }
+        if (next > acked + 1 && !timer_armed(&retransmit))
+        {
+            timer_arm(&wheel, &retransmit, RECV_TIMEOUT * 1000);
+        }
+        struct pollfd fds[2] = {{socket, POLLIN, 0}, {ring.notify[0], POLLIN, 0}};
+        // Without the blocks in flight no timer is armed and only the reader is waited for
+        int ready = poll(fds, 2, wheel_timeout(&wheel));
+        timed_out = false;
+        wheel_expire(&wheel);
+        if (timed_out)
+        {
+            timeouts++;
+            if (!--tiktok)
             {
+                printf("ERROR: Transfer timed out\n");
                 close(socket);
                 exit(EXIT_FAILURE);
             }
+            // Whole window after the last acknowledged block is sent again
+            next = acked + 1;
+            continue;
         }
-        if (!tiktok)
+        if (ready > 0 && (fds[1].revents & POLLIN))
         {
-            close(socket);
-            exit(EXIT_FAILURE);
+            ring_drain(&ring);
+        }
+        if (ready < 0 || !(fds[0].revents & POLLIN))
+        {
+            continue;
         }
-        if (!opcodes_check_download(message, block, block, slen, address))
+        x = receive_message(socket, message, address, &slen, 512);
+        if (x < 4 || ntohs(message->opcode) != ACK)
         {
+            if (x >= 4 && ntohs(message->opcode) == ERROR)
+            {
+                printf("Error message received: %s", message->error.error_string);
+            }
+            else
+            {
+                send_error(socket, address, slen, 0, "Invalid message received during transfer\n");
+            }
             close(socket);
             exit(EXIT_FAILURE);
         }
-        free(message);
-
-        // Last packet sent
-        if (datalen < blocksize)
+        uint64_t ack = block_unwrap(acked, ntohs(message->ack.block_number), rollover);
+        if (ack > acked && ack < next)
         {
-            return;
+            acked = ack;
+            ring_release(&ring, acked);
+            tiktok = RECV_RETRIES;
+            timer_cancel(&wheel, &retransmit);
         }
+        else if (windowsize > 1 && ack == acked && next > acked + 1)
+        {
+            // Server acknowledged the block before the gap again, the rest of the window is sent again.
+            // With one block in flight the duplicate ACK is ignored, the block is sent again only after the timeout
+            next = acked + 1;
+            timer_cancel(&wheel, &retransmit);
+        }
+    }
+    if (timer_report)
+    {
+        wheel_report(&wheel, "upload");
+    }
+    wheel_free(&wheel);
+    free(message);
+    ring_stop(&ring);
+    source_free(&src);
+    if (in != raw)
+    {
+        fclose(in);
+    }
+    if (raw != stdin)
+    {
+        fclose(raw);
     }
 }
 
@@ -339,30 +1330,17 @@ void send_request(char *mode, struct sockaddr *adress, socklen_t slen, int socke
 {
     int datalen = 0;
     char *modePosition;
-    if (type == DOWNLOAD)
-    {
-        datalen = strlen(filepath) + strlen(mode) + 2;
-        tftp_message_request *message = malloc(sizeof(tftp_message_request) + datalen);
-        message->request.opcode = htons(RRQ);
-
-        strcpy((char *)message->request.filename_and_mode, filepath);
-
-        modePosition = (char *)message->request.filename_and_mode + strlen(filepath) + 1;
-        strcpy(modePosition, mode);
-        sendto(socket, message, 2 + datalen, 0, adress, slen);
-        free(message);
-    }
-    else
-    {
-        datalen = strlen(destination_path) + strlen(mode) + 2;
-        tftp_message_request *message = malloc(sizeof(tftp_message_request) + datalen);
-        message->request.opcode = htons(WRQ);
-        strcpy(message->request.filename_and_mode, destination_path);
-        modePosition = message->request.filename_and_mode + strlen(destination_path) + 1;
-        strcpy(modePosition, mode);
-        sendto(socket, message, 2 + datalen, 0, adress, slen);
-        free(message);
-    }
+    char *path = type == DOWNLOAD ? filepath : destination_path;
+    datalen = strlen(path) + strlen(mode) + 2;
+    tftp_message_request *message = malloc(sizeof(tftp_message_request) + datalen + request_options_len);
+    message->request.opcode = htons(type == DOWNLOAD ? RRQ : WRQ);
+    strcpy((char *)message->request.filename_and_mode, path);
+    modePosition = (char *)message->request.filename_and_mode + strlen(path) + 1;
+    strcpy(modePosition, mode);
+    // Options follow the mode as pairs of name and value strings
+    memcpy(message->request.filename_and_mode + datalen, request_options, request_options_len);
+    sendto(socket, message, 2 + datalen + request_options_len, 0, adress, slen);
+    free(message);
 }
 
 /**
@@ -393,6 +1371,48 @@ void handle_wrq(int socket, socklen_t slen, struct sockaddr *address, char *mode
     client_send(address, slen, socket, destination_path);
 }
 
+/**
+ * @brief Downloads the signatures of the base file into the memory, the delta upload is encoded against them
+ * @param server Address of the server
+ */
+void signatures_fetch(struct sockaddr_in *server)
+{
+    char value[12];
+    // Download shares the globals with the upload that follows it
+    type = DOWNLOAD;
+    filepath = delta_base;
+    receive_stream = open_memstream(&signatures, &signatures_len);
+    if (receive_stream == NULL)
+    {
+        printf("ERROR: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(value, sizeof(value), "%d", DELTA_CHUNK);
+    request_option_add("signatures", value);
+    request_option_add("tsize", "0");
+    if (window_request > 1)
+    {
+        snprintf(value, sizeof(value), "%d", window_request);
+        request_option_add("windowsize", value);
+    }
+    // Address is changed to the port of the session when the first reply arrives
+    struct sockaddr_in address = *server;
+    int socket = create_socket();
+    handle_rrq(socket, sizeof(address), (struct sockaddr *)&address, "octet");
+    close(socket);
+    // Stream was closed at the end of the download, its buffer holds the signatures
+    receive_stream = NULL;
+    type = UPLOAD;
+    blocksize = 512;
+    windowsize = 1;
+    request_options_len = 0;
+    transfer_size = 0;
+    payload_bytes = 0;
+    data_packets = 0;
+    retransmits = 0;
+    timeouts = 0;
+}
+
 /**
  * @brief Main function
  * @param argc number of arguments
@@ -419,7 +1439,78 @@ int main(int argc, char **argv)
     server_address.sin_port = htons(port);
     socklen_t adress_size = sizeof(server_address);
     struct sockaddr *adress = (struct sockaddr *)&server_address;
+    if (delta_base != NULL)
+    {
+        signatures_fetch(&server_address);
+    }
     socket = create_socket();
+    if (multicast)
+    {
+        request_option_add("multicast", "");
+    }
+    if (compress)
+    {
+        request_option_add("compress", "lz");
+    }
+    if (checksum)
+    {
+        request_option_add("checksum", "crc32c");
+    }
+    if (window_request > 1 && !multicast)
+    {
+        char value[12];
+        snprintf(value, sizeof(value), "%d", window_request);
+        request_option_add("windowsize", value);
+    }
+    struct stat st;
+    if (type == DOWNLOAD)
+    {
+        request_option_add("tsize", "0");
+    }
+    else if (null_bytes >= 0)
+    {
+        char value[32];
+        snprintf(value, sizeof(value), "%lld", null_bytes);
+        request_option_add("tsize", value);
+    }
+    else if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        // Server checks whether the uploaded file fits on its disk
+        char value[32];
+        snprintf(value, sizeof(value), "%lld", (long long)st.st_size);
+        request_option_add("tsize", value);
+    }
+    if (rollover_request >= 0)
+    {
+        request_option_add("rollover", rollover_request ? "1" : "0");
+    }
+    if (delta_base != NULL)
+    {
+        request_option_add("delta", delta_base);
+    }
+    if (discard)
+    {
+        receive_stream = null_sink();
+    }
+    if (bundle)
+    {
+        request_option_add("bundle", "1");
+        receive_stream = bundle_unpack(destination_path);
+        if (receive_stream == NULL)
+        {
+            printf("ERROR: Can not create the directory\n");
+            return 1;
+        }
+    }
+    if (resume && type == DOWNLOAD)
+    {
+        resume_request(destination_path);
+    }
+    else if (resume)
+    {
+        request_option_add("resume", "");
+    }
+    double start = transfer_clock();
     if (type == DOWNLOAD)
     {
         handle_rrq(socket, adress_size, adress, mode);
@@ -428,6 +1519,21 @@ int main(int argc, char **argv)
     {
         handle_wrq(socket, adress_size, adress, mode);
     }
+    if (null_bytes >= 0 || discard)
+    {
+        transfer_report(transfer_clock() - start);
+    }
+    if (bundle && !bundle_complete)
+    {
+        printf("ERROR: Bundle ended before all its files arrived\n");
+        return 1;
+    }
+    if (delta_base != NULL)
+    {
+        // Sent bytes include the operations and the compression, the signatures were downloaded before
+        printf("DELTA copied=%llu literal=%llu sent=%llu signatures=%zu\n", delta_copied, delta_literal, payload_bytes, signatures_len);
+        free(signatures);
+    }
     // Ends the communication with the server
     if (close(socket) < 0)
     {
@@ -4,24 +4,41 @@
  * @brief  ISA Project
  * @date 2023-10-22
  */
-#ifndef TFTP-CLIENT_H
+#ifndef TFTP_CLIENT_H
 #define TFTP_CLIENT_H
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "messages.h"
 
-void handle_hostname(char *a, char *b);
+void handle_port(char *b);
 
-void handle_dfilepath(char *a, char *b);
+void arguments_check(int num, char **argarr);
 
-void handle_port(char *a, char *b);
+void request_option_add(char *name, char *value);
 
-void handle_filepath(char *a, char *b);
+bool handle_oack(tftp_message *message, ssize_t len);
 
-void arguments_check(int num, char **argarr);
+void interrupt_handler(int sig);
+
+void partial_remove(char *filename);
+
+bool resume_position(FILE *fd);
+
+void resume_request(char *filename);
+
+bool resume_skip(FILE *fd, off_t offset, uint32_t crc);
+
+int multicast_socket(struct sockaddr_in *server);
+
+bool client_receive_multicast(struct sockaddr *address, socklen_t slen, int socket, char *filename);
 
 void send_request( char *mode, struct sockaddr *adress, socklen_t slen, int socket);
 
-void handle_rrq(int socket, socklen_t slen, struct sockaddr *adress);
+void handle_rrq(int socket, socklen_t slen, struct sockaddr *adress, char *mode);
 
-void handle_wrq(int socket, socklen_t slen, struct sockaddr *adress);
+void handle_wrq(int socket, socklen_t slen, struct sockaddr *adress, char *mode);
 
 
 #endif
\ No newline at end of file
@@ -17,17 +17,94 @@
 #include <errno.h>
 #include <sys/statvfs.h>
 #include <sys/stat.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/file.h>
+#include <signal.h>
+#include <math.h>
 #include "tftp-server.h"
 #include "messages.h"
+#include "sessions.h"
+#include "stream.h"
+#include "crc32c.h"
+#include "timer.h"
+#include "trace.h"
+#include "profiles.h"
+#include "tstamp.h"
+#include "control.h"
+#include "delta.h"
+#include "bundle.h"
+#include "xdp.h"
 #define PORT 69
 #define RECV_RETRIES 5
+// Blocks of the download window are kept in the memory, the window is lowered to fit into this many bytes
+#define WINDOW_BYTES (8 * 1024 * 1024)
+// Shortest timeout computed from the kernel timestamps, in seconds
+#define RTO_MIN 0.2
+// Number of 10 ms waits for the cancelled previous session to release the staged upload
+#define STAGING_TAKEOVER 100
 int port = -1;
 char *directory;
 int RECV_TIMEOUT = 5;
-int tsize = 0;
+off_t tsize = 0;
 int blocksize = 512;
+// Number of the block that follows the block 65535, negotiated by the rollover option
+int rollover = 0;
+// Number of the blocks received before the ACK is sent (RFC 7440)
+int windowsize = 1;
 int timeout;
 struct timeval tv;
+bool multicast = false;
+bool mcast_enabled = false;
+struct in_addr mcast_group;
+int mcast_port = 1758;
+// Read end of the pipe that delivers the clients joining the multicast session
+int mc_pipe = -1;
+// Write ends of the pipes of the multicast sessions, used only by the main server process
+int mc_pipes[SESSION_SLOTS];
+bool compress = false;
+bool checksum = false;
+// Offset the download continues from and the checksum of the data the client already has before it
+bool resume = false;
+off_t resume_offset = 0;
+uint32_t resume_crc = 0;
+// Base file the upload is reconstructed from, NULL if the whole file is uploaded
+char *delta_base = NULL;
+// Chunk size of the signatures sent instead of the requested file, 0 if the file itself is sent
+uint32_t signature_chunk = 0;
+// True if the requested file is the manifest of the bundle, its members are sent instead of it
+bool bundle = false;
+FILE *bundle_fd = NULL;
+off_t bundle_size = 0;
+// Interface the AF_XDP engine is started on, NULL if only the sockets are used
+char *xdp_ifname = NULL;
+// Directory with the compressed copies of the files, NULL if the copies are not kept
+char *cache_dir = NULL;
+char cache_path[PATH_MAX];
+char cache_tmp[PATH_MAX + 32];
+// Directory with the partially uploaded files, NULL if the partial uploads are removed
+char *staging_dir = NULL;
+// Partial uploads untouched for this many seconds are removed
+int staging_ttl = 86400;
+char staging_path[PATH_MAX];
+time_t staging_collected = 0;
+// ACKs of the block sent before the current one and of the even older blocks, they are ignored
+unsigned long duplicate_acks = 0;
+unsigned long stale_acks = 0;
+// DATA blocks the client sent again because it did not get their ACK
+unsigned long duplicate_data = 0;
+// Outcome of the transfer of the session, it updates the profile of the client
+session_stats stats;
+// Socket and client of the session, the session cancelled from the control socket sends ERROR to the client
+int cancel_socket = -1;
+struct sockaddr_in cancel_peer;
+// Smoothed round trip time and its variation from the kernel timestamps (RFC 6298), 0 before the first sample
+double srtt = 0;
+double rttvar = 0;
 
 /**
  * @brief Function that creates UDP socket
@@ -44,6 +121,22 @@ int create_socket()
     return sock;
 }
 
+/**
+ * @brief Finds the end of the string of the request
+ * @param str Start of the string, NULL if the previous string was not terminated
+ * @param end End of the request
+ * @return Start of the next string, NULL if the string is not terminated inside the request
+ */
+static char *request_next(char *str, char *end)
+{
+    if (str == NULL || str >= end)
+    {
+        return NULL;
+    }
+    char *term = memchr(str, '\0', end - str);
+    return term ? term + 1 : NULL;
+}
+
 /**
  * @brief Function used by SERVER for printing out message info
  * @param socket Destination ID
@@ -65,61 +158,32 @@ void request_message_info(tftp_message_request *message, struct sockaddr *addres
     struct sockaddr_in *addr_in = (struct sockaddr_in *)address;
     (void)inet_ntop(AF_INET, &(addr_in->sin_addr), ip_str, INET_ADDRSTRLEN);
     int source_port = ntohs(addr_in->sin_port);
-    char *options = NULL;
-    ssize_t lenght = 0;
-    switch ((ntohs(message->request.opcode)))
+    uint16_t opcode = ntohs(message->request.opcode);
+    if (opcode != RRQ && opcode != WRQ)
     {
-    case WRQ:
-        options = message->request.filename_and_mode;
-        lenght += strlen(options);
-        fprintf(stderr, "WRQ %s:%d \"%s\" ", ip_str, source_port, options);
-        options = strchr(options, '\0') + 1;
-        lenght += strlen(options);
-        fprintf(stderr, "%s", options);
-        if (lenght == bsize - 4)
-        {
-            fprintf(stderr, "\n");
-        }
-        else
-        {
-            options = strchr(options, '\0') + 1;
-            fprintf(stderr, " ");
-            while (options[0] != '\0')
-            {
-                fprintf(stderr, "%s", options);
-                options = strchr(options, '\0') + 1;
-                fprintf(stderr, "=%s ", options);
-                options = strchr(options, '\0') + 1;
-            }
-            fprintf(stderr, "\n");
-        }
-        break;
-    case RRQ:
-        options = message->request.filename_and_mode;
-        lenght += strlen(options);
-        fprintf(stderr, "RRQ %s:%d \"%s\" ", ip_str, source_port, options);
-        options = strchr(options, '\0') + 1;
-        lenght += strlen(options);
-        fprintf(stderr, "%s", options);
-        if (lenght == bsize - 4)
-        {
-            fprintf(stderr, "\n");
-        }
-        else
+        return;
+    }
+    // Strings of the request are terminated by receive_message_request(), none of them is read past the end of the datagram
+    char *end = (char *)message + bsize;
+    char *filename = (char *)message->request.filename_and_mode;
+    char *mode = request_next(filename, end);
+    fprintf(stderr, "%s %s:%d \"%s\" %s", opcode == RRQ ? "RRQ" : "WRQ", ip_str, source_port, filename, mode ? mode : "");
+    char *options = request_next(mode, end);
+    if (options != NULL && options < end)
+    {
+        fprintf(stderr, " ");
+        while (options < end && options[0] != '\0')
         {
-            options = strchr(options, '\0') + 1;
-            fprintf(stderr, " ");
-            while (options[0] != '\0')
+            char *value = request_next(options, end);
+            fprintf(stderr, "%s=%s ", options, value && value < end ? value : "");
+            options = request_next(value, end);
+            if (options == NULL)
             {
-                fprintf(stderr, "%s", options);
-                options = strchr(options, '\0') + 1;
-                fprintf(stderr, "=%s ", options);
-                options = strchr(options, '\0') + 1;
+                break;
             }
-            fprintf(stderr, "\n");
         }
-        break;
     }
+    fprintf(stderr, "\n");
 }
 /**
  * @brief Function used by both SERVER and CLIENT for receiving message
@@ -131,7 +195,7 @@ void request_message_info(tftp_message_request *message, struct sockaddr *addres
  */
 ssize_t receive_message_request(int socket, tftp_message_request *message, struct sockaddr *address, socklen_t *slen)
 {
-    ssize_t bsize = recvfrom(socket, message, sizeof(message) + 512, 0, address, slen);
+    ssize_t bsize = engine_recvfrom(socket, message, MAX_REQUEST, 0, address, slen);
     if (bsize < 0)
     {
         printf("ERROR recvfrom()\n");
@@ -139,6 +203,8 @@ ssize_t receive_message_request(int socket, tftp_message_request *message, struc
     }
     else
     {
+        // Strings of the request are always terminated, even if the client did not terminate them
+        ((char *)message)[bsize] = '\0';
         request_message_info(message, address, socket, bsize);
         return bsize;
     }
@@ -164,6 +230,40 @@ void server_bind(int server_socket)
     }
 }
 
+/**
+ * @brief Parses the limit passed by the user
+ * @param str Limit passed by the user
+ * @return Parsed limit, exits the programme if the limit is invalid
+ */
+int parse_limit(char *str)
+{
+    char *end;
+    long limit = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || limit < 0 || limit > SESSION_SLOTS)
+    {
+        printf("ERROR: Invalid limit \"%s\"\n", str);
+        exit(EXIT_FAILURE);
+    }
+    return (int)limit;
+}
+
+/**
+ * @brief Parses the time in seconds passed by the user
+ * @param str Number of seconds passed by the user
+ * @return Parsed number of seconds, exits the programme if it is invalid
+ */
+int parse_seconds(char *str)
+{
+    char *end;
+    long seconds = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || seconds <= 0 || seconds > INT_MAX)
+    {
+        printf("ERROR: Invalid number of seconds \"%s\"\n", str);
+        exit(EXIT_FAILURE);
+    }
+    return (int)seconds;
+}
+
 /**
  * @brief Checks whether the SERVER arguments are passed in the correct way
  * @param argscount Number of arguments
@@ -171,45 +271,192 @@ void server_bind(int server_socket)
  */
 void check_args(int argscount, char **args)
 {
-    if (argscount != 4)
+    static struct option long_options[] = {
+        {"max-sessions", required_argument, 0, OPT_MAX_SESSIONS},
+        {"max-per-ip", required_argument, 0, OPT_MAX_PER_IP},
+        {"max-per-subnet", required_argument, 0, OPT_MAX_PER_SUBNET},
+        {"subnet-prefix", required_argument, 0, OPT_SUBNET_PREFIX},
+        {"max-rps", required_argument, 0, OPT_MAX_RPS},
+        {"session-rate", required_argument, 0, OPT_SESSION_RATE},
+        {"client-rate", required_argument, 0, OPT_CLIENT_RATE},
+        {"mcast-group", required_argument, 0, OPT_MCAST_GROUP},
+        {"mcast-port", required_argument, 0, OPT_MCAST_PORT},
+        {"compress-cache", required_argument, 0, OPT_COMPRESS_CACHE},
+        {"staging-dir", required_argument, 0, OPT_STAGING_DIR},
+        {"staging-ttl", required_argument, 0, OPT_STAGING_TTL},
+        {"uplink-rate", required_argument, 0, OPT_UPLINK_RATE},
+        {"sched-aging", required_argument, 0, OPT_SCHED_AGING},
+        {"sched-class", required_argument, 0, OPT_SCHED_CLASS},
+        {"trace", required_argument, 0, OPT_TRACE},
+        {"trace-ip", required_argument, 0, OPT_TRACE_IP},
+        {"trace-name", required_argument, 0, OPT_TRACE_NAME},
+        {"profile-file", required_argument, 0, OPT_PROFILE_FILE},
+        {"profile-decay", required_argument, 0, OPT_PROFILE_DECAY},
+        {"timestamps", no_argument, 0, OPT_TIMESTAMPS},
+        {"control", required_argument, 0, OPT_CONTROL},
+        {"xdp", required_argument, 0, OPT_XDP},
+        {0, 0, 0, 0}};
+    session_limits *limits = &sessions->limits;
+    // Port number was not specified from the user, the RFC says that PORT 69 should be used
+    port = PORT;
+    int opt;
+    while ((opt = getopt_long(argscount, args, "p:", long_options, NULL)) != -1)
     {
-        // Port number was not specified from the user, the RFC says that PORT 69 should be used
-        port = PORT;
-        if (argscount != 2)
-        {
-            printf("ERROR:Invalid number of arguments\n");
-            exit(EXIT_FAILURE);
-        }
-        else
+        switch (opt)
         {
-            directory = args[1];
-            if (chdir(directory) < 0)
+        case 'p':
+            if (atoi(optarg) < 0 || atoi(optarg) > 65535)
+            {
+                printf("ERROR: Invalid port number\n");
+                exit(EXIT_FAILURE);
+            }
+            // We received valid port number from input->we set the
+            port = atoi(optarg);
+            break;
+        case OPT_MAX_SESSIONS:
+            limits->max_sessions = parse_limit(optarg);
+            break;
+        case OPT_MAX_PER_IP:
+            limits->max_per_ip = parse_limit(optarg);
+            break;
+        case OPT_MAX_PER_SUBNET:
+            limits->max_per_subnet = parse_limit(optarg);
+            break;
+        case OPT_SUBNET_PREFIX:
+            limits->subnet_prefix = parse_limit(optarg);
+            if (limits->subnet_prefix > 32)
+            {
+                printf("ERROR: Invalid subnet prefix\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_MAX_RPS:
+            limits->max_rps = parse_rate(optarg);
+            break;
+        case OPT_SESSION_RATE:
+            limits->session_rate = parse_rate(optarg);
+            break;
+        case OPT_CLIENT_RATE:
+            limits->client_rate = parse_rate(optarg);
+            break;
+        case OPT_MCAST_GROUP:
+            if (inet_pton(AF_INET, optarg, &mcast_group) != 1 || !IN_MULTICAST(ntohl(mcast_group.s_addr)))
+            {
+                printf("ERROR: Invalid multicast group\n");
+                exit(EXIT_FAILURE);
+            }
+            mcast_enabled = true;
+            break;
+        case OPT_MCAST_PORT:
+            mcast_port = atoi(optarg);
+            if (mcast_port <= 0 || mcast_port + SESSION_SLOTS > 65535)
+            {
+                printf("ERROR: Invalid multicast port\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_COMPRESS_CACHE:
+            cache_dir = realpath(optarg, NULL);
+            if (cache_dir == NULL)
+            {
+                printf("ERROR: Invalid cache directory\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_STAGING_DIR:
+            staging_dir = realpath(optarg, NULL);
+            if (staging_dir == NULL)
+            {
+                printf("ERROR: Invalid staging directory\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_STAGING_TTL:
+            staging_ttl = parse_seconds(optarg);
+            break;
+        case OPT_UPLINK_RATE:
+            limits->uplink_rate = parse_rate(optarg);
+            break;
+        case OPT_SCHED_AGING:
+            limits->sched_aging = atof(optarg);
+            if (limits->sched_aging <= 0)
+            {
+                printf("ERROR: Invalid aging time\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_SCHED_CLASS:
+            if (!sched_add_class(optarg))
+            {
+                printf("ERROR: Invalid scheduling class \"%s\"\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_TRACE:
+            if (!trace_open(optarg))
+            {
+                printf("ERROR: Can not create the trace file\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_TRACE_IP:
+            if (!trace_filter_ip(optarg))
+            {
+                printf("ERROR: Invalid trace address\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_TRACE_NAME:
+            trace_filter_name(optarg);
+            break;
+        case OPT_PROFILE_FILE:
+            if (!profiles_open(optarg))
+            {
+                printf("ERROR: Can not read the profile file\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_PROFILE_DECAY:
+            profiles->decay = atoi(optarg);
+            if (profiles->decay <= 0)
+            {
+                printf("ERROR: Invalid decay time\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_TIMESTAMPS:
+            timestamping = true;
+            break;
+        case OPT_CONTROL:
+            if (!control_open(optarg))
             {
-                printf("ERROR: Invalid directory path passed \n");
+                printf("ERROR: Can not create the control socket\n");
                 exit(EXIT_FAILURE);
             }
+            break;
+        case OPT_XDP:
+            xdp_ifname = optarg;
+            break;
+        default:
+            printf("ERROR:Invalid arguments\n");
+            exit(EXIT_FAILURE);
         }
     }
-    else
+    if (limits->max_rps < 0 || limits->session_rate < 0 || limits->client_rate < 0 || limits->uplink_rate < 0)
     {
-        directory = args[3];
-        if (strcmp(args[1], "-p"))
-        {
-            printf("ERROR:Expected \"-p\" argument to be here \n");
-            exit(EXIT_FAILURE);
-        }
-        else if (atoi(args[2]) < 0 || atoi(args[2]) > 65635)
-        {
-            printf("ERROR: Invalid port number\n");
-            exit(EXIT_FAILURE);
-        }
-        else if (chdir(directory) < 0)
-        {
-            printf("ERROR: Invalid directory path passed \n");
-            exit(EXIT_FAILURE);
-        }
-        // We received valid port number from input->we set the
-        port = atoi(args[2]);
+        printf("ERROR: Invalid rate\n");
+        exit(EXIT_FAILURE);
+    }
+    if (optind != argscount - 1)
+    {
+        printf("ERROR:Invalid number of arguments\n");
+        exit(EXIT_FAILURE);
+    }
+    directory = args[optind];
+    if (chdir(directory) < 0)
+    {
+        printf("ERROR: Invalid directory path passed \n");
+        exit(EXIT_FAILURE);
     }
 }
 
@@ -220,14 +467,18 @@ void check_args(int argscount, char **args)
  * @param asize Size of the file
  * @param directory_path Path of the directory that is about to be checked
  * @param tsize Size of the file that is to be sent
- * @return True if there is enough space
+ * @return True if there is enough space or the space is not known
  */
-bool check_dir_space(char *directory_path, unsigned long asize)
+bool check_dir_space(char *directory_path, off_t asize)
 {
     struct statvfs st;
-    statvfs(directory_path, &st);
-    unsigned long free_space = st.f_bfree * st.f_frsize;
-    if (asize > free_space)
+    if (statvfs(directory_path, &st) < 0)
+    {
+        // Unknown space does not reject the upload, writing it fails if the space runs out
+        return true;
+    }
+    unsigned long long free_space = (unsigned long long)st.f_bfree * st.f_frsize;
+    if ((unsigned long long)asize > free_space)
     {
         return false;
     }
@@ -235,421 +486,1950 @@ bool check_dir_space(char *directory_path, unsigned long asize)
 }
 
 /**
- * @brief Attaches given string to the options
- * @param str String to attach to the options
- * @param lenght Current lenght of the options
- * @return Lenght of the options
+ * @brief Attaches the option to the accepted options, the OACK is built this way
+ * @param req Parsed request
+ * @param name Name of the option
+ * @param value Value of the option
+ * @return True if the option fits into the OACK
  */
-int options_attach(char *str, int lenght, char *opts)
+bool options_append(tftp_request *req, char *name, char *value)
 {
-    if (lenght == 0)
+    size_t nlen = strlen(name) + 1, vlen = strlen(value) + 1;
+    if (req->opts_len + nlen + vlen > OPTIONS_SIZE)
     {
-        strcpy(opts, str);
-        lenght += strlen(str);
-        return lenght;
+        return false;
     }
-    else
+    memcpy(req->opts + req->opts_len, name, nlen);
+    memcpy(req->opts + req->opts_len + nlen, value, vlen);
+    req->opts_len += nlen + vlen;
+    req->opts[req->opts_len] = '\0';
+    return true;
+}
+
+/**
+ * @brief Finds the accepted option
+ * @param req Parsed request
+ * @param name Name of the option
+ * @return Value of the option, NULL if the option was not accepted
+ */
+char *options_get(tftp_request *req, char *name)
+{
+    char *str = req->opts;
+    while (str < req->opts + req->opts_len)
     {
-        strcpy(opts + lenght + 1, str);
-        lenght += strlen(str);
-        return lenght + 1;
+        char *value = str + strlen(str) + 1;
+        if (!strcasecmp(str, name))
+        {
+            return value;
+        }
+        str = value + strlen(value) + 1;
     }
+    return NULL;
 }
+
 /**
- * @brief Checks and parses the options
- * @param options String of options that needs to be checked and parsed
- * @return True if everything is the way it should be, False if error occurrs
+ * @brief Removes the option from the accepted options
+ * @param req Parsed request
+ * @param name Name of the option
  */
-bool parse_options(char *options, char *opts)
+void options_remove(tftp_request *req, char *name)
 {
-    int lenght = 0;
-    while (options[0] != '\0')
+    char *str = req->opts;
+    while (str < req->opts + req->opts_len)
     {
-        options = strchr(options, '\0') + 1;
-        if (!strcasecmp(options, "blksize"))
+        char *value = str + strlen(str) + 1;
+        char *next = value + strlen(value) + 1;
+        if (!strcasecmp(str, name))
         {
-            lenght = options_attach(options, lenght, opts);
-            options = strchr(options, '\0') + 1;
-            if (options[0] == '\0')
-            {
-                return false;
-            }
-            else
-            {
-                blocksize = atoi(options);
-                if (blocksize < 8 || blocksize > 65464)
-                {
-                    return false;
-                }
-                else
-                {
-                    lenght = options_attach(options, lenght, opts);
-                    continue;
-                }
-            }
+            memmove(str, next, req->opts + req->opts_len + 1 - next);
+            req->opts_len -= next - str;
+            continue;
         }
-        if (!strcasecmp(options, "timeout"))
+        str = next;
+    }
+}
+
+/**
+ * @brief Replaces the value of the accepted option with the lowered number
+ * @param req Parsed request
+ * @param name Name of the option
+ * @param value New value of the option
+ */
+void options_set(tftp_request *req, char *name, long long value)
+{
+    char str[24];
+    snprintf(str, sizeof(str), "%lld", value);
+    options_remove(req, name);
+    options_append(req, name, str);
+}
+
+/**
+ * @brief Sends the OACK with the accepted options, it was built by parse_request()
+ * @param socket Source ID
+ * @param address Destination address
+ * @param len Address lenght
+ * @param req Parsed request
+ * @return Number of bytes that have been sent
+ */
+ssize_t oack_send(int socket, struct sockaddr *address, socklen_t len, tftp_request *req)
+{
+    ssize_t x = engine_sendto(socket, req->oack, 4 + req->opts_len, 0, address, len);
+    if (x < 0)
+    {
+        printf("ERROR sendto()\n");
+    }
+    trace_instant("OACK", 0, x);
+    return x;
+}
+
+/**
+ * @brief Finds the value of the option in the request without parsing the whole request
+ * @param msg Request message, its strings are terminated by receive_message_request()
+ * @param lenght Lenght of the request
+ * @param name Name of the option
+ * @return Value of the option, NULL if the client did not request the option
+ */
+char *request_option(tftp_message_request *msg, ssize_t lenght, char *name)
+{
+    char *end = (char *)msg + lenght;
+    // Skip filename and mode
+    char *str = request_next(request_next((char *)msg->request.filename_and_mode, end), end);
+    while (str != NULL && str < end)
+    {
+        char *value = request_next(str, end);
+        if (value == NULL || value >= end)
         {
-            lenght = options_attach(options, lenght, opts);
-            options = strchr(options, '\0') + 1;
-            if (options[0] == '\0')
-            {
-                printf("Time optionswrongly passed \n");
-                return false;
-            }
-            else
-            {
-                timeout = atoi(options);
-                if (timeout > 255 || timeout < 1)
-                {
-                    printf("Time option wrongly passed \n");
-                    return false;
-                }
-                else
-                {
-                    tv.tv_sec = timeout;
-                    lenght = options_attach(options, lenght, opts);
-                    continue;
-                }
-            }
+            return NULL;
         }
-        if (!strcasecmp(options, "tsize"))
+        if (!strcasecmp(str, name))
         {
-            lenght = options_attach(options, lenght, opts);
-            options = strchr(options, '\0') + 1;
-            if (options[0] == '\0')
-            {
-                printf("Tsize option wrongly passed \n");
-                return false;
-            }
-            else
-            {
-                tsize = atoi(options);
-                if (tsize <= 0 || !check_dir_space(directory, tsize))
-                {
-                    printf("Tsize option wrongly passed \n");
-                    return false;
-                }
-                else
-                {
-                    lenght = options_attach(options, lenght, opts);
-                    continue;
-                }
-            }
+            return value;
         }
+        str = request_next(value, end);
     }
-    return true;
+    return NULL;
 }
 
-ssize_t send_netascii_data(ssize_t len, socklen_t slen, struct sockaddr *address, char *data, uint16_t block, int socket)
+/**
+ * @brief Parses the decimal value of the option, unlike atoi() it rejects everything but digits
+ * @param value Value of the option
+ * @param min Smallest allowed number
+ * @param max Biggest allowed number
+ * @param number Set to the parsed number
+ * @return True if the value is a number in the range
+ */
+static bool parse_number(char *value, long long min, long long max, long long *number)
 {
-    tftp_message *message = malloc(sizeof(tftp_message) + len);
-    message->data.opcode = htons(DATA);
-    message->data.block_number = htons(block);
-    memcpy(message->data.data, data, len);
-    ssize_t x;
-    if ((x = sendto(socket, message, len + 4, 0, address, slen)) < 0)
+    long long n = 0;
+    if (value[0] == '\0')
     {
-        printf("ERROR: sendto()\n");
+        return false;
     }
-    free(message);
-    return x;
+    for (char *c = value; *c; c++)
+    {
+        if (*c < '0' || *c > '9' || n > (max - (*c - '0')) / 10)
+        {
+            return false;
+        }
+        n = n * 10 + (*c - '0');
+    }
+    *number = n;
+    return n >= min;
 }
 
 /**
- * @brief Function used by SERVER for handling the download process
- * @param socket Source ID
- * @param address Destination address
- * @param slen Adress lenght
- * @param message Structured data type used for storing informations about the messages
- * @param filename The name of the file that we are going to sent
- * @param fd File that we are going to work with
- * @return Number of bytes that have been sent
+ * @brief Parses the request in one pass, no string is read past the end of the datagram.
+ *        Accepted options are attached to the OACK while they are parsed.
+ * @param msg Received request
+ * @param lenght Lenght of the request
+ * @param req Parsed request
+ * @param error Set to the error code for the client if the request is rejected
+ * @param reason Set to the message for the client if the request is rejected
+ * @return True if the request is valid
  */
-void server_download(FILE *fd, struct sockaddr *address, socklen_t slen, int socket, char *filename, char *opts, int mode, bool optionsi)
+bool parse_request(tftp_message_request *msg, ssize_t lenght, tftp_request *req, int *error, char **reason)
 {
-    ssize_t x, datalen;
-    uint8_t data[blocksize];
-    char *ndata = malloc(blocksize);
-    uint16_t block = 0;
-    tftp_message message;
-    int tiktok;
-    bool extrach = false;
-    char extra;
-    if (optionsi)
+    char *end = (char *)msg + lenght;
+    uint16_t opcode = htons(OACK), block = 0;
+    memcpy(req->oack, &opcode, 2);
+    memcpy(req->oack + 2, &block, 2);
+    req->opcode = ntohs(msg->opcode);
+    req->opts = (char *)req->oack + 4;
+    req->opts_len = 0;
+    req->opts[0] = '\0';
+    req->filename = (char *)msg->request.filename_and_mode;
+    char *mode = request_next(req->filename, end);
+    char *options = request_next(mode, end);
+    *error = not_defined;
+    if (mode == NULL || options == NULL || req->filename[0] == '\0')
     {
-        send_oack(socket, 0, address, slen, opts);
-        x = receive_message(socket, &message, address, &slen, 512);
-        if (x != 4 || ntohs(message.opcode) != ACK || ntohs(message.ack.block_number != 0))
-        {
-            send_error(socket, address, slen, 0, "ERROR: Received wrong response to OACK\n");
-            return;
-        }
+        *reason = "ERROR: Filename and mode passed in an incorrect way\n";
+        return false;
     }
-    if (mode == NETASCII)
+    if (!strcasecmp(mode, "octet"))
     {
-        fd = fopen(filename, "r");
+        req->mode = OCTET;
     }
-    else
+    else if (!strcasecmp(mode, "netascii"))
     {
-        fd = fopen(filename, "rb");
+        req->mode = NETASCII;
     }
-    if (fd == NULL)
+    else
     {
-        send_error(socket, address, slen, file_not_found, "ERROR: File not found\n");
-        close(socket);
-        free(ndata);
-        return;
+        *reason = "ERROR: Invalid mode specified \n";
+        return false;
     }
+    bool octet = req->mode == OCTET;
 
-    while (true)
+    *error = option_negogiaton;
+    *reason = "ERROR: Options passed in an incorrect way\n";
+    // Repeated option is ignored, so the OACK never contains the same option twice
+    unsigned seen = 0;
+    while (options < end)
     {
-        if (mode == NETASCII)
+        char *value = request_next(options, end);
+        char *next = request_next(value, end);
+        if (next == NULL)
         {
-            for (int i = 0; i < blocksize; i++)
+            printf("Option without value passed \n");
+            return false;
+        }
+        long long number;
+        bool accept = false;
+        unsigned option = 0;
+        if (!strcasecmp(options, "blksize"))
+        {
+            option = 1;
+            if (!parse_number(value, 8, 65464, &number))
             {
-
-                if (extrach)
-                {
-                    ndata[i] = extra;
-                    extrach = false;
-                    continue;
-                }
-                datalen = i + 1;
-                int c = fgetc(fd);
-
-                if (c == '\n')
-                {
-                    ndata[i] = '\r';
-                    i++;
-                    if (i == blocksize)
-                    {
-                        extra = c;
-                        extrach = true;
-                        datalen = blocksize;
-                        break;
-                    }
-                    ndata[i] = c;
-                    if (i == (blocksize - 1))
-                    {
-                        datalen = blocksize;
-                        break;
-                    }
-                    continue;
-                }
-                if (c == '\r')
-                {
-                    ndata[i] = '\0';
-                    i++;
-                    if (i == (blocksize - 1))
-                    {
-                        extra = c;
-                        extrach = true;
-                        datalen = blocksize;
-                        break;
-                    }
-                    ndata[i] = c;
-                    if (i == (blocksize - 1))
-                    {
-                        datalen = blocksize;
-                        break;
-                    }
-                    continue;
-                }
-                if (c == EOF)
-                {
-                    ndata[i] = c;
-                    break;
-                }
-                ndata[i] = c;
+                return false;
+            }
+            if (!(seen & option))
+            {
+                blocksize = number;
             }
+            accept = true;
         }
-        else
+        else if (!strcasecmp(options, "timeout"))
         {
-            datalen = fread(data, 1, sizeof(data), fd);
+            option = 2;
+            if (!parse_number(value, 1, 255, &number))
+            {
+                printf("Time option wrongly passed \n");
+                return false;
+            }
+            if (!(seen & option))
+            {
+                timeout = number;
+                tv.tv_sec = timeout;
+            }
+            accept = true;
         }
-        block++;
-        for (tiktok = RECV_RETRIES; tiktok; tiktok--)
+        else if (!strcasecmp(options, "tsize"))
         {
-            if (mode == OCTET)
+            option = 4;
+            // RRQ asks for the size with 0, it is reported by tsize_report()
+            if (!parse_number(value, 0, LLONG_MAX, &number) || (number > 0 && !check_dir_space(".", number)))
             {
-                x = send_data(datalen, slen, address, data, block, socket);
+                printf("Tsize option wrongly passed \n");
+                return false;
             }
-            else
+            if (!(seen & option))
             {
-                x = send_netascii_data(datalen, slen, address, ndata, block, socket);
+                tsize = number;
+            }
+            accept = true;
+        }
+        else if (!strcasecmp(options, "windowsize"))
+        {
+            option = 8;
+            if (!parse_number(value, 1, 65535, &number))
+            {
+                printf("Windowsize option wrongly passed \n");
+                return false;
+            }
+            if (!(seen & option))
+            {
+                windowsize = number;
+            }
+            accept = true;
+        }
+        else if (!strcasecmp(options, "compress"))
+        {
+            // Netascii is converted while it is being sent, so only octet transfers are compressed
+            option = 16;
+            accept = octet && !strcasecmp(value, "lz");
+            compress = compress || accept;
+        }
+        else if (!strcasecmp(options, "checksum"))
+        {
+            option = 32;
+            accept = octet && !strcasecmp(value, "crc32c");
+            checksum = checksum || accept;
+        }
+        else if (!strcasecmp(options, "resume"))
+        {
+            // Value is "offset,checksum", it is attached by resume_check() when the checksum matches the file.
+            // Upload sends the empty value and the server reports the offset of the partial upload.
+            option = 64;
+            char *sep;
+            long long offset = strtoll(value, &sep, 10);
+            if (value[0] != '\0' && (sep == value || *sep != ',' || offset < 0))
+            {
+                printf("Resume option wrongly passed \n");
+                return false;
+            }
+            if (!(seen & option))
+            {
+                resume = octet;
+                resume_offset = value[0] == '\0' ? 0 : offset;
+                resume_crc = value[0] == '\0' ? 0 : strtoul(sep + 1, NULL, 16);
+            }
+        }
+        else if (!strcasecmp(options, "rollover"))
+        {
+            option = 128;
+            if (!parse_number(value, 0, 1, &number))
+            {
+                printf("Rollover option wrongly passed \n");
+                return false;
+            }
+            if (!(seen & option))
+            {
+                rollover = number;
+            }
+            accept = true;
+        }
+        else if (!strcasecmp(options, "signatures"))
+        {
+            // Client that uploads the delta downloads the signatures of its base first
+            option = 256;
+            if (!parse_number(value, DELTA_CHUNK_MIN, DELTA_CHUNK_MAX, &number))
+            {
+                printf("Signatures option wrongly passed \n");
+                return false;
+            }
+            accept = octet && req->opcode == RRQ;
+            if (accept && !(seen & option))
+            {
+                signature_chunk = number;
+            }
+        }
+        else if (!strcasecmp(options, "delta"))
+        {
+            // Value is the name of the base file on the server
+            option = 512;
+            accept = octet && req->opcode == WRQ && value[0] != '\0';
+            if (accept && !(seen & option))
+            {
+                delta_base = value;
+            }
+        }
+        else if (!strcasecmp(options, "bundle"))
+        {
+            option = 1024;
+            accept = octet && req->opcode == RRQ && !strcmp(value, "1");
+            bundle = bundle || accept;
+        }
+        else if (!strcasecmp(options, "multicast"))
+        {
+            // Value of the multicast option differs for every client, it is attached by server_multicast()
+            multicast = mcast_enabled;
+        }
+        if (accept && !(seen & option) && !options_append(req, options, value))
+        {
+            return false;
+        }
+        seen |= option;
+        options = next;
+    }
+    return true;
+}
+
+/**
+ * @brief Replaces the value of the tsize option in the OACK of the RRQ with the size of the file
+ * @param req Parsed request, size of the netascii transfer is not known in advance
+ */
+void tsize_report(tftp_request *req)
+{
+    struct stat st;
+    char value[32];
+    if (options_get(req, "tsize") == NULL)
+    {
+        return;
+    }
+    options_remove(req, "tsize");
+    if (req->mode != OCTET || stat(req->filename, &st) < 0)
+    {
+        return;
+    }
+    // Signatures and the bundle sent instead of the file have their own size
+    off_t size = bundle_fd != NULL ? bundle_size : signature_chunk > 0 ? delta_signature_size(st.st_size, signature_chunk) : st.st_size;
+    snprintf(value, sizeof(value), "%lld", (long long)size);
+    options_append(req, "tsize", value);
+}
+
+/**
+ * @brief Accepts the resume option if the client has the same data before the offset as the file
+ * @param req Parsed request, resume option is attached to its options
+ */
+void resume_check(tftp_request *req)
+{
+    uint32_t crc;
+    struct stat st;
+    if (!resume)
+    {
+        resume_offset = 0;
+        return;
+    }
+    FILE *fd = fopen(req->filename, "rb");
+    if (fd == NULL || fstat(fileno(fd), &st) < 0 || resume_offset > st.st_size || !file_crc(fd, resume_offset, &crc) || crc != resume_crc)
+    {
+        // Client downloads the whole file again
+        resume_offset = 0;
+    }
+    if (fd != NULL)
+    {
+        fclose(fd);
+    }
+    if (resume_offset > 0)
+    {
+        char value[32];
+        snprintf(value, sizeof(value), "%lld", (long long)resume_offset);
+        if (!options_append(req, "resume", value))
+        {
+            resume_offset = 0;
+        }
+    }
+}
+
+ssize_t send_netascii_data(ssize_t len, socklen_t slen, struct sockaddr *address, char *data, uint16_t block, int socket)
+{
+    tftp_message *message = malloc(sizeof(tftp_message) + len);
+    message->data.opcode = htons(DATA);
+    message->data.block_number = htons(block);
+    memcpy(message->data.data, data, len);
+    ssize_t x;
+    if ((x = engine_sendto(socket, message, len + 4, 0, address, slen)) < 0)
+    {
+        printf("ERROR: sendto()\n");
+    }
+    free(message);
+    return x;
+}
+
+/**
+ * @brief Reads the next block of the file converted to netascii
+ * @param fd File that is being sent
+ * @param ndata Buffer for the block
+ * @param extrach True if the character that did not fit into the previous block is pending
+ * @param extra The pending character
+ * @return Size of the block
+ */
+ssize_t netascii_read(FILE *fd, char *ndata, bool *extrach, char *extra)
+{
+    ssize_t datalen = 0;
+    for (int i = 0; i < blocksize; i++)
+    {
+        if (*extrach)
+        {
+            ndata[i] = *extra;
+            *extrach = false;
+            continue;
+        }
+        datalen = i + 1;
+        int c = fgetc(fd);
+
+        if (c == '\n')
+        {
+            ndata[i] = '\r';
+            i++;
+            if (i == blocksize)
+            {
+                *extra = c;
+                *extrach = true;
+                datalen = blocksize;
+                break;
+            }
+            ndata[i] = c;
+            if (i == (blocksize - 1))
+            {
+                datalen = blocksize;
+                break;
+            }
+            continue;
+        }
+        if (c == '\r')
+        {
+            ndata[i] = '\0';
+            i++;
+            if (i == (blocksize - 1))
+            {
+                *extra = c;
+                *extrach = true;
+                datalen = blocksize;
+                break;
+            }
+            ndata[i] = c;
+            if (i == (blocksize - 1))
+            {
+                datalen = blocksize;
+                break;
+            }
+            continue;
+        }
+        if (c == EOF)
+        {
+            ndata[i] = c;
+            break;
+        }
+        ndata[i] = c;
+    }
+    return datalen;
+}
+
+/**
+ * @brief Opens the compressed copy of the file from the cache directory, or starts writing a new one
+ * @param fd File that is about to be sent
+ * @param filename The name of the file
+ * @param reused Set to true if the returned file contains compressed frames that can be sent as they are
+ * @return Opened copy, NULL if the cache is not used
+ */
+FILE *cache_open(FILE *fd, char *filename, bool *reused)
+{
+    struct stat file_info, cache_info;
+    char resolved[PATH_MAX];
+    *reused = false;
+    if (cache_dir == NULL || realpath(filename, resolved) == NULL || fstat(fileno(fd), &file_info) < 0)
+    {
+        return NULL;
+    }
+    // Path of the file is flattened into the name of its copy
+    for (char *c = resolved; *c; c++)
+    {
+        if (*c == '/')
+        {
+            *c = '%';
+        }
+    }
+    if (snprintf(cache_path, sizeof(cache_path), "%s/%s.lz", cache_dir, resolved) >= (int)sizeof(cache_path))
+    {
+        return NULL;
+    }
+    if (stat(cache_path, &cache_info) == 0 && cache_info.st_mtime >= file_info.st_mtime && cache_info.st_size > 0)
+    {
+        *reused = true;
+        return fopen(cache_path, "rb");
+    }
+    snprintf(cache_tmp, sizeof(cache_tmp), "%s.%d", cache_path, (int)getpid());
+    return fopen(cache_tmp, "wb");
+}
+
+/**
+ * @brief Frees the source of the DATA blocks, the new copy in the cache is kept only if the whole file was sent
+ * @param src Source of the DATA blocks
+ * @param complete True if the whole file was sent
+ */
+void source_close(xfer_source *src, bool complete)
+{
+    if (src->cache != NULL)
+    {
+        if (fclose(src->cache) == 0 && complete)
+        {
+            rename(cache_tmp, cache_path);
+        }
+        else
+        {
+            unlink(cache_tmp);
+        }
+        src->cache = NULL;
+    }
+    source_free(src);
+}
+
+/**
+ * @brief Removes the compressed copies from the cache directory, copies being written and the ones being sent are not affected
+ * @return Number of the removed copies
+ */
+int cache_flush()
+{
+    int removed = 0;
+    DIR *dir = cache_dir != NULL ? opendir(cache_dir) : NULL;
+    if (dir == NULL)
+    {
+        return 0;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char path[PATH_MAX];
+        size_t len = strlen(entry->d_name);
+        // Copy being written ends with the process ID, it is renamed to .lz only when it is complete
+        if (len < 3 || strcmp(entry->d_name + len - 3, ".lz") != 0)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, entry->d_name);
+        removed += unlink(path) == 0;
+    }
+    closedir(dir);
+    return removed;
+}
+
+/**
+ * @brief Opens the partial upload of the file in the staging directory
+ * @param peer Address of the uploading client
+ * @param filename The name of the uploaded file
+ * @param offset Set to the size of the partial upload that the client can continue from
+ * @return Opened partial upload positioned at its end, NULL if it can not be opened, errno is EWOULDBLOCK if it is being uploaded right now
+ */
+FILE *staging_open(struct in_addr peer, char *filename, off_t *offset)
+{
+    // Transfer ID identifies the upload of the file by the client across the sessions
+    uint32_t id = crc32c_update(crc32c_update(0, &peer, sizeof(peer)), filename, strlen(filename));
+    snprintf(staging_path, sizeof(staging_path), "%s/%08x%08x.part", staging_dir, id, crc32c_update(0, filename, strlen(filename)));
+    int fd = open(staging_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    bool locked = flock(fd, LOCK_EX | LOCK_NB) == 0;
+    if (!locked && errno == EWOULDBLOCK && session_cancel_duplicates() > 0)
+    {
+        // Client retries the upload its previous session still holds, that session is cancelled and closes the file
+        for (int i = 0; i < STAGING_TAKEOVER && !(locked = flock(fd, LOCK_EX | LOCK_NB) == 0) && errno == EWOULDBLOCK; i++)
+        {
+            usleep(10000);
+        }
+    }
+    if (!locked || (!resume && ftruncate(fd, 0) < 0))
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+    *offset = lseek(fd, 0, SEEK_END);
+    FILE *file = fdopen(fd, "w");
+    if (file == NULL)
+    {
+        close(fd);
+    }
+    return file;
+}
+
+/**
+ * @brief Moves the completed upload from the staging directory to its place, existing file is never replaced
+ * @param fd Completed upload
+ * @param filename The name of the uploaded file
+ * @return True if the file was moved
+ */
+bool staging_commit(FILE *fd, char *filename)
+{
+    if (fflush(fd) != 0 || fsync(fileno(fd)) < 0 || link(staging_path, filename) < 0)
+    {
+        return false;
+    }
+    unlink(staging_path);
+    return true;
+}
+
+/**
+ * @brief Removes the partial uploads that were abandoned by their clients
+ */
+void staging_collect()
+{
+    time_t now = time(NULL);
+    // Directory is scanned at most once a minute
+    if (staging_dir == NULL || now - staging_collected < 60)
+    {
+        return;
+    }
+    staging_collected = now;
+    DIR *dir = opendir(staging_dir);
+    if (dir == NULL)
+    {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char path[PATH_MAX];
+        struct stat info;
+        size_t len = strlen(entry->d_name);
+        if (len < 5 || strcmp(entry->d_name + len - 5, ".part") != 0)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", staging_dir, entry->d_name);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            continue;
+        }
+        // Locked partial upload is being continued by some session
+        if (fstat(fd, &info) == 0 && now - info.st_mtime > staging_ttl && flock(fd, LOCK_EX | LOCK_NB) == 0)
+        {
+            unlink(path);
+        }
+        close(fd);
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief Checks whether the session was cancelled from the control socket, the client gets ERROR the first time
+ * @return True if the transfer has to end, errno is then ECANCELED
+ */
+bool cancel_check()
+{
+    if (!session_cancelled)
+    {
+        return false;
+    }
+    if (cancel_socket >= 0)
+    {
+        send_error(cancel_socket, (struct sockaddr *)&cancel_peer, sizeof(cancel_peer), not_defined, "ERROR: Cancelled\n");
+        cancel_socket = -1;
+    }
+    errno = ECANCELED;
+    return true;
+}
+
+/**
+ * @brief Waits for the ACK of the sent block. ACKs of the older blocks are counted and ignored,
+ *        they never make the block sent again and they do not extend the timeout.
+ * @param socket Source ID
+ * @param message Received message, it has room for MAX_REQUEST bytes after the header
+ * @param address Destination address
+ * @param slen Adress lenght
+ * @param block Sent block counted from the start of the transfer
+ * @return Number of bytes received, -1 with errno EAGAIN if nothing but old ACKs arrived in time
+ */
+ssize_t ack_wait(int socket, tftp_message *message, struct sockaddr *address, socklen_t *slen, uint64_t block)
+{
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += tv.tv_sec;
+    deadline.tv_nsec += tv.tv_usec * 1000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while (true)
+    {
+        if (cancel_check())
+        {
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long wait = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        struct pollfd fds = {socket, POLLIN, 0};
+        int ready = engine_poll(&fds, 1, wait > 0 ? wait : 0);
+        if (ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready <= 0)
+        {
+            errno = ready == 0 ? EAGAIN : errno;
+            return -1;
+        }
+        // Send timestamp waiting in the error queue wakes poll() up too
+        if (timestamping && !(fds.revents & POLLIN) && tstamp_drain(socket))
+        {
+            continue;
+        }
+        ssize_t x = timestamping ? tstamp_receive(socket, message, address, slen, MAX_REQUEST)
+                                 : receive_message(socket, message, address, slen, MAX_REQUEST);
+        if (x < 4 || ntohs(message->opcode) != ACK)
+        {
+            return x;
+        }
+        // ACKs of the blocks ahead and of no nearby block are left to opcodes_check_download()
+        uint64_t acked = block_unwrap(block, ntohs(message->ack.block_number), rollover);
+        if (acked >= block)
+        {
+            return x;
+        }
+        if (acked == block - 1)
+        {
+            duplicate_acks++;
+            trace_instant("duplicate ACK", acked, -1);
+        }
+        else
+        {
+            stale_acks++;
+            trace_instant("stale ACK", acked, -1);
+        }
+    }
+}
+
+/**
+ * @brief Reads the monotonic clock for the round trip time of the block
+ * @return Seconds
+ */
+double rtt_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Publishes the progress of the session for the control socket
+ * @param block Last block acknowledged or received
+ */
+void progress_report(uint64_t block)
+{
+    session_progress(block, stats.bytes, stats.rtt_samples ? stats.rtt_sum / stats.rtt_samples : 0);
+}
+
+/**
+ * @brief Counts the round trip of the block that was sent once. With the kernel timestamps the time spent inside the server
+ *        is left out, and unless the client negotiated the timeout, the timeout follows the measured time (RFC 6298).
+ * @param socket Source ID
+ * @param sent Time the block was sent, read by rtt_clock()
+ * @param rto Timeout the block waits for its ACK, it is changed by the timestamped samples
+ */
+void rtt_sample(int socket, double sent, struct timeval *rto)
+{
+    double rtt = rtt_clock() - sent, host;
+    if (timestamping && tstamp_rtt(socket, &rtt, &host))
+    {
+        stats.wire_sum += rtt;
+        stats.host_sum += host;
+        stats.stamped++;
+        if (stats.stamped == 1)
+        {
+            srtt = rtt;
+            rttvar = rtt / 2;
+        }
+        else
+        {
+            rttvar = 0.75 * rttvar + 0.25 * fabs(srtt - rtt);
+            srtt = 0.875 * srtt + 0.125 * rtt;
+        }
+        if (timeout == 0)
+        {
+            double t = fmin(fmax(srtt + 4 * rttvar, RTO_MIN), RECV_TIMEOUT);
+            rto->tv_sec = (time_t)t;
+            rto->tv_usec = (suseconds_t)((t - rto->tv_sec) * 1e6);
+        }
+    }
+    stats.rtt_sum += rtt;
+    stats.rtt_samples++;
+}
+
+/**
+ * @brief Sends the block whose ACK measures the round trip time, the kernel timestamps the datagram if the timestamps are on
+ * @param len Size of the data
+ * @param slen Adress lenght
+ * @param address Destination address
+ * @param data Data of the block
+ * @param block Block number
+ * @param socket Source ID
+ * @param mode Defines which mode is going to be used
+ * @param sent Time the block was sent, read by rtt_clock()
+ * @return Number of bytes that have been sent
+ */
+ssize_t send_timed(ssize_t len, socklen_t slen, struct sockaddr *address, uint8_t *data, uint16_t block, int socket, int mode, double *sent)
+{
+    if (timestamping)
+    {
+        tstamp_arm(socket);
+    }
+    *sent = rtt_clock();
+    ssize_t x = mode == NETASCII ? send_netascii_data(len, slen, address, (char *)data, block, socket) : send_data(len, slen, address, data, block, socket);
+    if (timestamping)
+    {
+        tstamp_disarm(socket);
+    }
+    return x;
+}
+
+/**
+ * @brief Sends the file in windows of blocks (RFC 7440), the client ACKs the whole window or the last block it got in order before a gap.
+ *        Blocks of the window are kept until they are acknowledged, so they are sent again without reading the file again.
+ * @param fd File that is being sent
+ * @param src Source of the octet blocks
+ * @param total Size of the file, the remaining part of it decides the priority of the session
+ * @param address Destination address
+ * @param slen Adress lenght
+ * @param socket Source ID
+ * @param mode Defines which mode is going to be used
+ * @return True if the client acknowledged the whole file
+ */
+bool download_window(FILE *fd, xfer_source *src, off_t total, struct sockaddr *address, socklen_t slen, int socket, int mode)
+{
+    uint8_t *window = malloc((size_t)windowsize * blocksize);
+    ssize_t *lens = malloc(windowsize * sizeof(ssize_t));
+    uint16_t reply[(sizeof(tftp_message) + MAX_REQUEST) / sizeof(uint16_t)];
+    tftp_message *message = (tftp_message *)reply;
+    bool extrach = false, done = false;
+    char extra;
+    // Blocks are counted without wrapping, last is the final block once it is read, timed is the block its ACK measures the RTT
+    uint64_t acked = 0, next = 1, read = 0, last = 0, highest = 0, timed = 0;
+    // Acknowledged block after which the missing block was sent again
+    uint64_t repaired = UINT64_MAX;
+    double sent = 0;
+    struct timeval rto = tv;
+    int tiktok = RECV_RETRIES;
+    while (!done)
+    {
+        while (next <= acked + windowsize && (last == 0 || next <= last))
+        {
+            size_t slot = (next - 1) % windowsize;
+            uint8_t *data = window + slot * blocksize;
+            uint64_t start;
+            if (next > read)
+            {
+                start = trace_clock();
+                lens[slot] = mode == NETASCII ? netascii_read(fd, (char *)data, &extrach, &extra) : source_read(src, data, blocksize);
+                trace_span("read", start, next, lens[slot]);
+                if (lens[slot] < 0)
+                {
+                    send_error(socket, address, slen, not_defined, "ERROR: Read failed\n");
+                    free(window);
+                    free(lens);
+                    return false;
+                }
+                read = next;
+                if (lens[slot] < blocksize)
+                {
+                    last = next;
+                }
+            }
+            off_t left = total - ftello(fd) + lens[slot];
+            start = trace_clock();
+            shape_wait(lens[slot] + 4, left > 0 ? left : lens[slot]);
+            trace_span("shape", start, next, lens[slot]);
+            ssize_t x;
+            if (next > highest)
+            {
+                // Only the first new block of the burst is timed, the stamp of each ACK is paired with one block
+                trace_instant("DATA", next, lens[slot]);
+                if (timed == 0)
+                {
+                    timed = next;
+                    x = send_timed(lens[slot], slen, address, data, block_wire(next, rollover), socket, OCTET, &sent);
+                }
+                else
+                {
+                    x = send_data(lens[slot], slen, address, data, block_wire(next, rollover), socket);
+                }
+                highest = next;
+            }
+            else
+            {
+                stats.retransmits++;
+                trace_instant("retransmit", next, lens[slot]);
+                x = send_data(lens[slot], slen, address, data, block_wire(next, rollover), socket);
+            }
+            if (x < 0)
+            {
+                free(window);
+                free(lens);
+                return false;
+            }
+            next++;
+        }
+        // Copies of the ACK before the acknowledged block are ignored, the copy of the acknowledged block reports the gap.
+        // Once the missing block was sent again, its copies are ignored too and do not put off the timeout
+        ssize_t x = ack_wait(socket, message, address, &slen, repaired == acked ? acked + 1 : acked);
+        if (x < 0)
+        {
+            bool expired = errno == EAGAIN;
+            trace_instant("timeout", acked + 1, -1);
+            if (!expired || !--tiktok)
+            {
+                stats.timed_out = expired;
+                free(window);
+                free(lens);
+                return false;
+            }
+            timeradd(&tv, &tv, &tv);
+            // Whole window after the acknowledged block is sent again
+            next = acked + 1;
+            timed = 0;
+            repaired = UINT64_MAX;
+            continue;
+        }
+        bool is_ack = x >= 4 && ntohs(message->opcode) == ACK;
+        uint64_t ack = is_ack ? block_unwrap(acked, ntohs(message->ack.block_number), rollover) : UINT64_MAX;
+        if (ack >= next)
+        {
+            // Message other than the ACK of the sent block is refused
+            if (x < 4 || opcodes_check_download(message, socket, block_wire(next - 1, rollover), slen, address))
+            {
+                send_error(socket, address, slen, 0, "ERROR: Received wrong response\n");
+            }
+            free(window);
+            free(lens);
+            return false;
+        }
+        trace_instant("ACK", ack, -1);
+        if (timed != 0 && ack >= timed)
+        {
+            rtt_sample(socket, sent, &rto);
+            timed = 0;
+        }
+        if (ack > acked)
+        {
+            for (uint64_t b = acked + 1; b <= ack; b++)
+            {
+                stats.bytes += lens[(b - 1) % windowsize];
+            }
+            stats.blocks += ack - acked;
+            acked = ack;
+            tiktok = RECV_RETRIES;
+            tv = rto;
+            progress_report(acked);
+        }
+        done = last != 0 && acked == last;
+        if (!done && acked + 1 < next)
+        {
+            // Client got the blocks only up to the gap and keeps the later ones, so only the missing block is sent again.
+            // If it is lost again, the whole window is sent after the timeout
+            trace_instant("gap", acked + 1, -1);
+            repaired = acked;
+            timed = 0;
+            size_t slot = acked % windowsize;
+            off_t left = total - ftello(fd) + lens[slot];
+            shape_wait(lens[slot] + 4, left > 0 ? left : lens[slot]);
+            stats.retransmits++;
+            trace_instant("retransmit", acked + 1, lens[slot]);
+            if (send_data(lens[slot], slen, address, window + slot * blocksize, block_wire(acked + 1, rollover), socket) < 0)
+            {
+                free(window);
+                free(lens);
+                return false;
+            }
+        }
+    }
+    stats.completed = true;
+    free(window);
+    free(lens);
+    return true;
+}
+
+/**
+ * @brief Function used by SERVER for handling the download process
+ * @param socket Source ID
+ * @param address Destination address
+ * @param slen Adress lenght
+ * @param message Structured data type used for storing informations about the messages
+ * @param filename The name of the file that we are going to sent
+ * @param fd File that we are going to work with
+ * @return Number of bytes that have been sent
+ */
+void server_download(FILE *fd, struct sockaddr *address, socklen_t slen, int socket, char *filename, tftp_request *req, int mode, bool optionsi)
+{
+    ssize_t x, datalen;
+    uint8_t data[blocksize];
+    char *ndata = malloc(blocksize);
+    // Blocks are counted without wrapping, the messages carry their 16-bit numbers
+    uint64_t block = 0;
+    // Buffer has room for any message the client can send, not just for the ACK
+    uint16_t reply[(sizeof(tftp_message) + MAX_REQUEST) / sizeof(uint16_t)];
+    tftp_message *message = (tftp_message *)reply;
+    int tiktok;
+    // Timeout doubles with every retransmit of the block and returns to this value after the ACK
+    struct timeval rto = tv;
+    bool extrach = false;
+    char extra;
+    if (optionsi)
+    {
+        oack_send(socket, address, slen, req);
+        x = receive_message(socket, message, address, &slen, MAX_REQUEST);
+        if (x < 0 && cancel_check())
+        {
+            return;
+        }
+        if (x != 4 || ntohs(message->opcode) != ACK || ntohs(message->ack.block_number) != 0)
+        {
+            send_error(socket, address, slen, 0, "ERROR: Received wrong response to OACK\n");
+            return;
+        }
+    }
+    uint64_t start = trace_clock();
+    if (mode == NETASCII)
+    {
+        fd = fopen(filename, "r");
+    }
+    else
+    {
+        fd = fopen(filename, "rb");
+    }
+    trace_span("open", start, -1, -1);
+    if (fd == NULL)
+    {
+        send_error(socket, address, slen, file_not_found, "ERROR: File not found\n");
+        close(socket);
+        free(ndata);
+        return;
+    }
+    if (bundle_fd != NULL)
+    {
+        // Manifest names the files that are sent one after another with their headers
+        fclose(fd);
+        fd = bundle_fd;
+        bundle_fd = NULL;
+    }
+    else if (signature_chunk > 0)
+    {
+        // Client encodes its delta upload against the signatures, they are sent instead of the file
+        FILE *signatures = delta_signatures(fd, signature_chunk);
+        fclose(fd);
+        fd = signatures;
+        if (fd == NULL)
+        {
+            send_error(socket, address, slen, 0, "ERROR: Can not compute the signatures\n");
+            close(socket);
+            free(ndata);
+            return;
+        }
+    }
+    xfer_source src;
+    FILE *cache = NULL;
+    bool reused = false;
+    if (mode == OCTET && resume_offset > 0 && fseeko(fd, resume_offset, SEEK_SET) < 0)
+    {
+        send_error(socket, address, slen, 0, "ERROR: Resume failed\n");
+        close(socket);
+        fclose(fd);
+        free(ndata);
+        return;
+    }
+    // Cached frames are sent without reading the file, so the checksum of the file could not be computed
+    if (mode == OCTET && compress && !checksum && resume_offset == 0 && signature_chunk == 0 && !bundle)
+    {
+        cache = cache_open(fd, filename, &reused);
+    }
+    if (reused && cache != NULL)
+    {
+        // Compressed copy is sent as it is
+        fclose(fd);
+        fd = cache;
+        cache = NULL;
+    }
+    source_init(&src, fd, mode == OCTET && compress && !reused, mode == OCTET && checksum);
+    src.cache = cache;
+    // Size of the sent file, the remaining part of it decides the priority of the session
+    struct stat st;
+    off_t total = fstat(fileno(fd), &st) == 0 ? st.st_size : 0;
+    stats.blksize = blocksize;
+    stats.windowsize = windowsize;
+    double sent = 0;
+    if (windowsize > 1)
+    {
+        bool done = download_window(fd, &src, total, address, slen, socket, mode);
+        if (!done)
+        {
+            close(socket);
+        }
+        fclose(fd);
+        free(ndata);
+        source_close(&src, done);
+        return;
+    }
+
+    while (true)
+    {
+        start = trace_clock();
+        if (mode == NETASCII)
+        {
+            datalen = netascii_read(fd, ndata, &extrach, &extra);
+        }
+        else
+        {
+            datalen = source_read(&src, data, sizeof(data));
+            if (datalen < 0)
+            {
+                send_error(socket, address, slen, not_defined, "ERROR: Read failed\n");
+                close(socket);
+                fclose(fd);
+                free(ndata);
+                source_close(&src, false);
+                return;
+            }
+        }
+        block++;
+        trace_span("read", start, block, datalen);
+        for (tiktok = RECV_RETRIES; tiktok; tiktok--)
+        {
+            off_t left = total - ftello(fd) + datalen;
+            start = trace_clock();
+            shape_wait(datalen + 4, left > 0 ? left : datalen);
+            trace_span("shape", start, block, datalen);
+            trace_instant(tiktok == RECV_RETRIES ? "DATA" : "retransmit", block, datalen);
+            if (tiktok == RECV_RETRIES)
+            {
+                x = send_timed(datalen, slen, address, mode == OCTET ? data : (uint8_t *)ndata, block_wire(block, rollover), socket, mode, &sent);
+            }
+            else if (mode == OCTET)
+            {
+                stats.retransmits++;
+                x = send_data(datalen, slen, address, data, block_wire(block, rollover), socket);
+            }
+            else
+            {
+                stats.retransmits++;
+                x = send_netascii_data(datalen, slen, address, ndata, block_wire(block, rollover), socket);
             }
             if (x < 0)
             {
                 close(socket);
                 fclose(fd);
                 free(ndata);
+                source_close(&src, false);
                 return;
             }
-            x = receive_message(socket, &message, address, &slen, 512);
+            x = ack_wait(socket, message, address, &slen, block);
             if (x >= 0 && x < 4)
             {
                 send_error(socket, address, slen, 0, "ERROR: Received wrong response\n");
                 close(socket);
                 fclose(fd);
                 free(ndata);
+                source_close(&src, false);
                 return;
             }
             if (x >= 4)
             {
+                trace_instant(ntohs(message->opcode) == ACK ? "ACK" : "receive", ntohs(message->ack.block_number), -1);
+                // ACK of the block that was sent again could belong to any of its copies
+                if (tiktok == RECV_RETRIES)
+                {
+                    rtt_sample(socket, sent, &rto);
+                }
+                tv = rto;
                 break;
             }
-            tv.tv_sec *= 2;
+            trace_instant("timeout", block, -1);
+            timeradd(&tv, &tv, &tv);
             if (errno != EAGAIN)
             {
                 close(socket);
                 fclose(fd);
                 free(ndata);
+                source_close(&src, false);
                 return;
             }
         }
         if (!tiktok)
         {
+            stats.timed_out = true;
             close(socket);
             fclose(fd);
             free(ndata);
+            source_close(&src, false);
             return;
         }
-        if (!opcodes_check_download(&message, block, block, slen, address))
+        if (!opcodes_check_download(message, socket, block_wire(block, rollover), slen, address))
         {
             close(socket);
             fclose(fd);
             free(ndata);
+            source_close(&src, false);
             return;
         }
+        stats.blocks++;
+        stats.bytes += datalen;
+        progress_report(block);
         // Last packet sent
         if (datalen < blocksize)
         {
+            stats.completed = true;
             free(ndata);
             fclose(fd);
+            source_close(&src, true);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Removes the file after the failed upload, partial upload in the staging directory is kept
+ * @param filename The name of the uploaded file
+ */
+void upload_remove(char *filename)
+{
+    if (staging_dir == NULL)
+    {
+        remove(filename);
+    }
+}
+
+/**
+ * @brief Function used by both SERVER and CLIENT for handling the UPLOAD process
+ * @param socket Source ID
+ * @param address Destination address
+ * @param slen
+ * @param message Structured data type used for storing informations about the messages
+ * @param filename The name of the file that we are going to sent
+ * @param mode Defines which mode is going to be used
+ * @param fd File that we are going to work with
+ * @return Number of bytes that have been sent
+ */
+void server_upload(FILE *fd, struct sockaddr *address, socklen_t slen, int socket, char *filename, bool optionsi, tftp_request *req)
+{
+    bool end = false;
+    off_t offset = 0;
+    // Partial upload in the staging directory is kept when the transfer fails
+    char *path = filename;
+    FILE *base = NULL;
+    if (delta_base != NULL && (base = fopen(delta_base, "rb")) == NULL)
+    {
+        send_error(socket, address, slen, file_not_found, "ERROR: Base file not found\n");
+        return;
+    }
+    uint64_t start = trace_clock();
+    if (staging_dir != NULL)
+    {
+        fd = staging_open(((struct sockaddr_in *)address)->sin_addr, filename, &offset);
+        path = staging_path;
+    }
+    else
+    {
+        fd = fopen(filename, "w");
+    }
+    bool busy = fd == NULL && errno == EWOULDBLOCK;
+    trace_span("open", start, -1, offset);
+    if (fd == NULL)
+    {
+        if (busy)
+        {
+            send_error(socket, address, slen, not_defined, "ERROR: Upload already in progress, retry later\n");
+        }
+        else
+        {
+            send_error(socket, address, slen, acces_violation, "ERROR: Can not write the file\n");
+        }
+        if (base != NULL)
+        {
+            fclose(base);
+        }
+        return;
+    }
+    uint32_t crc;
+    bool resumed = false;
+    if (resume && offset > 0 && file_crc(fd, offset, &crc))
+    {
+        // Client skips the data the server already has after it checks their checksum
+        char value[48];
+        snprintf(value, sizeof(value), "%lld,%08x", (long long)offset, crc);
+        resumed = options_append(req, "resume", value);
+        optionsi = optionsi || resumed;
+    }
+    if (!resumed && offset > 0 && (ftruncate(fileno(fd), 0) < 0 || fseeko(fd, 0, SEEK_SET) < 0))
+    {
+        send_error(socket, address, slen, disk_full, "ERROR: Write failed\n");
+        fclose(fd);
+        if (base != NULL)
+        {
+            fclose(base);
+        }
+        return;
+    }
+    if (windowsize > 1)
+    {
+        // Whole window can arrive at once, kernel limits the size to net.core.rmem_max
+        int size = windowsize * (blocksize + 512);
+        setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    xfer_sink sink;
+    sink_init(&sink, fd, compress, checksum);
+    if (base != NULL)
+    {
+        // File is rebuilt from the copied chunks of the base and the literal bytes of the delta
+        sink.delta = delta_start(base);
+        base = NULL;
+        if (sink.delta == NULL)
+        {
+            send_error(socket, address, slen, 0, "ERROR: Out of memory\n");
+            fclose(fd);
+            sink_free(&sink);
+            remove(path);
+            return;
+        }
+    }
+    stats.blksize = blocksize;
+    stats.windowsize = windowsize;
+    tftp_message *message = malloc(sizeof(tftp_message) + blocksize);
+    ssize_t x;
+    // Blocks are counted without wrapping, the messages carry their 16-bit numbers
+    uint64_t block = 0, acked = 0;
+    bool gap = false;
+    if (optionsi)
+    {
+        x = oack_send(socket, address, slen, req);
+    }
+    else
+    {
+        x = send_ack(socket, block, address, slen);
+    }
+    if (x < 0)
+    {
+        fclose(fd);
+        sink_free(&sink);
+        return;
+    }
+    int tiktok;
+    while (true)
+    {
+        for (tiktok = RECV_RETRIES; tiktok; tiktok--)
+        {
+            // This should be in loop that is handling timeout
+            // Session cancelled while it wrote the block or slept does not wait for the next one
+            x = session_cancelled ? -1 : receive_message(socket, message, address, &slen, blocksize);
+            if ((x >= 0 && x < 4) || (x < 0 && cancel_check()))
+            {
+                if (x >= 0)
+                {
+                    send_error(socket, address, slen, 0, "ERROR: Received wrong response\n");
+                }
+                free(message);
+                close(socket);
+                fclose(fd);
+                sink_free(&sink);
+                upload_remove(filename);
+                return;
+            }
+
+            // I guess if we received a correct response on time we jump out of this for that is handling timeout, this break is not for while loop
+            if (x >= 4)
+            {
+                trace_instant(ntohs(message->opcode) == DATA ? "DATA" : "receive", ntohs(message->data.block_number), x - 4);
+                break;
+            }
+
+            trace_instant("timeout", block + 1, -1);
+            trace_instant("retransmit", block, -1);
+            stats.retransmits++;
+            x = send_ack(socket, block_wire(block, rollover), address, slen);
+
+            if (x < 0)
+            {
+                // send error
+                free(message);
+                close(socket);
+                fclose(fd);
+                sink_free(&sink);
+                upload_remove(filename);
+                return;
+            }
+        }
+        if (!tiktok)
+        {
+            // Transfer timed out
+            stats.timed_out = true;
+            send_error(socket, address, slen, 0, "ERROR: Timeout\n");
+            free(message);
+            close(socket);
+            fclose(fd);
+            sink_free(&sink);
+            upload_remove(filename);
+            return;
+        }
+
+        uint64_t received = block_unwrap(block, ntohs(message->data.block_number), rollover);
+        if (ntohs(message->opcode) == DATA && received <= block)
+        {
+            // Block that was already stored, the client sent it again because it did not get the ACK
+            duplicate_data++;
+            stats.retransmits++;
+            trace_instant("duplicate DATA", received, x - 4);
+            if (windowsize == 1)
+            {
+                // Only the copy of the last block is acknowledged again, older copies were overtaken by that ACK
+                if (received == block)
+                {
+                    send_ack(socket, block_wire(block, rollover), address, slen);
+                }
+                continue;
+            }
+        }
+        if (windowsize > 1 && ntohs(message->opcode) == DATA && received != block + 1)
+        {
+            // Block out of the order is dropped, the first one after the gap makes the client send the window again
+            stats.retransmits++;
+            if (!gap)
+            {
+                send_ack(socket, block_wire(block, rollover), address, slen);
+                acked = block;
+                gap = true;
+            }
+            continue;
+        }
+        gap = false;
+        block++;
+        stats.blocks++;
+        stats.bytes += x - 4;
+        progress_report(block);
+        if (x - 4 < blocksize)
+        {
+            end = true;
+        }
+        if (!opcodes_check_upload(socket, block_wire(block, rollover), message, slen, address))
+        {
+            // Client refuses to continue the partial upload if its data differ
+            if (block == 1 && ntohs(message->opcode) == ERROR)
+            {
+                remove(path);
+            }
+            free(message);
+            close(socket);
+            fclose(fd);
+            sink_free(&sink);
+            upload_remove(filename);
+            return;
+        }
+        start = trace_clock();
+        bool stored = sink_write(&sink, message->data.data, x - 4);
+        trace_span("write", start, block, x - 4);
+        if (!stored || (end && !sink_finish(&sink)))
+        {
+            // Finished stream that does not match its checksum or ends inside a frame is corrupted
+            send_error(socket, address, slen, stored ? 0 : disk_full, stored ? "ERROR: Transferred data corrupted\n" : "ERROR: Write failed\n");
+            free(message);
+            close(socket);
+            fclose(fd);
+            sink_free(&sink);
+            remove(path);
+            return;
+        }
+        if (end && staging_dir != NULL && !staging_commit(fd, filename))
+        {
+            send_error(socket, address, slen, file_exists, "ERROR: Can not move the file into place\n");
+            free(message);
+            close(socket);
+            fclose(fd);
+            sink_free(&sink);
+            return;
+        }
+        // Delaying the ACK keeps the uploading client within the bandwidth limits
+        start = trace_clock();
+        shape_wait(x, -1);
+        trace_span("shape", start, block, x - 4);
+        if (!end && block - acked < (uint64_t)windowsize)
+        {
+            // Client expects the ACK only after the whole window
+            continue;
+        }
+        acked = block;
+        trace_instant("ACK", block, -1);
+        x = send_ack(socket, block_wire(block, rollover), address, slen);
+        if (x < 0)
+        {
+            free(message);
+            close(socket);
+            fclose(fd);
+            sink_free(&sink);
+            upload_remove(filename);
+            return;
+        }
+        if (end)
+        {
+            stats.completed = true;
+            free(message);
+            fclose(fd);
+            sink_free(&sink);
             return;
         }
     }
 }
 
 /**
- * @brief Function used by both SERVER and CLIENT for handling the UPLOAD process
+ * @brief Lowers the accepted block size and window to the values that worked for the subnet of the client
+ * @param req Parsed request, its OACK is changed
+ * @param peer Address of the client
+ */
+void profile_apply(tftp_request *req, struct in_addr peer)
+{
+    int blksize = options_get(req, "blksize") != NULL ? blocksize : 0;
+    int window = options_get(req, "windowsize") != NULL ? windowsize : 0;
+    profile_offer(peer, &blksize, &window);
+    if (blksize > 0 && blksize != blocksize)
+    {
+        blocksize = blksize;
+        options_set(req, "blksize", blocksize);
+    }
+    if (window > 0 && window != windowsize)
+    {
+        windowsize = window;
+        options_set(req, "windowsize", windowsize);
+    }
+}
+
+/**
+ * @brief Sends the OACK to the client of the multicast session, the multicast option is attached to the other accepted options
+ * @param socket Source ID
+ * @param client Destination address
+ * @param req Request of the first client, its OACK contains the options accepted for the whole session
+ * @param master True if the client becomes the master client
+ * @return Number of bytes that have been sent
+ */
+ssize_t send_multicast_oack(int socket, struct sockaddr_in *client, tftp_request *req, bool master)
+{
+    uint8_t buffer[sizeof(req->oack) + 64];
+    char group[INET_ADDRSTRLEN];
+    size_t size = 4 + req->opts_len;
+    memcpy(buffer, req->oack, size);
+    (void)inet_ntop(AF_INET, &mcast_group, group, INET_ADDRSTRLEN);
+    size += sprintf((char *)buffer + size, "multicast") + 1;
+    size += sprintf((char *)buffer + size, "%s,%d,%d", group, mcast_port + session_index, master) + 1;
+    ssize_t x = sendto(socket, buffer, size, 0, (struct sockaddr *)client, sizeof(*client));
+    if (x < 0)
+    {
+        printf("ERROR sendto()\n");
+    }
+    return x;
+}
+
+/**
+ * @brief Reads the block of the file and sends it
+ * @param file File that is being transferred
+ * @param block Number of the block
+ * @param data Buffer for the block
+ * @param address Destination address, unicast address of the client or the multicast group
+ * @param socket Source ID
+ * @return Number of bytes that have been sent
+ */
+ssize_t send_file_block(int file, uint16_t block, uint8_t *data, struct sockaddr_in *address, int socket)
+{
+    uint64_t start = trace_clock();
+    ssize_t datalen = pread(file, data, blocksize, (off_t)(block - 1) * blocksize);
+    if (datalen < 0)
+    {
+        printf("ERROR: pread()\n");
+        return datalen;
+    }
+    trace_span("read", start, block, datalen);
+    struct stat st;
+    off_t left = fstat(file, &st) == 0 ? st.st_size - (off_t)(block - 1) * blocksize : datalen;
+    start = trace_clock();
+    shape_wait(datalen + 4, left > 0 ? left : datalen);
+    trace_span("shape", start, block, datalen);
+    trace_instant("DATA", block, datalen);
+    return send_data(datalen, sizeof(*address), (struct sockaddr *)address, data, block, socket);
+}
+
+/**
+ * @brief Passes the client requesting a file to the multicast session that is already sending the same file, used by the main server process
+ * @param msg Request of the client
+ * @param lenght Lenght of the request
+ * @param client Address of the client
+ * @return True if the client was passed to the running session
+ */
+bool multicast_join(tftp_message_request *msg, ssize_t lenght, struct sockaddr_in *client)
+{
+    mc_join join;
+    bool joined = false;
+    join.addr = *client;
+    join.lenght = lenght;
+    memcpy(join.request, msg, lenght + 1);
+    char *filename = (char *)msg->request.filename_and_mode;
+    sessions_lock();
+    for (int i = 0; i < SESSION_SLOTS; i++)
+    {
+        session_slot *slot = &sessions->sessions[i];
+        if (slot->pid > 0 && slot->multicast && mc_pipes[i] >= 0 && !strcmp(slot->file, filename))
+        {
+            // The pipe is non-blocking, if the session is too busy to read it, the client gets its own session
+            joined = write(mc_pipes[i], &join, sizeof(join)) == sizeof(join);
+            break;
+        }
+    }
+    sessions_unlock();
+    return joined;
+}
+
+/**
+ * @brief Adds the joining client to the multicast session
+ * @param socket Source ID
+ * @param clients Clients of the session
+ * @param count Number of the clients
+ * @param join Request of the joining client
+ * @param req Request of the first client
+ * @param master True if the client becomes the master client
+ * @return True if the client was added
+ */
+bool multicast_add(int socket, mc_client *clients, int *count, mc_join *join, tftp_request *req, bool master)
+{
+    struct sockaddr *address = (struct sockaddr *)&join->addr;
+    char *value = request_option((tftp_message_request *)join->request, join->lenght, "blksize");
+    int requested = value ? atoi(value) : 512;
+    if (*count == MC_CLIENTS)
+    {
+        send_error(socket, address, sizeof(join->addr), not_defined, "ERROR: Multicast session is full\n");
+        return false;
+    }
+    if (requested < blocksize)
+    {
+        send_error(socket, address, sizeof(join->addr), option_negogiaton, "ERROR: Block size of the multicast session is too big\n");
+        return false;
+    }
+    clients[*count].addr = join->addr;
+    (*count)++;
+    send_multicast_oack(socket, &join->addr, req, master);
+    return true;
+}
+
+/**
+ * @brief Function used by SERVER for sending one copy of the file to all clients of the multicast session (RFC 2090)
+ * The master client ACKs the blocks sent to the group, other clients only listen to the group and ask for the missing blocks by unicast ACKs.
+ * When the master client has the whole file, the next client becomes the master client and the server continues from the block it needs.
+ * @param address Address of the first client
+ * @param slen Adress lenght
  * @param socket Source ID
- * @param address Destination address
- * @param slen
- * @param message Structured data type used for storing informations about the messages
  * @param filename The name of the file that we are going to sent
- * @param mode Defines which mode is going to be used
- * @param fd File that we are going to work with
- * @return Number of bytes that have been sent
+ * @param req Parsed request of the first client with the options accepted for the whole session
+ * @param msg Request of the first client
+ * @param lenght Lenght of the request
  */
-void server_upload(FILE *fd, struct sockaddr *address, socklen_t slen, int socket, char *filename, bool optionsi, char *opts)
+void server_multicast(struct sockaddr *address, socklen_t slen, int socket, char *filename, tftp_request *req, tftp_message_request *msg, ssize_t lenght)
 {
-    bool end = false;
-    fd = fopen(filename, "w");
-    tftp_message *message = malloc(sizeof(tftp_message) + blocksize);
-    ssize_t x;
-    uint16_t block = 0;
-    if (optionsi)
+    struct stat st;
+    uint64_t start = trace_clock();
+    int file = open(filename, O_RDONLY);
+    trace_span("open", start, -1, -1);
+    if (file < 0 || fstat(file, &st) < 0)
     {
-        send_oack(socket, 0, address, slen, opts);
+        send_error(socket, address, slen, file_not_found, "ERROR: File not found\n");
+        if (file >= 0)
+        {
+            close(file);
+        }
+        return;
     }
-    else
+    // The last block is always shorter than the block size, it can be empty
+    uint32_t last = st.st_size / blocksize + 1;
+    if (last > UINT16_MAX)
     {
-        x = send_ack(socket, block, address, slen);
+        send_error(socket, address, slen, not_defined, "ERROR: File too large for multicast transfer\n");
+        close(file);
+        return;
     }
-    if (x < 0)
+    struct sockaddr_in group;
+    memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_addr = mcast_group;
+    group.sin_port = htons(mcast_port + session_index);
+    // Group is reached through the interface used to reach the first client, this way loopback clients work as well
+    struct in_addr iface = local_address_to((struct sockaddr_in *)address);
+    unsigned char ttl = 1, loop = 1;
+    if (setsockopt(socket, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0 ||
+        setsockopt(socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+        setsockopt(socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0)
     {
-        fclose(fd);
+        printf("ERROR: setsockopt()\n");
+        send_error(socket, address, slen, not_defined, "ERROR: Multicast not available\n");
+        close(file);
         return;
     }
-    int tiktok;
+
+    mc_client clients[MC_CLIENTS];
+    mc_join join;
+    int count = 0, master = 0;
+    // Block waiting for the ACK of the master client, 0 if the master client did not ACK the OACK yet
+    uint16_t pending = 0;
+    int tiktok = RECV_RETRIES;
+    uint8_t *data = malloc(blocksize);
+    tftp_message *message = malloc(sizeof(tftp_message) + blocksize);
+    struct pollfd fds[2] = {{socket, POLLIN, 0}, {mc_pipe, POLLIN, 0}};
+    // Retransmission timer of the block (or the OACK) sent to the master client
+    timer_wheel wheel;
+    timer_entry retransmit;
+    bool timed_out = false;
+    if (!wheel_init(&wheel))
+    {
+        send_error(socket, address, slen, not_defined, "ERROR: Out of memory\n");
+        free(message);
+        free(data);
+        close(file);
+        return;
+    }
+    timer_init(&retransmit, timer_flag, &timed_out);
+
+    join.addr = *(struct sockaddr_in *)address;
+    join.lenght = lenght;
+    memcpy(join.request, msg, lenght + 1);
+    multicast_add(socket, clients, &count, &join, req, true);
+    timer_arm(&wheel, &retransmit, tv.tv_sec * 1000);
+    session_set_multicast(true);
     while (true)
     {
-        for (tiktok = RECV_RETRIES; tiktok; tiktok--)
+        if (count == 0)
         {
-            // This should be in loop that is handling timeout
-            x = receive_message(socket, message, address, &slen, blocksize);
-            if (x >= 0 && x < 4)
-            {
-                send_error(socket, address, slen, 0, "ERROR: Received wrong response\n");
-                free(message);
-                close(socket);
-                fclose(fd);
-                remove(filename);
-                return;
-            }
-
-            // I guess if we received a correct response on time we jump out of this for that is handling timeout, this break is not for while loop
-            if (x >= 4)
-            {
-                break;
-            }
-
-            x = send_ack(socket, block, address, slen);
-
-            if (x < 0)
-            {
-                // send error
-                free(message);
-                close(socket);
-                fclose(fd);
-                remove(filename);
-                return;
-            }
+            // New clients are not passed to this session anymore, the ones already in the pipe still have to be served
+            session_set_multicast(false);
         }
-        if (!tiktok)
+        if (cancel_check())
         {
-            // Transfer timed out
-            send_error(socket, address, slen, 0, "ERROR: Timeout\n");
-            free(message);
-            close(socket);
-            fclose(fd);
-            remove(filename);
-            return;
+            break;
         }
-
-        block++;
-        if (x < blocksize)
+        int ready = poll(fds, fds[1].fd >= 0 ? 2 : 1, count ? wheel_timeout(&wheel) : 0);
+        if (ready < 0 && errno == EINTR)
         {
-            end = true;
+            continue;
         }
-        if (!opcodes_check_upload(socket, block, message, slen, address))
+        if (ready < 0 || (ready == 0 && count == 0))
         {
-            // send error
-            free(message);
-            close(socket);
-            fclose(fd);
-            remove(filename);
-            return;
+            break;
         }
-        x = fwrite(message->data.data, 1, x - 4, fd);
-        if (x < 0)
+        timed_out = false;
+        wheel_expire(&wheel);
+        if (timed_out)
         {
-            // send error
-            free(message);
-            close(socket);
-            fclose(fd);
-            remove(filename);
-            return;
+            trace_instant("timeout", pending, -1);
+            if (--tiktok)
+            {
+                // Master client did not respond in time
+                trace_instant("retransmit", pending, -1);
+                if (pending == 0)
+                {
+                    send_multicast_oack(socket, &clients[master].addr, req, true);
+                }
+                else
+                {
+                    send_file_block(file, pending, data, &group, socket);
+                }
+                timer_arm(&wheel, &retransmit, tv.tv_sec * 1000);
+            }
+            else
+            {
+                // Master client is gone, the next client takes over
+                clients[master] = clients[--count];
+                master = -1;
+                timer_cancel(&wheel, &retransmit);
+            }
         }
-        x = send_ack(socket, block, address, slen);
-        if (x < 0)
+        if (ready > 0 && (fds[1].revents & POLLIN))
         {
-            free(message);
-            close(socket);
-            fclose(fd);
-            remove(filename);
-            return;
+            if (read(mc_pipe, &join, sizeof(join)) == sizeof(join))
+            {
+                multicast_add(socket, clients, &count, &join, req, master < 0);
+                if (master < 0 && count > 0)
+                {
+                    master = count - 1;
+                    pending = 0;
+                    tiktok = RECV_RETRIES;
+                    timer_arm(&wheel, &retransmit, tv.tv_sec * 1000);
+                }
+            }
         }
-        if (end)
+        else if (ready > 0 && (fds[1].revents & (POLLHUP | POLLERR)))
         {
-            // send error
-            free(message);
-            fclose(fd);
-            return;
+            fds[1].fd = -1;
+        }
+        if (ready > 0 && (fds[0].revents & POLLIN))
+        {
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+            ssize_t x = receive_message(socket, message, (struct sockaddr *)&from, &fromlen, blocksize);
+            int c;
+            for (c = 0; c < count; c++)
+            {
+                if (clients[c].addr.sin_addr.s_addr == from.sin_addr.s_addr && clients[c].addr.sin_port == from.sin_port)
+                {
+                    break;
+                }
+            }
+            if (x < 4)
+            {
+                continue;
+            }
+            if (c == count)
+            {
+                send_error(socket, (struct sockaddr *)&from, fromlen, unknown_id, "ERROR: Unknown transfer ID\n");
+                continue;
+            }
+            bool remove_client = false;
+            trace_instant(ntohs(message->opcode) == ACK ? "ACK" : "receive", ntohs(message->ack.block_number), -1);
+            if (ntohs(message->opcode) == ERROR)
+            {
+                remove_client = true;
+            }
+            else if (ntohs(message->opcode) != ACK)
+            {
+                send_error(socket, (struct sockaddr *)&from, fromlen, illegal_operation, "Invalid message received during transfer\n");
+                remove_client = true;
+            }
+            else if (ntohs(message->ack.block_number) >= last)
+            {
+                // Client has the whole file
+                remove_client = true;
+            }
+            else if (c == master && pending != 0 && ntohs(message->ack.block_number) != pending)
+            {
+                // Old ACK of the master client, the pending block is sent again only by the retransmission timer
+                if ((uint16_t)(pending - ntohs(message->ack.block_number)) == 1)
+                {
+                    duplicate_acks++;
+                }
+                else
+                {
+                    stale_acks++;
+                }
+            }
+            else if (c == master)
+            {
+                pending = ntohs(message->ack.block_number) + 1;
+                tiktok = RECV_RETRIES;
+                send_file_block(file, pending, data, &group, socket);
+                timer_arm(&wheel, &retransmit, tv.tv_sec * 1000);
+            }
+            else
+            {
+                // Client that is not the master fills the gap by unicast
+                send_file_block(file, ntohs(message->ack.block_number) + 1, data, &clients[c].addr, socket);
+            }
+            if (remove_client)
+            {
+                clients[c] = clients[--count];
+                if (c == master)
+                {
+                    master = -1;
+                    timer_cancel(&wheel, &retransmit);
+                }
+                else if (master == count)
+                {
+                    master = c;
+                }
+            }
+        }
+        if (master < 0 && count > 0)
+        {
+            // Next client becomes the master client and tells the server which block it needs
+            master = 0;
+            pending = 0;
+            tiktok = RECV_RETRIES;
+            send_multicast_oack(socket, &clients[master].addr, req, true);
+            timer_arm(&wheel, &retransmit, tv.tv_sec * 1000);
         }
     }
+    // Counters of the wheel are printed only for the traced session
+    if (tracing)
+    {
+        wheel_report(&wheel, "multicast");
+    }
+    wheel_free(&wheel);
+    free(message);
+    free(data);
+    close(file);
+}
+
+/**
+ * @brief Marks the session cancelled from the control socket. The session could be holding a shared lock,
+ *        so it ends through its usual cleanup once its current wait is interrupted.
+ * @param sig Number of the signal
+ */
+void session_cancel(int sig)
+{
+    (void)sig;
+    session_cancelled = 1;
 }
 
 /**
@@ -663,101 +2443,168 @@ void handle_client_rqst(tftp_message_request *msg, struct sockaddr *adress, sock
 {
     tv.tv_usec = 0;
     tv.tv_sec = RECV_TIMEOUT;
-    char *filename, *mode, *lastnode;
     int client_socket;
-    uint16_t opcode;
     FILE *fd;
-    char *options;
-    bool optinfo = false;
+    int error;
+    char *reason;
+    // Request is parsed into the stack, nothing is allocated for it
+    tftp_request req;
+    trace_start((struct sockaddr_in *)adress, (char *)msg->request.filename_and_mode, ntohs(msg->opcode));
     client_socket = create_socket();
-    if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+    cancel_socket = client_socket;
+    cancel_peer = *(struct sockaddr_in *)adress;
+    // Handler does not restart the interrupted wait, the session notices the cancel right away
+    struct sigaction cancel;
+    memset(&cancel, 0, sizeof(cancel));
+    cancel.sa_handler = session_cancel;
+    sigemptyset(&cancel.sa_mask);
+    sigaction(SIGTERM, &cancel, NULL);
+    // Frames of the AF_XDP engine do not pass the socket, so they have no kernel timestamps
+    if (timestamping && (xdp_request || !tstamp_enable(client_socket)))
     {
-        printf("setsockopt()\n");
-        free(msg);
+        // Session falls back to the clock of the server
+        timestamping = false;
+    }
+    if (!parse_request(msg, lenght, &req, &error, &reason))
+    {
+        send_error(client_socket, adress, len, error, reason);
         close(client_socket);
-        exit(EXIT_FAILURE);
+        free(msg);
+        return;
     }
-    filename = msg->request.filename_and_mode;
-    mode = strchr(filename, '\0') + 1;
-    ssize_t fmlen = strlen(mode) + strlen(filename);
-    char *opts = NULL;
-    if (fmlen != (lenght - 4))
+    if (signature_chunk > 0 && bundle)
     {
-        opts = (char *)malloc(lenght - 4 - fmlen);
-        options = mode;
-        if (!parse_options(options, opts))
-        {
-            send_error(client_socket, adress, len, 8, "ERROR: Options passed in an incorrect way\n");
-            close(client_socket);
-            free(opts);
-            free(msg);
-            return;
-        }
-        optinfo = true;
+        bundle = false;
+        options_remove(&req, "bundle");
     }
-    else
+    if (req.opcode != RRQ || signature_chunk > 0 || bundle)
     {
-        lastnode = &filename[lenght - 3];
-        if (*lastnode != '\0')
-        {
-            send_error(client_socket, adress, len, 0, "ERROR: Filename and mode passed in an incorrect way\n");
-            free(opts);
-            close(client_socket);
-            free(msg);
-            return;
-        }
+        multicast = false;
+    }
+    if (signature_chunk > 0 || delta_base != NULL || bundle)
+    {
+        // Signatures, the delta and the bundle cover the whole file, the partial one is not continued
+        resume = false;
+    }
+    if (req.opcode == RRQ && windowsize > 1 && (long)windowsize * blocksize > WINDOW_BYTES)
+    {
+        // Blocks of the download window are kept in the memory until they are acknowledged, whatever the download sends
+        windowsize = WINDOW_BYTES / blocksize;
+        options_set(&req, "windowsize", windowsize);
     }
-    int transfermode;
-    if (!strcmp(mode, "octet"))
+    if (multicast)
     {
-        transfermode = OCTET;
+        // Multicast session sends one block at a time to the group
+        options_remove(&req, "windowsize");
+        windowsize = 1;
+        // Multicast session sends the same raw blocks to every client, they can not be encoded per client
+        options_remove(&req, "compress");
+        options_remove(&req, "checksum");
+        compress = false;
+        checksum = false;
     }
     else
     {
-        if (!strcmp(mode, "netascii"))
-        {
-            transfermode = NETASCII;
-        }
-        else
-        {
-            send_error(client_socket, adress, len, 0, "ERROR: Invalid mode specified \n");
-            free(opts);
-            close(client_socket);
-            free(msg);
-            return;
-        }
+        // Multicast session serves many subnets, its parameters are not changed
+        profile_apply(&req, ((struct sockaddr_in *)adress)->sin_addr);
+    }
+    if (xdp_request && !multicast && blocksize > xdp_block)
+    {
+        // Frame of the engine is never fragmented, the block must fit into one
+        blocksize = xdp_block;
+        options_set(&req, "blksize", blocksize);
     }
+    char *filename = req.filename;
 
     if (filename[0] == '/' && strncmp(filename, directory, strlen(directory)) != 0)
     {
         send_error(client_socket, adress, len, 0, "ERROR: Filename outside base directory \n");
-        free(opts);
         close(client_socket);
         free(msg);
         return;
     }
-    opcode = ntohs(msg->opcode);
-    if (opcode == RRQ)
+    if (delta_base != NULL && delta_base[0] == '/' && strncmp(delta_base, directory, strlen(directory)) != 0)
+    {
+        send_error(client_socket, adress, len, 0, "ERROR: Base file outside base directory \n");
+        close(client_socket);
+        free(msg);
+        return;
+    }
+    // Timeout option could change the time, so it is set after the options are parsed
+    if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+    {
+        printf("setsockopt()\n");
+        free(msg);
+        close(client_socket);
+        exit(EXIT_FAILURE);
+    }
+    if (multicast)
+    {
+        // Group and the clients that join are served through the kernel
+        xdp_request = false;
+    }
+    // Datagrams of the session go through the engine from its first reply
+    xdp_session(client_socket);
+    session_set_file(filename, req.opcode);
+    if (bundle && (bundle_fd = bundle_open(filename, &bundle_size)) == NULL)
+    {
+        // Members are opened while the bundle is sent, but all of them must exist before the OACK
+        send_error(client_socket, adress, len, file_not_found, "ERROR: Bundle can not be sent\n");
+        close(client_socket);
+        free(msg);
+        return;
+    }
+    if (req.opcode == RRQ)
+    {
+        tsize_report(&req);
+    }
+    else if (tsize == 0)
+    {
+        // Upload of the unknown size
+        options_remove(&req, "tsize");
+    }
+    if (req.opcode == RRQ && multicast && req.mode == OCTET)
     {
-        server_download(fd, adress, len, client_socket, filename, opts, transfermode, optinfo);
+        server_multicast(adress, len, client_socket, filename, &req, msg, lenght);
         free(msg);
     }
-    else if (opcode == WRQ)
+    else if (req.opcode == RRQ)
+    {
+        resume_check(&req);
+        server_download(fd, adress, len, client_socket, filename, &req, req.mode, req.opts_len > 0);
+        free(msg);
+    }
+    else if (req.opcode == WRQ)
     {
         struct stat file_info;
         if (stat(filename, &file_info) == 0)
         {
             send_error(client_socket, adress, len, file_exists, "ERROR: Filename already exists \n");
-            free(opts);
             close(client_socket);
             free(msg);
             return;
         }
-        server_upload(fd, adress, len, client_socket, filename, optinfo, opts);
+        server_upload(fd, adress, len, client_socket, filename, req.opts_len > 0, &req);
         free(msg);
     }
+    if (stats.completed || stats.timed_out)
+    {
+        profile_update(((struct sockaddr_in *)adress)->sin_addr, &stats);
+    }
+    if (duplicate_acks || stale_acks || duplicate_data)
+    {
+        fprintf(stderr, "DUPLICATES duplicate_acks=%lu stale_acks=%lu duplicate_data=%lu\n", duplicate_acks, stale_acks, duplicate_data);
+    }
+    if (stats.stamped)
+    {
+        fprintf(stderr, "TIMESTAMPS samples=%lu wire_rtt=%.3fms host=%.3fms srtt=%.3fms rto=%.3fms\n", stats.stamped, stats.wire_sum / stats.stamped * 1000,
+                stats.host_sum / stats.stamped * 1000, srtt * 1000, (tv.tv_sec + tv.tv_usec / 1e6) * 1000);
+    }
+    if (xdp_request)
+    {
+        fprintf(stderr, "XDP sent=%lu received=%lu kernel=%lu\n", xdp_sent, xdp_received, xdp_kernel);
+    }
     close(client_socket);
-    free(opts);
     return;
 }
 
@@ -770,37 +2617,113 @@ void server(int sck)
     struct sockaddr_in client_addr;
     socklen_t addr_size;
     struct sockaddr *addr = (struct sockaddr *)&client_addr;
-    const char *hostaddrp;
-    struct hostent *hostp;
     while (1)
     {
         tftp_message_request *msg = malloc(sizeof(tftp_message) + 512);
         uint16_t opcode;
         ssize_t lenght;
         addr_size = sizeof(client_addr);
+        if (control_fd >= 0 || xdp_event >= 0)
+        {
+            // Commands are answered between the requests, the requests from the AF_XDP engine come with its event
+            struct pollfd fds[3] = {{sck, POLLIN, 0}, {control_fd, POLLIN, 0}, {xdp_event, POLLIN, 0}};
+            if (poll(fds, 3, -1) > 0 && (fds[1].revents & POLLIN))
+            {
+                control_handle();
+            }
+            if (!(fds[0].revents & POLLIN) && !(fds[2].revents & POLLIN))
+            {
+                free(msg);
+                continue;
+            }
+        }
         if ((lenght = receive_message_request(sck, msg, addr, &addr_size)) < 4)
         {
             printf("ERROR: Invalid message received\n");
+            free(msg);
+            continue;
         }
-        hostp = gethostbyaddr((const char *)&client_addr.sin_addr.s_addr, sizeof(client_addr.sin_addr.s_addr), AF_INET);
-        hostaddrp = inet_ntoa(client_addr.sin_addr);
         opcode = ntohs(msg->opcode);
+        trace_received();
+        staging_collect();
+        profiles_save(false);
         if (opcode == WRQ || opcode == RRQ)
         {
-            if (fork() == 0)
+            bool mc_request = opcode == RRQ && mcast_enabled && request_option(msg, lenght, "multicast") != NULL;
+            // Requests over the limits are rejected right away, so the client does not wait for a timeout.
+            // Client joining the running multicast session is checked too, its slot is freed once it joined.
+            char *reason;
+            int slot = session_admit(&client_addr, &reason);
+            if (slot < 0)
+            {
+                send_error(sck, addr, addr_size, not_defined, reason);
+                free(msg);
+                continue;
+            }
+            if (mc_request && multicast_join(msg, lenght, &client_addr))
+            {
+                session_release(slot);
+                free(msg);
+                continue;
+            }
+            int pipefd[2] = {-1, -1};
+            if (mc_request && pipe(pipefd) < 0)
+            {
+                printf("ERROR: pipe()\n");
+            }
+            pid_t pid = fork();
+            if (pid == 0)
             {
+                close(sck);
+                for (int i = 0; i < SESSION_SLOTS; i++)
+                {
+                    if (mc_pipes[i] >= 0)
+                    {
+                        close(mc_pipes[i]);
+                    }
+                }
+                if (pipefd[1] >= 0)
+                {
+                    close(pipefd[1]);
+                }
+                mc_pipe = pipefd[0];
+                session_index = slot;
                 handle_client_rqst(msg, addr, addr_size, lenght, sck);
+                xdp_session_end();
+                exit(session_cancelled ? EXIT_FAILURE : EXIT_SUCCESS);
+            }
+            if (pipefd[0] >= 0)
+            {
+                close(pipefd[0]);
+            }
+            if (pid < 0)
+            {
+                printf("ERROR: fork()\n");
+                session_release(slot);
+                if (pipefd[1] >= 0)
+                {
+                    close(pipefd[1]);
+                }
             }
             else
             {
-                close(sck);
-                exit(EXIT_FAILURE);
+                session_attach(slot, pid);
+                if (pipefd[1] >= 0)
+                {
+                    fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
+                }
+                if (mc_pipes[slot] >= 0)
+                {
+                    close(mc_pipes[slot]);
+                }
+                mc_pipes[slot] = pipefd[1];
             }
         }
         else
         {
             printf("Invalid opcode received\n");
         }
+        free(msg);
     }
     close(sck);
     exit(EXIT_SUCCESS);
@@ -814,9 +2737,20 @@ void server(int sck)
  */
 int main(int argc, char *argv[])
 {
+    sessions_init();
+    profiles_init();
+    for (int i = 0; i < SESSION_SLOTS; i++)
+    {
+        mc_pipes[i] = -1;
+    }
     check_args(argc, argv);
     int socket = create_socket();
     server_bind(socket);
+    if (xdp_ifname != NULL && !xdp_open(xdp_ifname, socket))
+    {
+        printf("AF_XDP engine is not available on %s, the sockets are used\n", xdp_ifname);
+        fflush(stdout);
+    }
     server(socket);
 
     return 0;
@@ -6,6 +6,8 @@
  */
 #ifndef TFTP_SERVER_H
 #define TFTP_SERVER_H
+#include <stdio.h>
+#include <netinet/in.h>
 #include "messages.h"
 
 enum MODE
@@ -14,10 +16,108 @@ enum MODE
     NETASCII
 };
 
+enum SERVER_OPTIONS
+{
+    OPT_MAX_SESSIONS = 256,
+    OPT_MAX_PER_IP,
+    OPT_MAX_PER_SUBNET,
+    OPT_SUBNET_PREFIX,
+    OPT_MAX_RPS,
+    OPT_SESSION_RATE,
+    OPT_CLIENT_RATE,
+    OPT_MCAST_GROUP,
+    OPT_MCAST_PORT,
+    OPT_COMPRESS_CACHE,
+    OPT_STAGING_DIR,
+    OPT_STAGING_TTL,
+    OPT_UPLINK_RATE,
+    OPT_SCHED_AGING,
+    OPT_SCHED_CLASS,
+    OPT_TRACE,
+    OPT_TRACE_IP,
+    OPT_TRACE_NAME,
+    OPT_PROFILE_FILE,
+    OPT_PROFILE_DECAY,
+    OPT_TIMESTAMPS,
+    OPT_CONTROL,
+    OPT_XDP
+};
+
+#define MAX_REQUEST 512
+#define OPTIONS_SIZE 1024
+#define MC_CLIENTS 256
+
+typedef struct
+{
+    struct sockaddr_in addr;
+} mc_client;
+
+/* Request parsed by parse_request(), the filename points to the received datagram.
+   Accepted options are stored right after the header of the OACK, so the OACK is sent without copying. */
+typedef struct
+{
+    uint16_t opcode;
+    char *filename;
+    int mode;
+    char *opts;      /* Accepted options as pairs of name and value strings, terminated by the empty string */
+    size_t opts_len; /* Bytes of the accepted options without the terminating empty string */
+    uint8_t oack[4 + OPTIONS_SIZE + 1];
+} tftp_request;
+
+/* Client passed from the main server process to the running multicast session */
+typedef struct
+{
+    struct sockaddr_in addr;
+    ssize_t lenght;
+    uint8_t request[MAX_REQUEST + 1];
+} mc_join;
+
+int parse_limit(char *str);
+
+int parse_seconds(char *str);
+
 void check_args(int argscount, char **args);
 
 void server(int sck);
 
+bool options_append(tftp_request *req, char *name, char *value);
+
+char *options_get(tftp_request *req, char *name);
+
+void options_remove(tftp_request *req, char *name);
+
+void options_set(tftp_request *req, char *name, long long value);
+
+ssize_t oack_send(int socket, struct sockaddr *address, socklen_t len, tftp_request *req);
+
+char *request_option(tftp_message_request *msg, ssize_t lenght, char *name);
+
+bool parse_request(tftp_message_request *msg, ssize_t lenght, tftp_request *req, int *error, char **reason);
+
+void tsize_report(tftp_request *req);
+
+void resume_check(tftp_request *req);
+
+void profile_apply(tftp_request *req, struct in_addr peer);
+
+ssize_t netascii_read(FILE *fd, char *ndata, bool *extrach, char *extra);
+
+FILE *staging_open(struct in_addr peer, char *filename, off_t *offset);
+
+bool staging_commit(FILE *fd, char *filename);
+
+void staging_collect();
+
+void upload_remove(char *filename);
+
+FILE *cache_open(FILE *fd, char *filename, bool *reused);
+
+int cache_flush();
+
+bool multicast_join(tftp_message_request *msg, ssize_t lenght, struct sockaddr_in *client);
+
+void server_multicast(struct sockaddr *address, socklen_t slen, int socket, char *filename, tftp_request *req, tftp_message_request *msg, ssize_t lenght);
+
 void handle_client_rqst(tftp_message_request *msg, struct sockaddr *adress, socklen_t len, ssize_t lenght, int socket);
 
 void check_args(int argscount, char **args);
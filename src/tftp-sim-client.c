@@ -0,0 +1,74 @@
+/**
+ * @file tftp-sim-client.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+// Client is compiled into the simulation next to the server, its globals and functions with the same names as the ones of the server are renamed
+#define main client_main
+#define port client_port
+#define blocksize client_blocksize
+#define windowsize client_windowsize
+#define multicast client_multicast
+#define compress client_compress
+#define checksum client_checksum
+#define resume client_resume
+#define resume_offset client_resume_offset
+#define resume_crc client_resume_crc
+#define rollover client_rollover
+#define delta_base client_delta_base
+#define bundle client_bundle
+#define create_socket client_create_socket
+#include "tftp-client.c"
+
+/**
+ * @brief Downloads the file like "tftp-client -h server -f filename -t destination" does, used by the client of the simulation
+ * @param server Address of the server
+ * @param filename Requested file
+ * @param destination Path of the downloaded file
+ * @param options True if the client asks for the compression and the checksum
+ * @param window Requested window, 1 if the client does not ask for it
+ */
+void sim_client_download(struct sockaddr_in *server, char *filename, char *destination, bool options, int window)
+{
+    // Globals keep the state of the previous download of the same process
+    type = DOWNLOAD;
+    filepath = filename;
+    destination_path = destination;
+    blocksize = 512;
+    windowsize = 1;
+    request_options_len = 0;
+    compress = options;
+    checksum = options;
+    lz_accepted = false;
+    crc_accepted = false;
+    resume = false;
+    resume_accepted = false;
+    resume_offset = 0;
+    transfer_size = 0;
+    rollover = 0;
+    active_sink = NULL;
+    multicast = false;
+    mc_accepted = false;
+    if (compress)
+    {
+        request_option_add("compress", "lz");
+    }
+    if (checksum)
+    {
+        request_option_add("checksum", "crc32c");
+    }
+    request_option_add("tsize", "0");
+    window_request = window;
+    if (window > 1)
+    {
+        char value[12];
+        snprintf(value, sizeof(value), "%d", window);
+        request_option_add("windowsize", value);
+    }
+    // Address is changed to the port of the session when the first reply arrives
+    struct sockaddr_in address = *server;
+    int socket = create_socket();
+    handle_rrq(socket, sizeof(address), (struct sockaddr *)&address, "octet");
+    close(socket);
+}
@@ -0,0 +1,894 @@
+/**
+ * @file tftp-sim.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+// Server is compiled into the simulation so that its sessions can run in threads, its main() is renamed
+#define main server_main
+#include "tftp-server.c"
+#undef main
+
+#define SIM_SOCKETS 64
+#define SIM_ACTORS 2
+// Deadline of the wait that ends only with the datagram
+#define SIM_NONE UINT64_MAX
+#define SIM_SERVER_IP 0x0a000001
+#define SIM_CLIENT_IP 0x0a000002
+// Virtual clock starts here, so the code under the test never sees the time 0
+#define SIM_EPOCH 1000000000000ULL
+
+int __real_socket(int domain, int type, int protocol);
+int __real_bind(int socket, const struct sockaddr *address, socklen_t len);
+int __real_close(int fd);
+ssize_t __real_sendto(int socket, const void *buf, size_t len, int flags, const struct sockaddr *address, socklen_t slen);
+ssize_t __real_recvfrom(int socket, void *buf, size_t len, int flags, struct sockaddr *address, socklen_t *slen);
+int __real_poll(struct pollfd *fds, nfds_t n, int timeout);
+int __real_setsockopt(int socket, int level, int name, const void *value, socklen_t len);
+int __real_getsockname(int socket, struct sockaddr *address, socklen_t *len);
+int __real_clock_gettime(clockid_t clock, struct timespec *ts);
+int __real_nanosleep(const struct timespec *req, struct timespec *rem);
+void __real_exit(int status) __attribute__((noreturn));
+
+void sim_client_download(struct sockaddr_in *server, char *filename, char *destination, bool options, int window);
+
+/* Datagram travelling through the simulated network or waiting in the socket */
+typedef struct sim_packet
+{
+    struct sim_packet *next;
+    uint64_t time; /* Virtual time of the delivery */
+    uint64_t seq;  /* Datagrams delivered at the same time keep the order they were sent in */
+    struct sockaddr_in from;
+    struct sockaddr_in to;
+    size_t len;
+    uint8_t data[];
+} sim_packet;
+
+/* Simulated UDP socket, it is backed by a real socket only so that its descriptor is unique */
+typedef struct
+{
+    int fd; /* -1 if the slot is free */
+    struct sockaddr_in addr;
+    uint64_t rcvtimeo; /* Nanoseconds, 0 if the receiving blocks until the datagram arrives */
+    sim_packet *head;
+    sim_packet *tail;
+} sim_socket;
+
+/* Thread running one side of the transfer, only one actor runs at a time */
+typedef struct
+{
+    pthread_t thread;
+    pthread_cond_t wake;
+    bool running;
+    bool blocked;
+    bool done;
+    uint64_t deadline;
+    int waits[4]; /* Sockets the blocked actor waits for */
+    int nwaits;
+    uint32_t host;
+    void (*fn)(void *arg);
+    void *arg;
+    int status;
+    uint64_t end;
+} sim_actor;
+
+/* Parameters of the simulated link, they are the same in both directions */
+typedef struct
+{
+    double loss;      /* Probability that the datagram is lost */
+    double duplicate; /* Probability that the datagram is delivered twice */
+    uint64_t latency; /* One way delay in nanoseconds */
+    uint64_t jitter;  /* Largest random delay added to the latency, datagrams with different delays are reordered */
+} sim_link;
+
+/* Outcome of one simulated transfer */
+typedef struct
+{
+    bool ok;
+    uint64_t time;
+    unsigned long data_sent;
+    unsigned long dropped;
+} sim_result;
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t idle; /* Signalled when the running actor blocks or ends */
+    bool active;
+    bool aborted;
+    uint64_t now;
+    uint64_t seq;
+    uint64_t rng;
+    sim_link link;
+    sim_packet *flight; /* Datagrams in the network ordered by their delivery */
+    sim_socket sockets[SIM_SOCKETS];
+    sim_actor actors[SIM_ACTORS];
+    uint16_t next_port;
+    unsigned long data_sent;
+    unsigned long dropped;
+} sim = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, false, 0, 0, 0, {0, 0, 0, 0}, NULL, {{0}}, {{0}}, 0, 0, 0};
+
+// Actor of the calling thread, NULL in the threads that do not take part in the simulation
+static __thread sim_actor *self = NULL;
+
+/**
+ * @brief Draws the random number from the seeded generator (xorshift64*)
+ * @return Number from the interval [0, 1)
+ */
+static double sim_random()
+{
+    sim.rng ^= sim.rng >> 12;
+    sim.rng ^= sim.rng << 25;
+    sim.rng ^= sim.rng >> 27;
+    return (double)((sim.rng * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 53);
+}
+
+/**
+ * @brief Finds the simulated socket
+ * @param fd Descriptor of the socket
+ * @return Simulated socket, NULL if the descriptor is not one
+ */
+static sim_socket *sim_find(int fd)
+{
+    if (!sim.active || fd < 0)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < SIM_SOCKETS; i++)
+    {
+        if (sim.sockets[i].fd == fd)
+        {
+            return &sim.sockets[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Gives the control back to the scheduler until the awaited datagram arrives or the deadline passes,
+ *        the lock is held. Actor of the aborted simulation ends here.
+ * @param deadline Virtual time the actor waits until, SIM_NONE if it waits only for the datagram
+ */
+static void sim_block(uint64_t deadline)
+{
+    self->deadline = deadline;
+    self->blocked = true;
+    self->running = false;
+    pthread_cond_signal(&sim.idle);
+    while (!self->running)
+    {
+        pthread_cond_wait(&self->wake, &sim.lock);
+    }
+    if (sim.aborted)
+    {
+        self->status = EXIT_FAILURE;
+        self->done = true;
+        self->running = false;
+        pthread_cond_signal(&sim.idle);
+        pthread_mutex_unlock(&sim.lock);
+        pthread_exit(NULL);
+    }
+}
+
+/**
+ * @brief Delivers the datagram to the socket it was sent to, the actors waiting for the socket can run again
+ * @param packet Datagram that reached its destination
+ */
+static void sim_deliver(sim_packet *packet)
+{
+    sim_socket *dst = NULL;
+    for (int i = 0; i < SIM_SOCKETS && dst == NULL; i++)
+    {
+        if (sim.sockets[i].fd >= 0 && sim.sockets[i].addr.sin_port == packet->to.sin_port &&
+            sim.sockets[i].addr.sin_addr.s_addr == packet->to.sin_addr.s_addr)
+        {
+            dst = &sim.sockets[i];
+        }
+    }
+    if (dst == NULL)
+    {
+        // Nobody listens on the port
+        free(packet);
+        return;
+    }
+    packet->next = NULL;
+    if (dst->tail != NULL)
+    {
+        dst->tail->next = packet;
+    }
+    else
+    {
+        dst->head = packet;
+    }
+    dst->tail = packet;
+    for (int a = 0; a < SIM_ACTORS; a++)
+    {
+        for (int w = 0; w < sim.actors[a].nwaits; w++)
+        {
+            if (sim.actors[a].blocked && sim.actors[a].waits[w] == dst->fd)
+            {
+                sim.actors[a].blocked = false;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Puts the datagram into the network, it is delivered after the latency and the jitter of the link
+ * @param from Source address
+ * @param to Destination address
+ * @param buf Payload of the datagram
+ * @param len Lenght of the payload
+ */
+static void sim_transmit(struct sockaddr_in *from, const struct sockaddr_in *to, const void *buf, size_t len)
+{
+    sim_packet *packet = malloc(sizeof(sim_packet) + len);
+    packet->time = sim.now + sim.link.latency + (uint64_t)(sim_random() * sim.link.jitter);
+    packet->seq = sim.seq++;
+    packet->from = *from;
+    packet->to = *to;
+    packet->len = len;
+    memcpy(packet->data, buf, len);
+    sim_packet **pos = &sim.flight;
+    while (*pos != NULL && ((*pos)->time < packet->time || ((*pos)->time == packet->time && (*pos)->seq < packet->seq)))
+    {
+        pos = &(*pos)->next;
+    }
+    packet->next = *pos;
+    *pos = packet;
+}
+
+/**
+ * @brief Creates the simulated socket when it is created by the actor
+ */
+int __wrap_socket(int domain, int type, int protocol)
+{
+    int fd = __real_socket(domain, type, protocol);
+    if (self == NULL || fd < 0 || domain != AF_INET || type != SOCK_DGRAM)
+    {
+        return fd;
+    }
+    pthread_mutex_lock(&sim.lock);
+    for (int i = 0; i < SIM_SOCKETS; i++)
+    {
+        if (sim.sockets[i].fd < 0)
+        {
+            memset(&sim.sockets[i], 0, sizeof(sim_socket));
+            sim.sockets[i].fd = fd;
+            sim.sockets[i].addr.sin_family = AF_INET;
+            sim.sockets[i].addr.sin_addr.s_addr = htonl(self->host);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sim.lock);
+    return fd;
+}
+
+/**
+ * @brief Binds the simulated socket to the port, the address is always the one of the host of the actor
+ */
+int __wrap_bind(int socket, const struct sockaddr *address, socklen_t len)
+{
+    pthread_mutex_lock(&sim.lock);
+    sim_socket *s = sim_find(socket);
+    if (s != NULL)
+    {
+        s->addr.sin_port = ((struct sockaddr_in *)address)->sin_port;
+    }
+    pthread_mutex_unlock(&sim.lock);
+    return s != NULL ? 0 : __real_bind(socket, address, len);
+}
+
+/**
+ * @brief Closes the socket, datagrams waiting in the simulated socket are dropped
+ */
+int __wrap_close(int fd)
+{
+    pthread_mutex_lock(&sim.lock);
+    sim_socket *s = sim_find(fd);
+    if (s != NULL)
+    {
+        while (s->head != NULL)
+        {
+            sim_packet *next = s->head->next;
+            free(s->head);
+            s->head = next;
+        }
+        s->fd = -1;
+    }
+    pthread_mutex_unlock(&sim.lock);
+    return __real_close(fd);
+}
+
+/**
+ * @brief Sends the datagram through the simulated link, it can be lost, delayed or duplicated
+ */
+ssize_t __wrap_sendto(int socket, const void *buf, size_t len, int flags, const struct sockaddr *address, socklen_t slen)
+{
+    pthread_mutex_lock(&sim.lock);
+    sim_socket *s = sim_find(socket);
+    if (s == NULL)
+    {
+        pthread_mutex_unlock(&sim.lock);
+        return __real_sendto(socket, buf, len, flags, address, slen);
+    }
+    if (s->addr.sin_port == 0)
+    {
+        s->addr.sin_port = htons(sim.next_port++);
+    }
+    if (len >= 4 && ntohs(((const tftp_message *)buf)->opcode) == DATA && ntohl(s->addr.sin_addr.s_addr) == SIM_SERVER_IP)
+    {
+        sim.data_sent++;
+    }
+    // Random numbers are drawn in the same order in every run with the same seed
+    double fate = sim_random();
+    if (fate < sim.link.loss)
+    {
+        sim.dropped++;
+    }
+    else
+    {
+        sim_transmit(&s->addr, (const struct sockaddr_in *)address, buf, len);
+        if (fate < sim.link.loss + sim.link.duplicate)
+        {
+            sim_transmit(&s->addr, (const struct sockaddr_in *)address, buf, len);
+        }
+    }
+    pthread_mutex_unlock(&sim.lock);
+    return len;
+}
+
+/**
+ * @brief Receives the datagram from the simulated socket, the timeout of the socket runs in the virtual time
+ */
+ssize_t __wrap_recvfrom(int socket, void *buf, size_t len, int flags, struct sockaddr *address, socklen_t *slen)
+{
+    pthread_mutex_lock(&sim.lock);
+    sim_socket *s = sim_find(socket);
+    if (s == NULL || self == NULL)
+    {
+        pthread_mutex_unlock(&sim.lock);
+        return __real_recvfrom(socket, buf, len, flags, address, slen);
+    }
+    uint64_t deadline = s->rcvtimeo ? sim.now + s->rcvtimeo : SIM_NONE;
+    while (s->head == NULL)
+    {
+        if (sim.now >= deadline || (flags & MSG_DONTWAIT))
+        {
+            pthread_mutex_unlock(&sim.lock);
+            errno = EAGAIN;
+            return -1;
+        }
+        self->waits[0] = socket;
+        self->nwaits = 1;
+        sim_block(deadline);
+    }
+    sim_packet *packet = s->head;
+    s->head = packet->next;
+    if (s->head == NULL)
+    {
+        s->tail = NULL;
+    }
+    // Datagram longer than the buffer is truncated like the real one
+    size_t n = packet->len < len ? packet->len : len;
+    memcpy(buf, packet->data, n);
+    if (address != NULL)
+    {
+        memcpy(address, &packet->from, *slen < sizeof(packet->from) ? *slen : sizeof(packet->from));
+        *slen = sizeof(packet->from);
+    }
+    free(packet);
+    pthread_mutex_unlock(&sim.lock);
+    return n;
+}
+
+/**
+ * @brief Waits for the simulated sockets in the virtual time, the other descriptors are only checked
+ */
+int __wrap_poll(struct pollfd *fds, nfds_t n, int timeout)
+{
+    if (self == NULL)
+    {
+        return __real_poll(fds, n, timeout);
+    }
+    pthread_mutex_lock(&sim.lock);
+    uint64_t deadline = timeout < 0 ? SIM_NONE : sim.now + (uint64_t)timeout * 1000000;
+    while (true)
+    {
+        int ready = 0;
+        self->nwaits = 0;
+        for (nfds_t i = 0; i < n; i++)
+        {
+            sim_socket *s = sim_find(fds[i].fd);
+            fds[i].revents = 0;
+            if (s != NULL)
+            {
+                fds[i].revents = s->head != NULL ? (fds[i].events & POLLIN) : 0;
+                if (self->nwaits < 4)
+                {
+                    self->waits[self->nwaits++] = fds[i].fd;
+                }
+            }
+            else if (fds[i].fd >= 0)
+            {
+                __real_poll(&fds[i], 1, 0);
+            }
+            ready += fds[i].revents != 0;
+        }
+        if (ready > 0 || sim.now >= deadline)
+        {
+            pthread_mutex_unlock(&sim.lock);
+            return ready;
+        }
+        sim_block(deadline);
+    }
+}
+
+/**
+ * @brief Stores the receive timeout of the simulated socket, the other options are ignored
+ */
+int __wrap_setsockopt(int socket, int level, int name, const void *value, socklen_t len)
+{
+    pthread_mutex_lock(&sim.lock);
+    sim_socket *s = sim_find(socket);
+    if (s != NULL && level == SOL_SOCKET && name == SO_RCVTIMEO)
+    {
+        const struct timeval *tv = value;
+        s->rcvtimeo = (uint64_t)tv->tv_sec * 1000000000 + (uint64_t)tv->tv_usec * 1000;
+    }
+    pthread_mutex_unlock(&sim.lock);
+    return s != NULL ? 0 : __real_setsockopt(socket, level, name, value, len);
+}
+
+/**
+ * @brief Returns the simulated address of the socket
+ */
+int __wrap_getsockname(int socket, struct sockaddr *address, socklen_t *len)
+{
+    pthread_mutex_lock(&sim.lock);
+    sim_socket *s = sim_find(socket);
+    if (s != NULL)
+    {
+        memcpy(address, &s->addr, *len < sizeof(s->addr) ? *len : sizeof(s->addr));
+        *len = sizeof(s->addr);
+    }
+    pthread_mutex_unlock(&sim.lock);
+    return s != NULL ? 0 : __real_getsockname(socket, address, len);
+}
+
+/**
+ * @brief Reads the virtual clock in the actors, the other threads read the real clocks
+ */
+int __wrap_clock_gettime(clockid_t clock, struct timespec *ts)
+{
+    if (self == NULL || clock != CLOCK_MONOTONIC)
+    {
+        return __real_clock_gettime(clock, ts);
+    }
+    ts->tv_sec = sim.now / 1000000000;
+    ts->tv_nsec = sim.now % 1000000000;
+    return 0;
+}
+
+/**
+ * @brief Sleeps in the virtual time
+ */
+int __wrap_nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    if (self == NULL)
+    {
+        return __real_nanosleep(req, rem);
+    }
+    pthread_mutex_lock(&sim.lock);
+    uint64_t deadline = sim.now + (uint64_t)req->tv_sec * 1000000000 + req->tv_nsec;
+    self->nwaits = 0;
+    while (sim.now < deadline)
+    {
+        sim_block(deadline);
+    }
+    pthread_mutex_unlock(&sim.lock);
+    return 0;
+}
+
+/**
+ * @brief Ends only the actor that exits, the simulation goes on
+ */
+void __wrap_exit(int status)
+{
+    if (self == NULL)
+    {
+        __real_exit(status);
+    }
+    pthread_mutex_lock(&sim.lock);
+    self->status = status;
+    self->end = sim.now;
+    self->done = true;
+    self->running = false;
+    pthread_cond_signal(&sim.idle);
+    pthread_mutex_unlock(&sim.lock);
+    pthread_exit(NULL);
+}
+
+/**
+ * @brief Thread of the actor, it waits for its turn and runs its side of the transfer
+ * @param arg Actor
+ * @return NULL
+ */
+static void *sim_actor_main(void *arg)
+{
+    self = arg;
+    pthread_mutex_lock(&sim.lock);
+    while (!self->running)
+    {
+        pthread_cond_wait(&self->wake, &sim.lock);
+    }
+    pthread_mutex_unlock(&sim.lock);
+    self->fn(self->arg);
+    pthread_mutex_lock(&sim.lock);
+    self->end = sim.now;
+    self->done = true;
+    self->running = false;
+    pthread_cond_signal(&sim.idle);
+    pthread_mutex_unlock(&sim.lock);
+    return NULL;
+}
+
+/**
+ * @brief Lets the actor run until it blocks or ends, the lock is held
+ * @param actor Actor that can run
+ */
+static void sim_resume(sim_actor *actor)
+{
+    actor->blocked = false;
+    actor->running = true;
+    pthread_cond_signal(&actor->wake);
+    while (actor->running)
+    {
+        pthread_cond_wait(&sim.idle, &sim.lock);
+    }
+}
+
+/**
+ * @brief Runs the actors until all of them end. The actors run one at a time in a fixed order and the virtual clock
+ *        jumps to the next delivery or deadline, so the run depends only on the seed. Actors that would wait forever are aborted.
+ */
+static void sim_run()
+{
+    pthread_mutex_lock(&sim.lock);
+    while (true)
+    {
+        bool ran = true;
+        while (ran)
+        {
+            ran = false;
+            for (int a = 0; a < SIM_ACTORS; a++)
+            {
+                if (!sim.actors[a].done && !sim.actors[a].blocked)
+                {
+                    sim_resume(&sim.actors[a]);
+                    ran = true;
+                }
+            }
+        }
+        bool alive = false;
+        uint64_t next = sim.flight != NULL ? sim.flight->time : SIM_NONE;
+        for (int a = 0; a < SIM_ACTORS; a++)
+        {
+            alive = alive || !sim.actors[a].done;
+            if (!sim.actors[a].done && sim.actors[a].deadline < next)
+            {
+                next = sim.actors[a].deadline;
+            }
+        }
+        if (!alive)
+        {
+            break;
+        }
+        if (next == SIM_NONE)
+        {
+            sim.aborted = true;
+            for (int a = 0; a < SIM_ACTORS; a++)
+            {
+                if (!sim.actors[a].done)
+                {
+                    sim_resume(&sim.actors[a]);
+                }
+            }
+            break;
+        }
+        if (next > sim.now)
+        {
+            sim.now = next;
+        }
+        while (sim.flight != NULL && sim.flight->time <= sim.now)
+        {
+            sim_packet *packet = sim.flight;
+            sim.flight = packet->next;
+            sim_deliver(packet);
+        }
+        for (int a = 0; a < SIM_ACTORS; a++)
+        {
+            if (sim.actors[a].blocked && sim.actors[a].deadline <= sim.now)
+            {
+                sim.actors[a].blocked = false;
+            }
+        }
+    }
+    pthread_mutex_unlock(&sim.lock);
+}
+
+/**
+ * @brief Server side of the simulation, it waits for the request like server() and serves it in the same thread
+ * @param arg Unused
+ */
+static void sim_server(void *arg)
+{
+    (void)arg;
+    int sck = create_socket();
+    server_bind(sck);
+    struct sockaddr_in client;
+    socklen_t len;
+    ssize_t lenght;
+    tftp_message_request *msg = malloc(sizeof(tftp_message) + MAX_REQUEST);
+    do
+    {
+        len = sizeof(client);
+        lenght = receive_message_request(sck, msg, (struct sockaddr *)&client, &len);
+    } while (lenght < 4 || ntohs(msg->opcode) != RRQ);
+    close(sck);
+    handle_client_rqst(msg, (struct sockaddr *)&client, len, lenght, sck);
+}
+
+/* Options of the simulated download */
+static bool sim_options = false;
+static int sim_window = 1;
+
+/**
+ * @brief Client side of the simulation
+ * @param arg Unused
+ */
+static void sim_client(void *arg)
+{
+    (void)arg;
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(SIM_SERVER_IP);
+    server.sin_port = htons(PORT);
+    sim_client_download(&server, "sim.bin", "sim.out", sim_options, sim_window);
+}
+
+/**
+ * @brief Compares the downloaded file with the original
+ * @return True if the files are the same
+ */
+static bool sim_compare()
+{
+    FILE *a = fopen("sim.bin", "rb"), *b = fopen("sim.out", "rb");
+    bool same = a != NULL && b != NULL;
+    uint8_t bufa[4096], bufb[4096];
+    while (same)
+    {
+        size_t na = fread(bufa, 1, sizeof(bufa), a), nb = fread(bufb, 1, sizeof(bufb), b);
+        same = na == nb && memcmp(bufa, bufb, na) == 0;
+        if (na == 0)
+        {
+            break;
+        }
+    }
+    if (a != NULL)
+    {
+        fclose(a);
+    }
+    if (b != NULL)
+    {
+        fclose(b);
+    }
+    return same;
+}
+
+/**
+ * @brief Runs one simulated download
+ * @param link Parameters of the link
+ * @param seed Seed of the losses and the delays
+ * @return Outcome of the download
+ */
+static sim_result sim_scenario(sim_link *link, uint64_t seed)
+{
+    sim_result result;
+    // State of the previous session of the server is reset like in the freshly forked process
+    blocksize = 512;
+    windowsize = 1;
+    tsize = 0;
+    rollover = 0;
+    compress = false;
+    checksum = false;
+    resume = false;
+    resume_offset = 0;
+    delta_base = NULL;
+    signature_chunk = 0;
+    bundle = false;
+    multicast = false;
+    duplicate_acks = stale_acks = duplicate_data = 0;
+    memset(&stats, 0, sizeof(stats));
+    port = PORT;
+    remove("sim.out");
+
+    sim.active = true;
+    sim.aborted = false;
+    sim.now = SIM_EPOCH;
+    sim.seq = 0;
+    sim.rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+    sim.link = *link;
+    sim.flight = NULL;
+    sim.next_port = 49152;
+    sim.data_sent = 0;
+    sim.dropped = 0;
+    for (int i = 0; i < SIM_SOCKETS; i++)
+    {
+        sim.sockets[i].fd = -1;
+    }
+    void (*fns[SIM_ACTORS])(void *) = {sim_server, sim_client};
+    uint32_t hosts[SIM_ACTORS] = {SIM_SERVER_IP, SIM_CLIENT_IP};
+    for (int a = 0; a < SIM_ACTORS; a++)
+    {
+        sim_actor *actor = &sim.actors[a];
+        memset(actor, 0, sizeof(*actor));
+        pthread_cond_init(&actor->wake, NULL);
+        actor->fn = fns[a];
+        actor->host = hosts[a];
+        actor->deadline = SIM_NONE;
+        pthread_create(&actor->thread, NULL, sim_actor_main, actor);
+    }
+    sim_run();
+    for (int a = 0; a < SIM_ACTORS; a++)
+    {
+        pthread_join(sim.actors[a].thread, NULL);
+        pthread_cond_destroy(&sim.actors[a].wake);
+    }
+    // Sockets of the aborted actors and the datagrams still in the network are dropped
+    for (int i = 0; i < SIM_SOCKETS; i++)
+    {
+        if (sim.sockets[i].fd >= 0)
+        {
+            __wrap_close(sim.sockets[i].fd);
+        }
+    }
+    while (sim.flight != NULL)
+    {
+        sim_packet *next = sim.flight->next;
+        free(sim.flight);
+        sim.flight = next;
+    }
+    sim.active = false;
+    sim_actor *client = &sim.actors[1];
+    result.ok = client->status == EXIT_SUCCESS && sim_compare();
+    result.time = client->end - SIM_EPOCH;
+    result.data_sent = sim.data_sent;
+    result.dropped = sim.dropped;
+    return result;
+}
+
+/**
+ * @brief Compares two durations for qsort()
+ */
+static int sim_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Main function of the simulation
+ * @param argc number of arguments
+ * @param argv array of arguments
+ * @return 0 if everything is okay
+ */
+int main(int argc, char *argv[])
+{
+    int seeds = 50;
+    long size = 65536;
+    double duplicate = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:d:ow:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            seeds = atoi(optarg);
+            break;
+        case 's':
+            size = atol(optarg);
+            break;
+        case 'd':
+            duplicate = atof(optarg);
+            break;
+        case 'o':
+            sim_options = true;
+            break;
+        case 'w':
+            sim_window = atoi(optarg);
+            break;
+        default:
+            printf("ERROR: Invalid arguments\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (seeds < 1 || size < 0 || duplicate < 0 || duplicate > 1 || sim_window < 1 || sim_window > 65535)
+    {
+        printf("ERROR: Invalid arguments\n");
+        return EXIT_FAILURE;
+    }
+    char dir[] = "/tmp/tftp-sim-XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) < 0)
+    {
+        printf("ERROR: Can not create the directory of the simulation\n");
+        return EXIT_FAILURE;
+    }
+    directory = dir;
+    // Every datagram and every timeout is logged, the log is not shown and the results are printed to the original output
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stderr) == NULL || freopen("/dev/null", "w", stdout) == NULL)
+    {
+        printf("ERROR: Can not open /dev/null\n");
+        return EXIT_FAILURE;
+    }
+    sessions_init();
+    // Content of the file is the same in every run
+    FILE *fd = fopen("sim.bin", "wb");
+    sim.rng = 42;
+    for (long i = 0; i < size; i++)
+    {
+        fputc((int)(sim_random() * 256), fd);
+    }
+    fclose(fd);
+
+    double losses[] = {0, 0.01, 0.02, 0.05, 0.1, 0.2};
+    double latencies[] = {0.001, 0.02, 0.1};
+    double jitters[] = {0, 1};
+    uint64_t *times = malloc(seeds * sizeof(uint64_t));
+    struct timespec start, end;
+    __real_clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned long scenarios = 0;
+    double virtual = 0;
+    fprintf(out, "%6s %8s %8s %6s %6s %10s %10s %12s %10s\n", "loss", "latency", "jitter", "runs", "ok%", "median_s", "p95_s", "goodput_B/s", "data/blk");
+    for (size_t l = 0; l < sizeof(losses) / sizeof(losses[0]); l++)
+    {
+        for (size_t d = 0; d < sizeof(latencies) / sizeof(latencies[0]); d++)
+        {
+            for (size_t j = 0; j < sizeof(jitters) / sizeof(jitters[0]); j++)
+            {
+                sim_link link = {losses[l], duplicate, (uint64_t)(latencies[d] * 1e9), (uint64_t)(latencies[d] * jitters[j] * 1e9)};
+                int ok = 0;
+                double goodput = 0, sent = 0;
+                for (int s = 0; s < seeds; s++)
+                {
+                    sim_result r = sim_scenario(&link, (uint64_t)s + 1);
+                    scenarios++;
+                    virtual += r.time / 1e9;
+                    sent += r.data_sent;
+                    if (r.ok)
+                    {
+                        times[ok++] = r.time;
+                        goodput += r.time ? size / (r.time / 1e9) : 0;
+                    }
+                }
+                qsort(times, ok, sizeof(uint64_t), sim_cmp);
+                fprintf(out, "%6.2f %8.3f %8.3f %6d %6.1f %10.3f %10.3f %12.0f %10.2f\n", losses[l], latencies[d], latencies[d] * jitters[j], seeds,
+                       100.0 * ok / seeds, ok ? times[ok / 2] / 1e9 : 0, ok ? times[(ok * 95) / 100 < ok ? (ok * 95) / 100 : ok - 1] / 1e9 : 0,
+                       ok ? goodput / ok : 0, sent / seeds / (size / 512 + 1));
+            }
+        }
+    }
+    __real_clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(out, "%lu scenarios, %.0f s of virtual time in %.2f s\n", scenarios, virtual,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    fclose(out);
+    free(times);
+    remove("sim.bin");
+    remove("sim.out");
+    rmdir(dir);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,284 @@
+/**
+ * @file timer.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "timer.h"
+
+/**
+ * @brief Gets the head of the slot list
+ * @param wheel Timer wheel
+ * @param level Level of the wheel
+ * @param slot Index of the slot in the level
+ * @return Head of the list
+ */
+static timer_entry *wheel_slot(timer_wheel *wheel, int level, uint64_t slot)
+{
+    return &wheel->slots[level * WHEEL_SIZE + (slot & (WHEEL_SIZE - 1))];
+}
+
+/**
+ * @brief Links the timer into the slot of the lowest level that reaches its expiry
+ * @param wheel Timer wheel
+ * @param timer Timer that is not linked, its expiry is not before the current tick
+ */
+static void wheel_insert(timer_wheel *wheel, timer_entry *timer)
+{
+    int level = 0;
+    // Level is chosen by the distance of the slots, not of the ticks, so the timer is never put to a slot that was already passed
+    while (level < WHEEL_LEVELS - 1 && (timer->expires >> (level * WHEEL_BITS)) - (wheel->now >> (level * WHEEL_BITS)) >= WHEEL_SIZE)
+    {
+        level++;
+    }
+    if (level == WHEEL_LEVELS - 1 && (timer->expires >> (level * WHEEL_BITS)) - (wheel->now >> (level * WHEEL_BITS)) >= WHEEL_SIZE)
+    {
+        // Timer beyond the range of the wheel is delayed to its end
+        timer->expires = wheel->now + ((uint64_t)(WHEEL_SIZE - 1) << (level * WHEEL_BITS));
+    }
+    timer_entry *head = wheel_slot(wheel, level, timer->expires >> (level * WHEEL_BITS));
+    timer->level = level;
+    timer->prev = head;
+    timer->next = head->next;
+    head->next->prev = timer;
+    head->next = timer;
+    wheel->occupancy[level]++;
+}
+
+/**
+ * @brief Unlinks the timer from its slot
+ * @param wheel Timer wheel
+ * @param timer Linked timer
+ */
+static void wheel_unlink(timer_wheel *wheel, timer_entry *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+    wheel->occupancy[timer->level]--;
+}
+
+/**
+ * @brief Initializes the empty wheel, its ticks are counted from now
+ * @param wheel Wheel that is about to be initialized
+ * @return True if everything is okay
+ */
+bool wheel_init(timer_wheel *wheel)
+{
+    wheel->slots = malloc(WHEEL_LEVELS * WHEEL_SIZE * sizeof(timer_entry));
+    if (wheel->slots == NULL)
+    {
+        return false;
+    }
+    for (int i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++)
+    {
+        wheel->slots[i].next = wheel->slots[i].prev = &wheel->slots[i];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wheel->start);
+    wheel->now = 0;
+    wheel->armed = 0;
+    for (int i = 0; i < WHEEL_LEVELS; i++)
+    {
+        wheel->occupancy[i] = 0;
+    }
+    wheel->expired = 0;
+    wheel->late_total = 0;
+    wheel->late_max = 0;
+    return true;
+}
+
+/**
+ * @brief Frees the wheel, the timers that are still armed are forgotten
+ * @param wheel Timer wheel
+ */
+void wheel_free(timer_wheel *wheel)
+{
+    free(wheel->slots);
+    wheel->slots = NULL;
+}
+
+/**
+ * @brief Reads the monotonic clock
+ * @param wheel Timer wheel
+ * @return Milliseconds since the initialization of the wheel
+ */
+uint64_t wheel_clock(timer_wheel *wheel)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t ns = (int64_t)(ts.tv_sec - wheel->start.tv_sec) * 1000000000 + (ts.tv_nsec - wheel->start.tv_nsec);
+    return ns / 1000000;
+}
+
+/**
+ * @brief Initializes the timer that is not armed
+ * @param timer Timer that is about to be initialized
+ * @param fn Function called when the timer expires
+ * @param arg Argument for the function, stored in the timer
+ */
+void timer_init(timer_entry *timer, timer_fn fn, void *arg)
+{
+    timer->next = timer->prev = NULL;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+/**
+ * @brief Timer function for the loops that handle the expiry themselves, sets the bool passed as the argument
+ * @param timer Expired timer
+ */
+void timer_flag(timer_entry *timer)
+{
+    *(bool *)timer->arg = true;
+}
+
+/**
+ * @brief Arms the timer, the timer that is already armed is moved to the new expiry
+ * @param wheel Timer wheel
+ * @param timer Timer
+ * @param ms Number of milliseconds until the expiry
+ */
+void timer_arm(timer_wheel *wheel, timer_entry *timer, uint64_t ms)
+{
+    timer_cancel(wheel, timer);
+    timer->expires = wheel_clock(wheel) + ms;
+    // Slot of the current tick was already processed
+    if (timer->expires <= wheel->now)
+    {
+        timer->expires = wheel->now + 1;
+    }
+    wheel_insert(wheel, timer);
+    wheel->armed++;
+}
+
+/**
+ * @brief Disarms the timer, nothing happens if it is not armed
+ * @param wheel Timer wheel
+ * @param timer Timer
+ */
+void timer_cancel(timer_wheel *wheel, timer_entry *timer)
+{
+    if (timer->next != NULL)
+    {
+        wheel_unlink(wheel, timer);
+        wheel->armed--;
+    }
+}
+
+/**
+ * @brief Checks whether the timer is armed
+ * @param timer Timer
+ * @return True if the timer waits for its expiry
+ */
+bool timer_armed(timer_entry *timer)
+{
+    return timer->next != NULL;
+}
+
+/**
+ * @brief Computes the timeout for poll(), it ends at the next expiry or at the next cascade of the higher levels
+ * @param wheel Timer wheel
+ * @return Number of milliseconds, -1 if no timer is armed
+ */
+int wheel_timeout(timer_wheel *wheel)
+{
+    if (wheel->armed == 0)
+    {
+        return -1;
+    }
+    uint64_t tick = wheel->now + 1;
+    uint64_t rotation = (wheel->now | (WHEEL_SIZE - 1)) + 1;
+    while (tick < rotation)
+    {
+        timer_entry *head = wheel_slot(wheel, 0, tick);
+        if (head->next != head)
+        {
+            break;
+        }
+        tick++;
+    }
+    uint64_t now = wheel_clock(wheel);
+    return tick <= now ? 0 : (int)(tick - now);
+}
+
+/**
+ * @brief Moves the timers of the slot of the higher level to the lower levels
+ * @param wheel Timer wheel
+ * @param level Level of the slot, the slot is the one reached by the current tick
+ */
+static void wheel_cascade(timer_wheel *wheel, int level)
+{
+    uint64_t slot = wheel->now >> (level * WHEEL_BITS);
+    // Slot of the next level is reached at the same time as the first slot of this level
+    if ((slot & (WHEEL_SIZE - 1)) == 0 && level < WHEEL_LEVELS - 1)
+    {
+        wheel_cascade(wheel, level + 1);
+    }
+    timer_entry *head = wheel_slot(wheel, level, slot);
+    while (head->next != head)
+    {
+        timer_entry *timer = head->next;
+        wheel_unlink(wheel, timer);
+        wheel_insert(wheel, timer);
+    }
+}
+
+/**
+ * @brief Advances the wheel to the current time and calls the functions of the expired timers,
+ *        the functions can arm the timers again
+ * @param wheel Timer wheel
+ * @return Number of the expired timers
+ */
+size_t wheel_expire(timer_wheel *wheel)
+{
+    uint64_t now = wheel_clock(wheel);
+    size_t expired = 0;
+    if (wheel->armed == 0)
+    {
+        wheel->now = now;
+        return 0;
+    }
+    while (wheel->now < now)
+    {
+        wheel->now++;
+        if ((wheel->now & (WHEEL_SIZE - 1)) == 0)
+        {
+            wheel_cascade(wheel, 1);
+        }
+        timer_entry *head = wheel_slot(wheel, 0, wheel->now);
+        while (head->next != head)
+        {
+            timer_entry *timer = head->next;
+            wheel_unlink(wheel, timer);
+            wheel->armed--;
+            uint64_t late = now - timer->expires;
+            wheel->late_total += late;
+            if (late > wheel->late_max)
+            {
+                wheel->late_max = late;
+            }
+            wheel->expired++;
+            expired++;
+            timer->fn(timer);
+        }
+        if (wheel->armed == 0)
+        {
+            wheel->now = now;
+        }
+    }
+    return expired;
+}
+
+/**
+ * @brief Prints the counters of the wheel
+ * @param wheel Timer wheel
+ * @param name Name of the loop that uses the wheel
+ */
+void wheel_report(timer_wheel *wheel, char *name)
+{
+    fprintf(stderr, "TIMERS %s armed=%zu levels=%zu/%zu/%zu/%zu expired=%llu late_avg=%.2fms late_max=%llums\n", name, wheel->armed,
+            wheel->occupancy[0], wheel->occupancy[1], wheel->occupancy[2], wheel->occupancy[3], (unsigned long long)wheel->expired,
+            wheel->expired ? (double)wheel->late_total / wheel->expired : 0.0, (unsigned long long)wheel->late_max);
+}
@@ -0,0 +1,68 @@
+/**
+ * @file timer.h
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#ifndef TIMER_H
+#define TIMER_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Every level of the wheel has 256 slots, one tick is one millisecond, four levels cover 49 days */
+#define WHEEL_BITS 8
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct timer_entry timer_entry;
+
+typedef void (*timer_fn)(timer_entry *timer);
+
+/* Timer that is armed while it is linked into a slot of the wheel */
+struct timer_entry
+{
+    timer_entry *next;
+    timer_entry *prev;
+    uint64_t expires; /* Tick at which the timer expires */
+    int level;
+    timer_fn fn;
+    void *arg;
+};
+
+typedef struct
+{
+    struct timespec start;
+    uint64_t now;        /* Last processed tick */
+    timer_entry *slots;  /* Heads of the slot lists, WHEEL_LEVELS * WHEEL_SIZE of them */
+    size_t armed;
+    size_t occupancy[WHEEL_LEVELS];
+    uint64_t expired;
+    uint64_t late_total; /* Milliseconds between the expiry and the callback, summed over all expired timers */
+    uint64_t late_max;
+} timer_wheel;
+
+bool wheel_init(timer_wheel *wheel);
+
+void wheel_free(timer_wheel *wheel);
+
+uint64_t wheel_clock(timer_wheel *wheel);
+
+void timer_init(timer_entry *timer, timer_fn fn, void *arg);
+
+void timer_flag(timer_entry *timer);
+
+void timer_arm(timer_wheel *wheel, timer_entry *timer, uint64_t ms);
+
+void timer_cancel(timer_wheel *wheel, timer_entry *timer);
+
+bool timer_armed(timer_entry *timer);
+
+int wheel_timeout(timer_wheel *wheel);
+
+size_t wheel_expire(timer_wheel *wheel);
+
+void wheel_report(timer_wheel *wheel, char *name);
+
+#endif
@@ -0,0 +1,301 @@
+/**
+ * @file trace.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "trace.h"
+#include "messages.h"
+
+bool tracing = false;
+// Trace file shared by all session processes, -1 if tracing is off
+static int trace_fd = -1;
+// Only the sessions of this client are traced if the filter is set
+static bool ip_filter = false;
+static struct in_addr trace_ip;
+// Only the sessions of the files starting with this prefix are traced, NULL if every file is traced
+static char *trace_name = NULL;
+// True if the new sessions are not traced, set from the control socket
+static bool paused = false;
+// Time the main server process received the request of the session
+static uint64_t received = 0;
+static char buffer[TRACE_BUFFER];
+static size_t used = 0;
+static int trace_pid;
+
+/**
+ * @brief Reads the monotonic clock, it is the same for all processes of the server
+ * @return Nanoseconds
+ */
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Creates the trace file, the sessions append their events to it.
+ *        The file is a JSON array of the Chrome trace format without the closing bracket, which the format allows.
+ * @param path Path of the trace file
+ * @return True if the file was created
+ */
+bool trace_open(char *path)
+{
+    // Running sessions keep writing to the previous file they inherited
+    if (trace_fd >= 0)
+    {
+        close(trace_fd);
+    }
+    // File is opened before the server changes its directory and is inherited by the session processes
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (trace_fd < 0)
+    {
+        return false;
+    }
+    char header[128];
+    int n = snprintf(header, sizeof(header), "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"tftp-server\"}}", getpid());
+    if (write(trace_fd, header, n) != n)
+    {
+        close(trace_fd);
+        trace_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Turns tracing of the new sessions on or off while the server runs, the running sessions are not changed
+ * @param on True if the new sessions are traced
+ * @return False if tracing is turned on without the trace file
+ */
+bool trace_enable(bool on)
+{
+    if (on && trace_fd < 0)
+    {
+        return false;
+    }
+    paused = !on;
+    return true;
+}
+
+/**
+ * @brief Traces only the sessions of the client
+ * @param addr IPv4 address of the client
+ * @return True if the address is valid
+ */
+bool trace_filter_ip(char *addr)
+{
+    ip_filter = inet_pton(AF_INET, addr, &trace_ip) == 1;
+    return ip_filter;
+}
+
+/**
+ * @brief Traces only the sessions of the files starting with the prefix
+ * @param prefix Start of the filename as the client requested it
+ */
+void trace_filter_name(char *prefix)
+{
+    trace_name = prefix;
+}
+
+/**
+ * @brief Reads the clock for the start of the span
+ * @return Nanoseconds, 0 if the session is not traced
+ */
+uint64_t trace_clock()
+{
+    return tracing ? monotonic_ns() : 0;
+}
+
+/**
+ * @brief Remembers the time the request was received, used by the main server process before the session is started
+ */
+void trace_received()
+{
+    if (trace_fd >= 0)
+    {
+        received = monotonic_ns();
+    }
+}
+
+/**
+ * @brief Copies the string into the JSON string, quotes, backslashes and control characters are escaped
+ * @param dst Escaped string
+ * @param size Size of the escaped string
+ * @param str Copied string
+ */
+static void json_escape(char *dst, size_t size, char *str)
+{
+    size_t n = 0;
+    for (unsigned char *c = (unsigned char *)str; *c && n + 7 < size; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            dst[n++] = '\\';
+            dst[n++] = *c;
+        }
+        else if (*c < 0x20)
+        {
+            n += snprintf(dst + n, size - n, "\\u%04x", *c);
+        }
+        else
+        {
+            dst[n++] = *c;
+        }
+    }
+    dst[n] = '\0';
+}
+
+/**
+ * @brief Appends the event to the buffer
+ * @param name Name of the event
+ * @param phase Type of the event, 'i' for the instant and 'X' for the span
+ * @param ts Start of the event in nanoseconds
+ * @param dur Duration of the span in nanoseconds
+ * @param block Block number attached to the event, -1 if there is none
+ * @param bytes Number of bytes attached to the event, -1 if there is none
+ */
+static void trace_event(char *name, char phase, uint64_t ts, uint64_t dur, long block, long bytes)
+{
+    // Longest event is well below this size
+    if (used > TRACE_BUFFER - 256)
+    {
+        trace_flush();
+    }
+    char *out = buffer + used;
+    size_t size = TRACE_BUFFER - used;
+    // Timestamps of the format are microseconds, the fraction keeps the nanoseconds
+    int n = snprintf(out, size, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d", name, phase,
+                     (unsigned long long)(ts / 1000), (unsigned long long)(ts % 1000), trace_pid, trace_pid);
+    if (phase == 'X')
+    {
+        n += snprintf(out + n, size - n, ",\"dur\":%llu.%03llu", (unsigned long long)(dur / 1000), (unsigned long long)(dur % 1000));
+    }
+    else
+    {
+        n += snprintf(out + n, size - n, ",\"s\":\"t\"");
+    }
+    if (block >= 0 && bytes >= 0)
+    {
+        n += snprintf(out + n, size - n, ",\"args\":{\"block\":%ld,\"bytes\":%ld}}", block, bytes);
+    }
+    else if (block >= 0)
+    {
+        n += snprintf(out + n, size - n, ",\"args\":{\"block\":%ld}}", block);
+    }
+    else if (bytes >= 0)
+    {
+        n += snprintf(out + n, size - n, ",\"args\":{\"bytes\":%ld}}", bytes);
+    }
+    else
+    {
+        n += snprintf(out + n, size - n, "}");
+    }
+    used += n;
+}
+
+/**
+ * @brief Records the span of the whole session and writes the rest of the buffer, called when the session process exits
+ */
+static void trace_end()
+{
+    if (tracing)
+    {
+        trace_span("session", received, -1, -1);
+        trace_flush();
+        tracing = false;
+    }
+}
+
+/**
+ * @brief Starts tracing of the session if it passes the filters, used by the session process
+ * @param peer Address of the client
+ * @param filename Requested file
+ * @param opcode Opcode of the request
+ */
+void trace_start(struct sockaddr_in *peer, char *filename, uint16_t opcode)
+{
+    if (trace_fd < 0 || paused || (ip_filter && peer->sin_addr.s_addr != trace_ip.s_addr) ||
+        (trace_name != NULL && strncmp(filename, trace_name, strlen(trace_name)) != 0))
+    {
+        return;
+    }
+    tracing = true;
+    trace_pid = getpid();
+    used = 0;
+    char ip_str[INET_ADDRSTRLEN];
+    char name[1024];
+    inet_ntop(AF_INET, &peer->sin_addr, ip_str, sizeof(ip_str));
+    json_escape(name, sizeof(name), filename);
+    // Every session is shown as its own process named by the request
+    used = snprintf(buffer, TRACE_BUFFER, ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s %s %s:%d\"}}",
+                    trace_pid, opcode == WRQ ? "WRQ" : "RRQ", name, ip_str, ntohs(peer->sin_port));
+    trace_event("request", 'i', received, 0, -1, -1);
+    atexit(trace_end);
+}
+
+/**
+ * @brief Records the event without a duration
+ * @param name Name of the event
+ * @param block Block number attached to the event, -1 if there is none
+ * @param bytes Number of bytes attached to the event, -1 if there is none
+ */
+void trace_instant(char *name, long block, long bytes)
+{
+    if (tracing)
+    {
+        trace_event(name, 'i', monotonic_ns(), 0, block, bytes);
+    }
+}
+
+/**
+ * @brief Records the event that lasted from the start until now
+ * @param name Name of the event
+ * @param start Start of the event returned by trace_clock()
+ * @param block Block number attached to the event, -1 if there is none
+ * @param bytes Number of bytes attached to the event, -1 if there is none
+ */
+void trace_span(char *name, uint64_t start, long block, long bytes)
+{
+    if (tracing)
+    {
+        trace_event(name, 'X', start, monotonic_ns() - start, block, bytes);
+    }
+}
+
+/**
+ * @brief Appends the buffered events to the trace file, the lock keeps the events of the concurrent sessions apart
+ */
+void trace_flush()
+{
+    if (!tracing || used == 0)
+    {
+        return;
+    }
+    // Record lock belongs to the process, flock() would be shared by all processes that inherited the file
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    fcntl(trace_fd, F_SETLKW, &lock);
+    for (size_t done = 0; done < used;)
+    {
+        ssize_t n = write(trace_fd, buffer + done, used - done);
+        if (n <= 0)
+        {
+            break;
+        }
+        done += n;
+    }
+    lock.l_type = F_UNLCK;
+    fcntl(trace_fd, F_SETLK, &lock);
+    used = 0;
+}
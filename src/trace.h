@@ -0,0 +1,39 @@
+/**
+ * @file trace.h
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* Events of the session are collected in the buffer, it is appended to the trace file when it fills up and when the session ends */
+#define TRACE_BUFFER 65536
+
+/* True in the session that is traced, every trace function returns right away otherwise */
+extern bool tracing;
+
+bool trace_open(char *path);
+
+bool trace_enable(bool on);
+
+bool trace_filter_ip(char *addr);
+
+void trace_filter_name(char *prefix);
+
+uint64_t trace_clock();
+
+void trace_received();
+
+void trace_start(struct sockaddr_in *peer, char *filename, uint16_t opcode);
+
+void trace_instant(char *name, long block, long bytes);
+
+void trace_span(char *name, uint64_t start, long block, long bytes);
+
+void trace_flush();
+
+#endif
@@ -0,0 +1,183 @@
+/**
+ * @file tstamp.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include "tstamp.h"
+
+/* Timestamps reported for every received datagram, they are taken by the kernel when the datagram arrives */
+#define TSTAMP_RX (SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY)
+
+bool timestamping = false;
+// Kernel time the armed datagram left and the time the server handed it to the kernel
+static struct timespec tx_stamp, armed;
+static bool tx_valid = false;
+// Kernel time the last datagram arrived and the time the server got it from the socket
+static struct timespec rx_stamp, handled;
+static bool rx_valid = false;
+
+/**
+ * @brief Subtracts the times
+ * @param a Later time
+ * @param b Earlier time
+ * @return Seconds between the times
+ */
+static double tstamp_diff(struct timespec *a, struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Finds the software timestamp in the control messages of the received datagram
+ * @param msg Received datagram
+ * @param ts Timestamp, the software timestamps use the realtime clock
+ * @return True if the datagram carried the timestamp
+ */
+static bool tstamp_find(struct msghdr *msg, struct timespec *ts)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+        {
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+            if (stamps.ts[0].tv_sec != 0 || stamps.ts[0].tv_nsec != 0)
+            {
+                *ts = stamps.ts[0];
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Turns on the receive timestamps of the socket, the send timestamps are asked for only by the armed datagrams
+ * @param socket Socket of the session
+ * @return True if the kernel supports the software timestamps
+ */
+bool tstamp_enable(int socket)
+{
+    int flags = TSTAMP_RX;
+    tx_valid = false;
+    rx_valid = false;
+    return setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+}
+
+/**
+ * @brief Asks for the send timestamp of the next datagram. Only the datagram that measures the round trip is stamped,
+ *        every stamp waits in the error queue of the socket, which shares the receive buffer with the ACKs.
+ * @param socket Socket of the session
+ */
+void tstamp_arm(int socket)
+{
+    int flags = TSTAMP_RX | SOF_TIMESTAMPING_TX_SOFTWARE;
+    // Stamp of the previous datagram that was never paired with its ACK is dropped
+    tstamp_drain(socket);
+    tx_valid = false;
+    setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    clock_gettime(CLOCK_REALTIME, &armed);
+}
+
+/**
+ * @brief Stops stamping the sent datagrams, called right after the armed datagram is sent
+ * @param socket Socket of the session
+ */
+void tstamp_disarm(int socket)
+{
+    int flags = TSTAMP_RX;
+    setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+/**
+ * @brief Reads the send timestamps waiting in the error queue, the newest one belongs to the armed datagram
+ * @param socket Socket of the session
+ * @return True if any timestamp was read
+ */
+bool tstamp_drain(int socket)
+{
+    bool found = false;
+    while (true)
+    {
+        char control[256];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            return found;
+        }
+        struct timespec ts;
+        if (tstamp_find(&msg, &ts))
+        {
+            tx_stamp = ts;
+            tx_valid = true;
+            found = true;
+        }
+    }
+}
+
+/**
+ * @brief Receives the message like receive_message() does and remembers when the kernel got it
+ * @param socket Source ID
+ * @param message Received message
+ * @param address Address of the sender
+ * @param slen Address lenght
+ * @param size Room for the message after its header
+ * @return Number of bytes received
+ */
+ssize_t tstamp_receive(int socket, tftp_message *message, struct sockaddr *address, socklen_t *slen, ssize_t size)
+{
+    char control[256];
+    struct iovec iov = {message, sizeof(tftp_message) + size};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = address;
+    msg.msg_namelen = *slen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t bsize = recvmsg(socket, &msg, 0);
+    if (bsize < 0)
+    {
+        printf("ERROR recvmsg()\n");
+        return bsize;
+    }
+    clock_gettime(CLOCK_REALTIME, &handled);
+    *slen = msg.msg_namelen;
+    rx_valid = tstamp_find(&msg, &rx_stamp);
+    message_info(message, address, socket);
+    return bsize;
+}
+
+/**
+ * @brief Splits the round trip of the armed datagram and the last received datagram.
+ *        The wire time runs from the kernel sending the datagram to the kernel receiving the reply,
+ *        the host time is what the server spent passing both of them to and from the kernel.
+ * @param socket Socket of the session
+ * @param wire Seconds on the network and in the peer
+ * @param host Seconds inside the server
+ * @return True if both timestamps were reported, the times are left untouched otherwise
+ */
+bool tstamp_rtt(int socket, double *wire, double *host)
+{
+    tstamp_drain(socket);
+    if (!tx_valid || !rx_valid)
+    {
+        return false;
+    }
+    tx_valid = false;
+    *wire = tstamp_diff(&rx_stamp, &tx_stamp);
+    *host = tstamp_diff(&tx_stamp, &armed) + tstamp_diff(&handled, &rx_stamp);
+    return *wire >= 0;
+}
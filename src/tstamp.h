@@ -0,0 +1,30 @@
+/**
+ * @file tstamp.h
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#ifndef TSTAMP_H
+#define TSTAMP_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "messages.h"
+
+/* True in the session whose socket reports the kernel timestamps of its datagrams */
+extern bool timestamping;
+
+bool tstamp_enable(int socket);
+
+void tstamp_arm(int socket);
+
+void tstamp_disarm(int socket);
+
+bool tstamp_drain(int socket);
+
+ssize_t tstamp_receive(int socket, tftp_message *message, struct sockaddr *address, socklen_t *slen, ssize_t size);
+
+bool tstamp_rtt(int socket, double *wire, double *host);
+
+#endif
@@ -0,0 +1,868 @@
+/**
+ * @file xdp.c
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ *
+ * AF_XDP packet engine. The XDP program redirects the UDP datagrams of the server port and of the ports of the sessions
+ * to one AF_XDP socket, the pump process moves them from its RX ring to the inboxes of the sessions. The sessions send
+ * their datagrams as whole frames through the TX ring shared under the lock. Everything is set up in the main process
+ * before the sessions are forked, every other datagram goes through the kernel as before.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <linux/futex.h>
+#include <linux/bpf.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include "xdp.h"
+#include "messages.h"
+#include "sessions.h"
+
+/* Headers of the frame, the datagrams with the IP options or fragmented are left to the kernel */
+#define XDP_HEADERS (ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr))
+// Offset of the jump to the end of the program that passes the frame to the kernel, it is resolved once the program is built
+#define XDP_TO_PASS 0x7fff
+
+/* Ring shared with the kernel, its indexes run freely and are masked on every access */
+typedef struct
+{
+    uint32_t *producer;
+    uint32_t *consumer;
+    void *ring;
+    uint32_t mask;
+} xdp_ring;
+
+/* Received datagram with the addresses the session answers from */
+typedef struct
+{
+    uint16_t len;
+    struct sockaddr_in from;
+    struct in_addr to;
+    uint8_t peer_mac[ETH_ALEN]; /* Client or the router in front of it */
+    uint8_t local_mac[ETH_ALEN];
+    uint8_t data[XDP_PAYLOAD];
+} xdp_packet;
+
+/* Datagrams of one session, only the pump moves the head and only the session moves the tail */
+typedef struct
+{
+    uint32_t head; /* The session sleeps on it */
+    uint32_t tail;
+    uint32_t waiting;
+    xdp_packet packets[XDP_INBOX];
+} xdp_inbox;
+
+/* State shared by the main process, the pump and the sessions */
+typedef struct
+{
+    bool lock;
+    uint32_t free_count; /* Frames that can be sent from */
+    uint64_t free[XDP_FRAMES / 2];
+    uint16_t ports[65536];               /* Inbox of the port plus one, 0 if the port is not served by the engine */
+    uint16_t slot_ports[SESSION_SLOTS];  /* Port the session of the slot registered */
+    xdp_inbox inboxes[SESSION_SLOTS + 1]; /* The last one receives the requests */
+} xdp_shared;
+
+int xdp_event = -1;
+bool xdp_request = false;
+int xdp_block = 0;
+unsigned long xdp_sent = 0;
+unsigned long xdp_received = 0;
+unsigned long xdp_kernel = 0;
+
+static xdp_shared *shared = NULL;
+static uint8_t *umem = NULL;
+static int xsk = -1;
+static int ports_map = -1;
+static xdp_ring fill, comp, rx, tx;
+static int server_socket = -1;
+// Socket of the session on the engine, its receive timeout and the request whose addresses its frames use
+static int session_socket = -1;
+static uint16_t session_port;
+static int session_timeout = -1;
+static xdp_packet origin;
+
+/**
+ * @brief Calls bpf(), the engine does not need libbpf
+ * @param cmd Command
+ * @param attr Attributes of the command
+ * @return Result of the command, -1 on error
+ */
+static int bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * @brief Creates the BPF map
+ * @param type Type of the map
+ * @param entries Number of the entries
+ * @return Descriptor of the map, -1 on error
+ */
+static int xdp_map_create(int type, int entries)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = entries;
+    return bpf(BPF_MAP_CREATE, &attr);
+}
+
+/**
+ * @brief Writes the entry of the BPF map
+ * @param map Descriptor of the map
+ * @param key Key of the entry
+ * @param value Value of the entry
+ * @return True if the entry was written
+ */
+static bool xdp_map_set(int map, uint32_t key, uint32_t value)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)&value;
+    attr.flags = BPF_ANY;
+    return bpf(BPF_MAP_UPDATE_ELEM, &attr) == 0;
+}
+
+/**
+ * @brief Turns the redirection of the port on or off. The program reads the port straight from the frame,
+ *        so the key is the port in the network order.
+ * @param port Port in the host order
+ * @param on True if the datagrams of the port go to the engine
+ * @return True if the port map was written
+ */
+static bool xdp_port(uint16_t port, bool on)
+{
+    return xdp_map_set(ports_map, htons(port), on);
+}
+
+/**
+ * @brief Builds one instruction of the program
+ * @return Instruction
+ */
+static struct bpf_insn xdp_insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+    struct bpf_insn insn = {code, dst, src, off, imm};
+    return insn;
+}
+
+/**
+ * @brief Loads the program that redirects the IPv4 UDP datagrams of the ports in the port map to the AF_XDP socket
+ * @param xsks Map with the AF_XDP socket of the RX queue
+ * @return Descriptor of the program, -1 on error
+ */
+static int xdp_program(int xsks)
+{
+    struct bpf_insn prog[] = {
+        xdp_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        xdp_insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data), 0),
+        xdp_insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end), 0),
+        xdp_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+        xdp_insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, XDP_HEADERS),
+        xdp_insn(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, XDP_TO_PASS, 0),
+        // IPv4 without the options
+        xdp_insn(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, offsetof(struct ethhdr, h_proto), 0),
+        xdp_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, XDP_TO_PASS, htons(ETH_P_IP)),
+        xdp_insn(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN, 0),
+        xdp_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, XDP_TO_PASS, 0x45),
+        xdp_insn(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN + offsetof(struct iphdr, protocol), 0),
+        xdp_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, XDP_TO_PASS, IPPROTO_UDP),
+        // Fragments are reassembled by the kernel
+        xdp_insn(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + offsetof(struct iphdr, frag_off), 0),
+        xdp_insn(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(0x3fff)),
+        xdp_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, XDP_TO_PASS, 0),
+        // Destination port is looked up in the port map
+        xdp_insn(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + sizeof(struct iphdr) + offsetof(struct udphdr, dest), 0),
+        xdp_insn(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_5, -4, 0),
+        xdp_insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, ports_map),
+        xdp_insn(0, 0, 0, 0, 0),
+        xdp_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        xdp_insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+        xdp_insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        xdp_insn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, XDP_TO_PASS, 0),
+        xdp_insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_0, 0, 0),
+        xdp_insn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, XDP_TO_PASS, 0),
+        // Socket of the queue, the frame goes to the kernel if the queue has none
+        xdp_insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index), 0),
+        xdp_insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, xsks),
+        xdp_insn(0, 0, 0, 0, 0),
+        xdp_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+        xdp_insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        xdp_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        xdp_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+        xdp_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)};
+    int count = sizeof(prog) / sizeof(prog[0]);
+    for (int i = 0; i < count; i++)
+    {
+        if (prog[i].off == XDP_TO_PASS)
+        {
+            prog[i].off = count - 2 - i - 1;
+        }
+    }
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (uintptr_t)prog;
+    attr.insn_cnt = count;
+    attr.license = (uintptr_t) "GPL";
+    return bpf(BPF_PROG_LOAD, &attr);
+}
+
+/**
+ * @brief Attaches the program to the interface, in the driver mode if the driver supports it, in the generic mode otherwise.
+ *        The program is detached by the kernel once the last process of the server exits.
+ * @param prog Descriptor of the program
+ * @param ifindex Index of the interface
+ * @param mode Set to the name of the mode
+ * @return Descriptor of the link, -1 on error
+ */
+static int xdp_attach(int prog, unsigned ifindex, char **mode)
+{
+    uint32_t flags[] = {XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE};
+    for (int i = 0; i < 2; i++)
+    {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = prog;
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = flags[i];
+        int link = bpf(BPF_LINK_CREATE, &attr);
+        if (link >= 0)
+        {
+            *mode = i == 0 ? "driver" : "generic";
+            return link;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Maps the ring of the AF_XDP socket
+ * @param r Ring
+ * @param off Offsets of the ring
+ * @param entry Size of one entry
+ * @param pgoff Offset that selects the ring
+ * @return True if the ring was mapped
+ */
+static bool xdp_ring_map(xdp_ring *r, struct xdp_ring_offset *off, size_t entry, off_t pgoff)
+{
+    uint8_t *map = mmap(NULL, off->desc + XDP_RING * entry, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xsk, pgoff);
+    if (map == MAP_FAILED)
+    {
+        return false;
+    }
+    r->producer = (uint32_t *)(map + off->producer);
+    r->consumer = (uint32_t *)(map + off->consumer);
+    r->ring = map + off->desc;
+    r->mask = XDP_RING - 1;
+    return true;
+}
+
+/**
+ * @brief Creates the AF_XDP socket on the first RX queue of the interface with the UMEM and its four rings
+ * @param ifindex Index of the interface
+ * @return True if the socket is bound
+ */
+static bool xdp_socket(unsigned ifindex)
+{
+    int size = XDP_RING;
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    socklen_t len = sizeof(off);
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uintptr_t)umem;
+    reg.len = (uint64_t)XDP_FRAMES * XDP_FRAME;
+    reg.chunk_size = XDP_FRAME;
+    xsk = socket(AF_XDP, SOCK_RAW, 0);
+    if (xsk < 0 || setsockopt(xsk, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(xsk, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(xsk, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(xsk, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 || setsockopt(xsk, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0 ||
+        getsockopt(xsk, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0)
+    {
+        return false;
+    }
+    if (!xdp_ring_map(&fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) ||
+        !xdp_ring_map(&comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) ||
+        !xdp_ring_map(&rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) || !xdp_ring_map(&tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING))
+    {
+        return false;
+    }
+    // Frames are copied, the zero copy mode would bind the UMEM to the memory of the driver
+    struct sockaddr_xdp addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = ifindex;
+    addr.sxdp_queue_id = 0;
+    addr.sxdp_flags = XDP_COPY;
+    if (bind(xsk, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < XDP_FRAMES / 2; i++)
+    {
+        ((uint64_t *)fill.ring)[i] = (uint64_t)i * XDP_FRAME;
+        shared->free[i] = (uint64_t)(XDP_FRAMES / 2 + i) * XDP_FRAME;
+    }
+    shared->free_count = XDP_FRAMES / 2;
+    __atomic_store_n(fill.producer, XDP_FRAMES / 2, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * @brief Counts the RX queues of the interface, the engine serves only the first one
+ * @param ifname Name of the interface
+ * @return Number of the queues, 1 if the interface does not report them
+ */
+static int xdp_queues(char *ifname)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", ifname);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        return 1;
+    }
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        count += !strncmp(entry->d_name, "rx-", 3);
+    }
+    closedir(dir);
+    return count;
+}
+
+/**
+ * @brief Stores the received frame into the inbox of its port. The requests wake the main process through its event,
+ *        the session is woken only if it sleeps.
+ * @param frame Received frame
+ * @param len Length of the frame
+ */
+static void xdp_dispatch(uint8_t *frame, uint32_t len)
+{
+    struct ethhdr *eth = (struct ethhdr *)frame;
+    struct iphdr *ip = (struct iphdr *)(frame + ETH_HLEN);
+    struct udphdr *udp = (struct udphdr *)(frame + ETH_HLEN + sizeof(*ip));
+    if (len < XDP_HEADERS)
+    {
+        return;
+    }
+    uint16_t ulen = ntohs(udp->len);
+    uint16_t index = __atomic_load_n(&shared->ports[ntohs(udp->dest)], __ATOMIC_ACQUIRE);
+    if (index == 0 || ulen < sizeof(*udp) || ulen > len - ETH_HLEN - sizeof(*ip) || ulen - sizeof(*udp) > XDP_PAYLOAD)
+    {
+        return;
+    }
+    xdp_inbox *box = &shared->inboxes[index - 1];
+    uint32_t head = box->head;
+    if (head - __atomic_load_n(&box->tail, __ATOMIC_ACQUIRE) >= XDP_INBOX)
+    {
+        return;
+    }
+    xdp_packet *p = &box->packets[head % XDP_INBOX];
+    p->len = ulen - sizeof(*udp);
+    p->from.sin_family = AF_INET;
+    p->from.sin_port = udp->source;
+    p->from.sin_addr.s_addr = ip->saddr;
+    p->to.s_addr = ip->daddr;
+    memcpy(p->peer_mac, eth->h_source, ETH_ALEN);
+    memcpy(p->local_mac, eth->h_dest, ETH_ALEN);
+    memcpy(p->data, udp + 1, p->len);
+    __atomic_store_n(&box->head, head + 1, __ATOMIC_SEQ_CST);
+    if (index - 1 == SESSION_SLOTS)
+    {
+        uint64_t one = 1;
+        (void)!write(xdp_event, &one, sizeof(one));
+    }
+    else if (__atomic_load_n(&box->waiting, __ATOMIC_SEQ_CST))
+    {
+        syscall(SYS_futex, &box->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+/**
+ * @brief Moves the received frames to the inboxes and gives them back to the kernel, it runs until the main process exits
+ * @param parent Main server process
+ */
+static void xdp_pump(pid_t parent)
+{
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    signal(SIGTERM, SIG_DFL);
+    while (getppid() == parent)
+    {
+        struct pollfd fds = {xsk, POLLIN, 0};
+        poll(&fds, 1, 1000);
+        uint32_t prod = __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE);
+        uint32_t cons = *rx.consumer;
+        uint32_t fprod = *fill.producer;
+        for (; cons != prod; cons++)
+        {
+            struct xdp_desc *d = &((struct xdp_desc *)rx.ring)[cons & rx.mask];
+            xdp_dispatch(umem + d->addr, d->len);
+            ((uint64_t *)fill.ring)[fprod++ & fill.mask] = d->addr & ~(uint64_t)(XDP_FRAME - 1);
+        }
+        __atomic_store_n(rx.consumer, cons, __ATOMIC_RELEASE);
+        __atomic_store_n(fill.producer, fprod, __ATOMIC_RELEASE);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * @brief Waits until the inbox has a datagram, the cancelled session stops waiting
+ * @param box Inbox of the session
+ * @param timeout Milliseconds, -1 waits forever
+ * @return True if a datagram arrived in time
+ */
+static bool xdp_wait(xdp_inbox *box, int timeout)
+{
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while (__atomic_load_n(&box->head, __ATOMIC_SEQ_CST) == box->tail)
+    {
+        struct timespec left;
+        if (session_cancelled)
+        {
+            return false;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left.tv_sec = deadline.tv_sec - now.tv_sec;
+        left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+        if (left.tv_nsec < 0)
+        {
+            left.tv_sec--;
+            left.tv_nsec += 1000000000;
+        }
+        if (timeout >= 0 && left.tv_sec < 0)
+        {
+            return false;
+        }
+        // The pump wakes the session only if it sees the flag, the head is checked again after the flag is set
+        __atomic_store_n(&box->waiting, 1, __ATOMIC_SEQ_CST);
+        uint32_t head = __atomic_load_n(&box->head, __ATOMIC_SEQ_CST);
+        if (head == box->tail)
+        {
+            syscall(SYS_futex, &box->head, FUTEX_WAIT, head, timeout >= 0 ? &left : NULL, NULL, 0);
+        }
+        __atomic_store_n(&box->waiting, 0, __ATOMIC_SEQ_CST);
+    }
+    return true;
+}
+
+/**
+ * @brief Locks the frames to be sent, the lock is held only while one frame is queued
+ */
+static void xdp_lock()
+{
+    while (__atomic_test_and_set(&shared->lock, __ATOMIC_ACQUIRE))
+    {
+        sched_yield();
+    }
+}
+
+/**
+ * @brief Unlocks the frames to be sent
+ */
+static void xdp_unlock()
+{
+    __atomic_clear(&shared->lock, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Returns the frames the kernel already sent to the free frames, the lock is held
+ */
+static void xdp_reclaim()
+{
+    uint32_t prod = __atomic_load_n(comp.producer, __ATOMIC_ACQUIRE);
+    uint32_t cons = *comp.consumer;
+    for (; cons != prod; cons++)
+    {
+        shared->free[shared->free_count++] = ((uint64_t *)comp.ring)[cons & comp.mask];
+    }
+    __atomic_store_n(comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Makes the kernel send the queued frames of all the sessions
+ */
+static void xdp_kick()
+{
+    for (int i = 0; i < XDP_RING / XDP_BATCH && __atomic_load_n(tx.consumer, __ATOMIC_ACQUIRE) != __atomic_load_n(tx.producer, __ATOMIC_ACQUIRE);
+         i++)
+    {
+        if (sendto(xsk, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Computes the checksum of the IP header
+ * @param data Header
+ * @param len Length of the header
+ * @return Checksum
+ */
+static uint16_t xdp_checksum(void *data, size_t len)
+{
+    uint32_t sum = 0;
+    uint16_t *word = data;
+    for (; len > 1; len -= 2)
+    {
+        sum += *word++;
+    }
+    while (sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+/**
+ * @brief Sends the datagram of the session as a frame, the other sockets and the datagram that finds no free frame go through the kernel
+ * @return Number of bytes sent, -1 on error
+ */
+static ssize_t xdp_sendto(int socket, const void *buf, size_t len, int flags, const struct sockaddr *address, socklen_t alen)
+{
+    if (session_socket < 0 || socket != session_socket || len > XDP_FRAME - XDP_HEADERS || address->sa_family != AF_INET)
+    {
+        return sendto(socket, buf, len, flags, address, alen);
+    }
+    xdp_lock();
+    xdp_reclaim();
+    if (shared->free_count == 0)
+    {
+        xdp_unlock();
+        xdp_kick();
+        xdp_lock();
+        xdp_reclaim();
+    }
+    if (shared->free_count == 0)
+    {
+        xdp_unlock();
+        xdp_kernel++;
+        return sendto(socket, buf, len, flags, address, alen);
+    }
+    uint64_t addr = shared->free[--shared->free_count];
+    uint8_t *frame = umem + addr;
+    struct ethhdr *eth = (struct ethhdr *)frame;
+    struct iphdr *ip = (struct iphdr *)(frame + ETH_HLEN);
+    struct udphdr *udp = (struct udphdr *)(ip + 1);
+    memcpy(eth->h_dest, origin.peer_mac, ETH_ALEN);
+    memcpy(eth->h_source, origin.local_mac, ETH_ALEN);
+    eth->h_proto = htons(ETH_P_IP);
+    memset(ip, 0, sizeof(*ip));
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tot_len = htons(sizeof(*ip) + sizeof(*udp) + len);
+    ip->frag_off = htons(0x4000);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr = origin.to.s_addr;
+    ip->daddr = ((struct sockaddr_in *)address)->sin_addr.s_addr;
+    ip->check = xdp_checksum(ip, sizeof(*ip));
+    // UDP checksum is optional in IPv4, the frames are covered by the checksum of the link
+    udp->source = session_port;
+    udp->dest = ((struct sockaddr_in *)address)->sin_port;
+    udp->len = htons(sizeof(*udp) + len);
+    udp->check = 0;
+    memcpy(udp + 1, buf, len);
+    uint32_t prod = *tx.producer;
+    struct xdp_desc *d = &((struct xdp_desc *)tx.ring)[prod & tx.mask];
+    d->addr = addr;
+    d->len = XDP_HEADERS + len;
+    d->options = 0;
+    __atomic_store_n(tx.producer, prod + 1, __ATOMIC_RELEASE);
+    bool kick = prod + 1 - __atomic_load_n(tx.consumer, __ATOMIC_ACQUIRE) >= XDP_BATCH;
+    xdp_unlock();
+    xdp_sent++;
+    if (kick)
+    {
+        xdp_kick();
+    }
+    return len;
+}
+
+/**
+ * @brief Receives the datagram of the session from its inbox. The main process takes the request from its inbox
+ *        whenever its event is readable, otherwise it receives from the server socket.
+ * @return Number of bytes received, -1 with errno EAGAIN if nothing arrived in time or EINTR if the session was cancelled
+ */
+static ssize_t xdp_recvfrom(int socket, void *buf, size_t len, int flags, struct sockaddr *address, socklen_t *alen)
+{
+    xdp_inbox *box;
+    if (session_socket >= 0 && socket == session_socket)
+    {
+        box = &shared->inboxes[session_index];
+        xdp_kick();
+        if (!xdp_wait(box, flags & MSG_DONTWAIT ? 0 : session_timeout))
+        {
+            errno = session_cancelled ? EINTR : EAGAIN;
+            return -1;
+        }
+        xdp_received++;
+    }
+    else if (socket == server_socket)
+    {
+        uint64_t count;
+        box = &shared->inboxes[SESSION_SLOTS];
+        xdp_request = read(xdp_event, &count, sizeof(count)) == sizeof(count);
+        if (!xdp_request)
+        {
+            return recvfrom(socket, buf, len, flags, address, alen);
+        }
+        if (__atomic_load_n(&box->head, __ATOMIC_ACQUIRE) == box->tail)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    else
+    {
+        return recvfrom(socket, buf, len, flags, address, alen);
+    }
+    xdp_packet *p = &box->packets[box->tail % XDP_INBOX];
+    size_t n = p->len < len ? p->len : len;
+    memcpy(buf, p->data, n);
+    if (address != NULL)
+    {
+        memcpy(address, &p->from, *alen < sizeof(p->from) ? *alen : sizeof(p->from));
+        *alen = sizeof(p->from);
+    }
+    if (socket == server_socket)
+    {
+        // Session forked for the request answers from the addresses the request was sent to
+        memcpy(&origin, p, offsetof(xdp_packet, data));
+    }
+    __atomic_store_n(&box->tail, box->tail + 1, __ATOMIC_RELEASE);
+    return n;
+}
+
+/**
+ * @brief Waits for the datagram of the session, the other sockets are polled by the kernel
+ * @return 1 if the datagram arrived, 0 on timeout, -1 with errno EINTR if the session was cancelled
+ */
+static int xdp_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    if (session_socket < 0 || nfds != 1 || fds[0].fd != session_socket)
+    {
+        return poll(fds, nfds, timeout);
+    }
+    xdp_kick();
+    fds[0].revents = xdp_wait(&shared->inboxes[session_index], timeout) ? POLLIN : 0;
+    if (!fds[0].revents && session_cancelled)
+    {
+        errno = EINTR;
+        return -1;
+    }
+    return fds[0].revents ? 1 : 0;
+}
+
+/**
+ * @brief Releases everything the failed start of the engine created, the server then uses only the sockets
+ * @param fds Descriptors of the maps, the program and the link
+ * @param count Number of the descriptors
+ */
+static void xdp_close(int *fds, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (fds[i] >= 0)
+        {
+            close(fds[i]);
+        }
+    }
+    if (xsk >= 0)
+    {
+        close(xsk);
+        xsk = -1;
+    }
+    if (xdp_event >= 0)
+    {
+        close(xdp_event);
+        xdp_event = -1;
+    }
+    if (umem != NULL)
+    {
+        munmap(umem, (size_t)XDP_FRAMES * XDP_FRAME);
+        umem = NULL;
+    }
+    if (shared != NULL)
+    {
+        munmap(shared, sizeof(*shared));
+        shared = NULL;
+    }
+    ports_map = -1;
+}
+
+/**
+ * @brief Starts the engine on the interface, the requests to the server port that arrive through the interface
+ *        are then received by the engine and their sessions send and receive through it
+ * @param ifname Name of the interface
+ * @param server Bound server socket
+ * @return True if the engine runs, false if the interface, the kernel or the permissions do not allow it
+ */
+bool xdp_open(char *ifname, int server)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    struct ifreq ifr;
+    unsigned ifindex = if_nametoindex(ifname);
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    if (ifindex == 0 || xdp_queues(ifname) != 1 || getsockname(server, (struct sockaddr *)&addr, &len) < 0 || ioctl(server, SIOCGIFMTU, &ifr) < 0)
+    {
+        return false;
+    }
+    // Received frame keeps the headroom of the kernel, the block must fit into the rest of it
+    int mtu = ifr.ifr_mtu < (int)(XDP_PAYLOAD + sizeof(struct iphdr) + sizeof(struct udphdr)) ? ifr.ifr_mtu
+                                                                                               : (int)(XDP_PAYLOAD + sizeof(struct iphdr) + sizeof(struct udphdr));
+    xdp_block = mtu - sizeof(struct iphdr) - sizeof(struct udphdr) - 4;
+    // prog, xsks, ports, link
+    int fds[4] = {-1, -1, -1, -1};
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    umem = mmap(NULL, (size_t)XDP_FRAMES * XDP_FRAME, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    shared = shared == MAP_FAILED ? NULL : shared;
+    umem = umem == MAP_FAILED ? NULL : umem;
+    xdp_event = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK);
+    char *mode = NULL;
+    bool ok = shared != NULL && umem != NULL && xdp_event >= 0 && xdp_socket(ifindex);
+    ok = ok && (fds[1] = xdp_map_create(BPF_MAP_TYPE_XSKMAP, 1)) >= 0 && xdp_map_set(fds[1], 0, xsk);
+    ok = ok && (fds[2] = ports_map = xdp_map_create(BPF_MAP_TYPE_ARRAY, 65536)) >= 0 && xdp_port(ntohs(addr.sin_port), true);
+    ok = ok && (fds[0] = xdp_program(fds[1])) >= 0 && (fds[3] = xdp_attach(fds[0], ifindex, &mode)) >= 0;
+    if (!ok)
+    {
+        xdp_close(fds, 4);
+        return false;
+    }
+    shared->ports[ntohs(addr.sin_port)] = SESSION_SLOTS + 1;
+    server_socket = server;
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        xdp_pump(parent);
+    }
+    if (pid < 0)
+    {
+        xdp_close(fds, 4);
+        server_socket = -1;
+        return false;
+    }
+    // Link keeps the program and the maps, it stays open in the processes of the server
+    close(fds[0]);
+    close(fds[1]);
+    engine_sendto = xdp_sendto;
+    engine_recvfrom = xdp_recvfrom;
+    engine_poll = xdp_poll;
+    printf("XDP %s %s mode, blocks up to %d bytes\n", ifname, mode, xdp_block);
+    fflush(stdout);
+    return true;
+}
+
+/**
+ * @brief Moves the session to the engine if its request arrived through it. The session has its own port,
+ *        so the port is added to the port map and the datagrams of the port go to the inbox of the session.
+ *        Every session process calls it, the server socket it inherited is closed and its number could be reused.
+ * @param socket Socket of the session with its receive timeout set
+ */
+void xdp_session(int socket)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    struct timeval tv;
+    socklen_t tlen = sizeof(tv);
+    // Socket of the session must not take the requests from the inbox of the main process
+    server_socket = -1;
+    if (!xdp_request || shared == NULL || session_index < 0 || getsockname(socket, (struct sockaddr *)&addr, &len) < 0)
+    {
+        xdp_request = false;
+        return;
+    }
+    if (addr.sin_port == 0)
+    {
+        // Socket gets its port from the first datagram sent through the kernel, the engine needs it before
+        struct sockaddr_in any = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY)};
+        if (bind(socket, (struct sockaddr *)&any, sizeof(any)) < 0 || getsockname(socket, (struct sockaddr *)&addr, &len) < 0)
+        {
+            xdp_request = false;
+            return;
+        }
+    }
+    session_timeout = getsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, &tlen) == 0 && (tv.tv_sec || tv.tv_usec) ? tv.tv_sec * 1000 + tv.tv_usec / 1000 : -1;
+    uint16_t port = ntohs(addr.sin_port);
+    uint16_t stale = shared->slot_ports[session_index];
+    if (stale != 0 && __atomic_load_n(&shared->ports[stale], __ATOMIC_ACQUIRE) == session_index + 1)
+    {
+        // Port of the session of this slot that ended without releasing it
+        __atomic_store_n(&shared->ports[stale], 0, __ATOMIC_RELEASE);
+        xdp_port(stale, false);
+    }
+    xdp_inbox *box = &shared->inboxes[session_index];
+    __atomic_store_n(&box->tail, __atomic_load_n(&box->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    shared->slot_ports[session_index] = port;
+    __atomic_store_n(&shared->ports[port], session_index + 1, __ATOMIC_RELEASE);
+    if (!xdp_port(port, true))
+    {
+        __atomic_store_n(&shared->ports[port], 0, __ATOMIC_RELEASE);
+        shared->slot_ports[session_index] = 0;
+        xdp_request = false;
+        return;
+    }
+    session_socket = socket;
+    session_port = addr.sin_port;
+}
+
+/**
+ * @brief Sends the frames the session queued and gives its port back to the kernel, also after the session was cancelled
+ */
+void xdp_session_end()
+{
+    if (session_socket < 0)
+    {
+        return;
+    }
+    xdp_kick();
+    uint16_t port = ntohs(session_port);
+    xdp_port(port, false);
+    if (__atomic_load_n(&shared->ports[port], __ATOMIC_ACQUIRE) == session_index + 1)
+    {
+        __atomic_store_n(&shared->ports[port], 0, __ATOMIC_RELEASE);
+    }
+    shared->slot_ports[session_index] = 0;
+    session_socket = -1;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file xdp.h
+ * @author Samuel Cus (xcussa00@fit.vutbr.cz)
+ * @brief  ISA Project
+ * @date 2026-10-19
+ */
+#ifndef XDP_H
+#define XDP_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Frames of the UMEM, the first half is received into, the second half is sent from */
+#define XDP_FRAME 2048
+#define XDP_FRAMES 4096
+#define XDP_RING 2048
+
+/* Datagrams waiting in the inbox of one session, the newer ones are dropped like from the full socket buffer */
+#define XDP_INBOX 64
+
+/* Largest received datagram, the kernel keeps 256 bytes of headroom in every received frame */
+#define XDP_PAYLOAD (XDP_FRAME - 256 - 42)
+
+/* Frames queued for sending before the kernel is kicked, the session kicks it also before it waits */
+#define XDP_BATCH 32
+
+/* Event of the main server process, it becomes readable for every request that arrived through the engine, -1 without the engine */
+extern int xdp_event;
+
+/* True in the session whose request arrived through the engine, its datagrams then bypass the UDP stack */
+extern bool xdp_request;
+
+/* Largest block that fits into one frame of the interface */
+extern int xdp_block;
+
+/* Datagrams the session sent and received through the engine and sent through the socket when no frame was free */
+extern unsigned long xdp_sent;
+extern unsigned long xdp_received;
+extern unsigned long xdp_kernel;
+
+bool xdp_open(char *ifname, int server_socket);
+
+void xdp_session(int socket);
+
+void xdp_session_end();
+
+#endif